@@ -40,6 +40,8 @@ extern "C" {
 
 typedef struct LLConfig LLConfig;
 
+typedef size_t(* RellumeMemAccessCb)(size_t, uint8_t*, size_t, void*);
+
 RELLUME_API LLConfig* ll_config_new(void);
 RELLUME_API void ll_config_free(LLConfig*);
 
@@ -47,22 +49,108 @@ RELLUME_API void ll_config_free(LLConfig*);
 /// convention. Deprecated: avoid using the HHVM calling convention.
 RELLUME_API void ll_config_set_hhvm(LLConfig*, bool) RELLUME_DEPRECATED;
 RELLUME_API void ll_config_set_sptr_addrspace(LLConfig*, unsigned);
+/// Pass the registers at the given CPU struct offsets (general purpose
+/// registers or the instruction pointer) as i64 parameters after the CPU
+/// struct pointer and return them in a struct of i64, in the given order. All
+/// other registers are still passed in the CPU struct. The architecture must be
+/// set before, as this replaces its default calling convention. Returns false
+/// if an offset does not refer to a suitable register.
+RELLUME_API bool ll_config_set_reg_callconv(LLConfig*, size_t count,
+                                            const size_t* offsets);
+
+/// Location of a CPU struct entry in a custom layout. The entry is identified
+/// by its offset in the default layout; size must match its default size.
+typedef struct LLCpuStructEntry {
+    size_t default_offset;
+    size_t offset;
+    size_t size;
+} LLCpuStructEntry;
+/// Use a custom CPU struct layout, e.g. the state struct of an emulator, so
+/// that lifted functions access it directly. Entries must be naturally
+/// aligned, so the struct must be aligned to the size of its largest entry.
+/// Entries not in the layout are undefined at function entry and not
+/// stored anywhere. The architecture must be set before. Passing no entries
+/// restores the default layout. Returns false and leaves the configuration
+/// unchanged if an entry is invalid.
+RELLUME_API bool ll_config_set_cpu_struct_layout(LLConfig*, size_t count,
+                                                 const LLCpuStructEntry* entries);
 RELLUME_API void ll_config_enable_overflow_intrinsics(LLConfig*, bool);
 RELLUME_API void ll_config_enable_fast_math(LLConfig*, bool);
 RELLUME_API void ll_config_enable_verify_ir(LLConfig*, bool);
+/// Move stack slots below the stack pointer at function entry into an alloca,
+/// if they are only accessed at constant offsets and their address does not
+/// escape. The frame is written back to memory at exits. Only functions
+/// without calls (apart from tail calls at exits) are supported. The stack
+/// pointer must be loaded from the CPU struct at entry, so nothing is promoted
+/// if it is passed as parameter (ll_config_set_reg_callconv), set with
+/// ll_config_set_reg_constant or missing from a custom CPU struct layout.
+RELLUME_API void ll_config_enable_stack_promotion(LLConfig*, bool);
+/// Assert that guest memory accesses never alias the CPU struct. Accesses get
+/// alias scope metadata, so that loads and stores can be moved across each
+/// other, e.g. out of loops.
+RELLUME_API void ll_config_enable_cpu_struct_noalias(LLConfig*, bool);
 RELLUME_API void ll_config_set_position_independent_code(LLConfig*, bool);
 RELLUME_API void ll_config_set_pc_base(LLConfig*, uintptr_t, LLVMValueRef);
 RELLUME_API void ll_config_set_global_base(LLConfig*, uintptr_t, LLVMValueRef);
+/// Assume that the integer register with the given name (e.g., "rdi") has a
+/// constant value at function entry. The architecture must be set before.
+/// Returns false if there is no such register.
+RELLUME_API bool ll_config_set_reg_constant(LLConfig*, const char* reg,
+                                            uint64_t value);
+/// Declare size bytes at the given address as read-only memory with the given
+/// contents, which are copied. Loads from constant addresses within one such
+/// range are folded into constants. Ranges must not overlap.
+RELLUME_API void ll_config_add_const_memory(LLConfig*, uintptr_t addr,
+                                            size_t size, const void* bytes);
+/// Set a callback for reading read-only memory (e.g., .rodata or a GOT after
+/// relocation) outside of the constant memory ranges. The callback returns
+/// the number of bytes copied, which must be less than requested if the range
+/// is not entirely immutable. For batch lifting, it must be thread-safe.
+RELLUME_API void ll_config_set_const_memory_cb(LLConfig*, RellumeMemAccessCb,
+                                               void* user_arg);
+/// Represent the guest data section at addr with the given global: constant
+/// addresses inside the section become a byte offset from the global, which
+/// can have any type. Sections must not overlap.
+RELLUME_API void ll_config_add_data_section(LLConfig*, uintptr_t addr,
+                                            size_t size, LLVMValueRef global);
 RELLUME_API void ll_config_set_instr_impl(LLConfig*, unsigned,
                                           LLVMValueRef) RELLUME_DEPRECATED;
 RELLUME_API void ll_config_set_tail_func(LLConfig*, LLVMValueRef);
 RELLUME_API void ll_config_set_call_func(LLConfig*, LLVMValueRef);
+/// Register an already lifted function with the given entry address. Branches
+/// to this address are lifted as direct tail calls to the function, which must
+/// have the same signature as the functions lifted with this configuration.
+RELLUME_API void ll_config_add_known_function(LLConfig*, uintptr_t,
+                                              LLVMValueRef);
 RELLUME_API void ll_config_set_syscall_impl(LLConfig*, LLVMValueRef);
 RELLUME_API void ll_config_set_cpuinfo_func(LLConfig*, LLVMValueRef);
 RELLUME_API void ll_config_set_instr_marker(LLConfig*, LLVMValueRef);
+/// Set helper functions for REPNE SCASB and REPE CMPSB (e.g., memchr- or
+/// memcmp-like routines), which return the number of compared bytes. The
+/// signatures are i64(ptr %rdi, i8 %al, i64 %rcx) and
+/// i64(ptr %rsi, ptr %rdi, i64 %rcx). Comparison stops after the first byte
+/// equal to AL or the first mismatch, respectively.
+RELLUME_API void ll_config_set_repne_scasb_func(LLConfig*, LLVMValueRef);
+RELLUME_API void ll_config_set_repe_cmpsb_func(LLConfig*, LLVMValueRef);
 RELLUME_API void ll_config_set_call_ret_clobber_flags(LLConfig*, bool);
 RELLUME_API void ll_config_set_use_native_segment_base(LLConfig*, bool);
 RELLUME_API void ll_config_enable_full_facets(LLConfig*, bool);
+/// Set the registers live at function entry and after exits, identified by
+/// their offsets in the CPU struct. Other registers are not loaded at entry
+/// and not stored at exits, respectively. The architecture must be set before.
+/// Returns false and leaves the configuration unchanged if an offset does not
+/// refer to a register.
+RELLUME_API bool ll_config_set_live_in(LLConfig*, size_t count,
+                                       const size_t* offsets);
+RELLUME_API bool ll_config_set_live_out(LLConfig*, size_t count,
+                                        const size_t* offsets);
+/// Dispatch indirect branches and returns with unknown targets through a
+/// switch over all lifted blocks before leaving the function.
+RELLUME_API void ll_config_enable_indirect_branch_switch(LLConfig*, bool);
+/// Add a known (e.g., profiled) target of the indirect branch instruction at
+/// the given address. The target is decoded and dispatched to directly.
+RELLUME_API void ll_config_add_indirect_branch_target(LLConfig*, uintptr_t,
+                                                      uintptr_t);
 
 /// Sets the architecture. Currently the only valid options is "x86_64", which
 /// is also default, "rv64" and "aarch64". Return true, if the architecture is
@@ -82,7 +170,6 @@ RELLUME_API void ll_func_dispose(LLFunc*);
 RELLUME_API int ll_func_add_instr(LLFunc* func, uintptr_t block_addr,
                                   uintptr_t addr, size_t bufsz,
                                   const uint8_t* buf);
-typedef size_t(* RellumeMemAccessCb)(size_t, uint8_t*, size_t, void*);
 RELLUME_API int ll_func_decode_instr(LLFunc* func, uintptr_t addr,
                                      RellumeMemAccessCb cb, void* user_arg);
 RELLUME_API int ll_func_decode_block(LLFunc* func, uintptr_t addr,
@@ -90,6 +177,79 @@ RELLUME_API int ll_func_decode_block(LLFunc* func, uintptr_t addr,
 RELLUME_API int ll_func_decode_cfg(LLFunc* func, uintptr_t addr,
                                    RellumeMemAccessCb cb, void* user_arg);
 
+/// A contiguous region of guest memory starting at addr, which is mapped in
+/// the host at buf.
+typedef struct LLMemRegion {
+    uintptr_t addr;
+    const uint8_t* buf;
+    size_t size;
+} LLMemRegion;
+
+/// Like ll_func_decode_cfg, but read instructions directly from the given
+/// non-overlapping memory regions. The callback (if not NULL) is only used for
+/// addresses outside of the regions; otherwise, decoding stops there.
+RELLUME_API int ll_func_decode_cfg_range(LLFunc* func, uintptr_t addr,
+                                         size_t num_regions,
+                                         const LLMemRegion* regions,
+                                         RellumeMemAccessCb cb, void* user_arg);
+/// Decode all instructions in the memory regions (e.g., text sections) in a
+/// linear sweep into a single function with entry point addr. Blocks are split
+/// at all discovered branch targets; undecodable bytes are skipped. Branch
+/// targets outside of the regions are followed as in ll_func_decode_cfg_range.
+/// Indirect branches and returns with unknown targets are dispatched through a
+/// switch over all decoded blocks (see ll_config_enable_indirect_branch_switch),
+/// so that blocks only found by the sweep can be reached.
+RELLUME_API int ll_func_decode_linear(LLFunc* func, uintptr_t addr,
+                                      size_t num_regions,
+                                      const LLMemRegion* regions,
+                                      RellumeMemAccessCb cb, void* user_arg);
+
+/// Lift the functions starting at the count addresses in addrs in parallel
+/// with num_threads worker threads (0 to use all hardware threads) and link
+/// them into mod. Each worker lifts into its own LLVM context using a copy of
+/// the configuration, therefore all values referenced by the configuration
+/// must be named global values of mod without local linkage. The memory access
+/// callback (NULL to read the process memory) may be called concurrently. If
+/// fns is not NULL, it receives the lifted functions in the order of addrs, or
+/// NULL if decoding or lifting failed. Returns the number of functions that
+/// failed to lift.
+///
+/// Apart from this, an LLConfig and all LLFunc sharing an LLVM context must
+/// only be used by one thread at a time.
+RELLUME_API size_t ll_func_lift_batch(LLVMModuleRef mod, LLConfig* cfg,
+                                      size_t count, const uintptr_t* addrs,
+                                      RellumeMemAccessCb cb, void* user_arg,
+                                      unsigned num_threads, LLVMValueRef* fns);
+
+/// Create a function named name with the native signature fn_ty, which calls
+/// the lifted x86-64 function fn according to the System V ABI. The wrapper
+/// holds the CPU struct and a guest stack of stack_size bytes in allocas, so
+/// that after inlining fn, the CPU struct can be optimized away entirely. The
+/// instruction pointer is set to entry. fn must be lifted with the default
+/// calling convention and CPU struct layout. Parameters and the return value
+/// must be integers (up to 64 bit), pointers, float or double. Narrow integer
+/// parameters are zero-extended, unless they have the signext attribute: if
+/// the module already contains a declaration named name with type fn_ty, it
+/// becomes the wrapper and keeps its attributes. fn is marked alwaysinline.
+/// Returns NULL if fn or fn_ty is not supported.
+RELLUME_API LLVMValueRef ll_func_wrap_native(LLVMValueRef fn, LLVMTypeRef fn_ty,
+                                             uintptr_t entry, size_t stack_size,
+                                             const char* name);
+
+/// Statistics about the lifting of a function, for analyzing the performance
+/// of the lifter itself. Values are meaningful after ll_func_lift.
+typedef struct LLFuncStats {
+    /// Number of PHI nodes created during SSA construction.
+    uint64_t phis_created;
+    /// Number of PHI nodes removed again, because they were trivial or unused.
+    uint64_t phis_removed;
+    /// Number of flag computations omitted, because the flag is overwritten
+    /// before it is read (only with ll_func_decode_*).
+    uint64_t flags_skipped;
+} LLFuncStats;
+
+RELLUME_API void ll_func_get_stats(LLFunc* func, LLFuncStats* stats);
+
 #ifdef __cplusplus
 }
 #endif
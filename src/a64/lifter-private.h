@@ -95,9 +95,9 @@ private:
     llvm::Value* Addr(llvm::Type* elemty, farmdec::Reg base, farmdec::Reg off, uint32_t lsl);
     llvm::Value* Addr(llvm::Type* elemty, farmdec::Reg base, farmdec::Reg off, farmdec::ExtendType ext, uint32_t lsl);
 
-    void Load(farmdec::Reg rt, bool w32, llvm::Type* srcty, llvm::Value* ptr, farmdec::ExtendType ext, farmdec::MemOrdering mo = farmdec::MO_NONE);
-    void Load(farmdec::Reg rt, llvm::Type* srcty, llvm::Value* ptr, farmdec::MemOrdering mo = farmdec::MO_NONE);
-    void Store(llvm::Value* ptr, llvm::Value* val, farmdec::MemOrdering mo = farmdec::MO_NONE);
+    void Load(farmdec::Reg rt, bool w32, llvm::Type* srcty, llvm::Value* ptr, farmdec::ExtendType ext, farmdec::MemOrdering mo = farmdec::MO_NONE, bool nontemporal = false);
+    void Load(farmdec::Reg rt, llvm::Type* srcty, llvm::Value* ptr, farmdec::MemOrdering mo = farmdec::MO_NONE, bool nontemporal = false);
+    void Store(llvm::Value* ptr, llvm::Value* val, farmdec::MemOrdering mo = farmdec::MO_NONE, bool nontemporal = false);
 
     enum class BinOpKind : unsigned {
         SHIFT, EXT, IMM
@@ -105,7 +105,7 @@ private:
 
     void LiftBinOp(farmdec::Inst a64, bool w32, llvm::Instruction::BinaryOps op, BinOpKind kind, bool set_flags = false, bool invert_rhs = false);
     void LiftCCmp(llvm::Value* lhs, llvm::Value* rhs, farmdec::Cond cond, uint8_t nzcv, bool ccmn, bool fp = false);
-    void LiftLoadStore(farmdec::Inst a64, bool w32, bool fp = false);
+    void LiftLoadStore(farmdec::Inst a64, bool w32, bool fp = false, bool nontemporal = false);
 
     void FlagCalcFP(llvm::Value* lhs, llvm::Value* rhs);
     void LiftBinOpFP(llvm::Instruction::BinaryOps op, farmdec::FPSize prec, farmdec::Reg rd, farmdec::Reg rn, farmdec::Reg rm);
@@ -48,6 +48,12 @@ bool LiftInstruction(const Instr& inst, FunctionInfo& fi, const LLConfig& cfg,
 
 static uint64_t ones(int n);
 
+// The decoder does not distinguish LDNP/STNP from LDP/STP, so check the
+// encoding: load/store pair class (op0 = x0x1) with no-allocate offset.
+static bool IsNoAllocatePair(const Instr& inst) {
+    return (inst.a64_encoding() & 0x3b800000) == 0x28000000;
+}
+
 bool Lifter::Lift(const Instr& inst) {
     SetIP(inst.start()); // ARM PC points to current instruction.
 
@@ -269,7 +275,8 @@ bool Lifter::Lift(const Instr& inst) {
         switch (a64.imm) {
         case 0xde82: {// TPIDR_EL0
             unsigned idx = SptrIdx::aarch64::TPIDR_EL0;
-            irb.CreateStore(GetGp(a64.rt, /*w32=*/false), fi.sptr[idx]);
+            auto store = irb.CreateStore(GetGp(a64.rt, /*w32=*/false), fi.sptr[idx]);
+            fi.SetCpuAliasScope(store);
             break;
         }
         case 0xda10: {// NZCV (bits 31-28)
@@ -311,6 +318,7 @@ bool Lifter::Lift(const Instr& inst) {
         case 0xde82: {// TPIDR_EL0
             unsigned idx = SptrIdx::aarch64::TPIDR_EL0;
             auto res = irb.CreateLoad(irb.getInt64Ty(), fi.sptr[idx]);
+            fi.SetCpuAliasScope(res);
             SetGp(a64.rt, /*w32=*/false, res);
             break;
         }
@@ -700,7 +708,7 @@ bool Lifter::Lift(const Instr& inst) {
     case farmdec::A64_STP:
     case farmdec::A64_LDR:
     case farmdec::A64_STR:
-        LiftLoadStore(a64, w32);
+        LiftLoadStore(a64, w32, /*fp=*/false, IsNoAllocatePair(inst));
         break;
     case farmdec::A64_PRFM: {
         auto addr = Addr(irb.getInt8Ty(), a64); // i8*
@@ -721,6 +729,8 @@ bool Lifter::Lift(const Instr& inst) {
         }
 
         int locality = 3 - ((prfop>>1) & 3); // 3 - target
+        if (prfop & 1) // STRM: streaming, the data is used only once
+            locality = 0;
 
         llvm::SmallVector<llvm::Type*, 1> tys;
         tys.push_back(irb.getInt8PtrTy());
@@ -733,7 +743,7 @@ bool Lifter::Lift(const Instr& inst) {
     case farmdec::A64_STP_FP:
     case farmdec::A64_LDR_FP:
     case farmdec::A64_STR_FP:
-        LiftLoadStore(a64, w32, /*fp=*/true);
+        LiftLoadStore(a64, w32, /*fp=*/true, IsNoAllocatePair(inst));
         break;
     case farmdec::A64_FCVT_GPR: {
         auto fp = GetScalar(a64.rn, fad_get_prec(a64.flags));
@@ -1342,8 +1352,18 @@ void Lifter::LiftCCmp(llvm::Value* lhs, llvm::Value* rhs, farmdec::Cond cond, ui
 // Given a pointer ptr = *T, load a T value, extend it according to ext and put it in rt.
 void Lifter::Load(farmdec::Reg rt, bool w32, llvm::Type* srcty,
                   llvm::Value* ptr, farmdec::ExtendType ext,
-                  farmdec::MemOrdering mo) {
+                  farmdec::MemOrdering mo, bool nontemporal) {
+    if (mo == farmdec::MO_NONE) {
+        if (llvm::Constant* const_val = ConstLoad(srcty, ptr)) {
+            SetGp(rt, w32, Extend(const_val, w32, ext, 0));
+            return;
+        }
+    }
+
     llvm::LoadInst* load = irb.CreateAlignedLoad(srcty, ptr, llvm::Align(1));
+    fi.SetGuestAliasScope(load);
+    if (nontemporal)
+        SetNonTemporal(load);
     if (mo != farmdec::MO_NONE) {
         load->setOrdering(Ordering(mo));
         load->setAlignment(llvm::Align(srcty->getPrimitiveSizeInBits() / 8));
@@ -1353,8 +1373,18 @@ void Lifter::Load(farmdec::Reg rt, bool w32, llvm::Type* srcty,
 }
 
 // Loads into the SIMD&FP register Vt.
-void Lifter::Load(farmdec::Reg rt, llvm::Type* srcty, llvm::Value* ptr, farmdec::MemOrdering mo) {
+void Lifter::Load(farmdec::Reg rt, llvm::Type* srcty, llvm::Value* ptr, farmdec::MemOrdering mo, bool nontemporal) {
+    if (mo == farmdec::MO_NONE) {
+        if (llvm::Constant* const_val = ConstLoad(srcty, ptr)) {
+            SetScalar(rt, const_val);
+            return;
+        }
+    }
+
     llvm::LoadInst* load = irb.CreateAlignedLoad(srcty, ptr, llvm::Align(1));
+    fi.SetGuestAliasScope(load);
+    if (nontemporal)
+        SetNonTemporal(load);
     if (mo != farmdec::MO_NONE) {
         load->setOrdering(Ordering(mo));
         load->setAlignment(llvm::Align(srcty->getPrimitiveSizeInBits() / 8));
@@ -1364,8 +1394,11 @@ void Lifter::Load(farmdec::Reg rt, llvm::Type* srcty, llvm::Value* ptr, farmdec:
 }
 
 // Given a pointer ptr = *T, store the value val, which is truncated appropriately.
-void Lifter::Store(llvm::Value* ptr, llvm::Value* val, farmdec::MemOrdering mo) {
+void Lifter::Store(llvm::Value* ptr, llvm::Value* val, farmdec::MemOrdering mo, bool nontemporal) {
     llvm::StoreInst* store = irb.CreateStore(val, ptr);
+    fi.SetGuestAliasScope(store);
+    if (nontemporal)
+        SetNonTemporal(store);
     if (mo != farmdec::MO_NONE) {
         store->setOrdering(Ordering(mo));
         store->setAlignment(llvm::Align(val->getType()->getPrimitiveSizeInBits() / 8));
@@ -1375,7 +1408,7 @@ void Lifter::Store(llvm::Value* ptr, llvm::Value* val, farmdec::MemOrdering mo)
 }
 
 // (The w32 flag is passed for convenience and is ignored if fp=true.)
-void Lifter::LiftLoadStore(farmdec::Inst a64, bool w32, bool fp) {
+void Lifter::LiftLoadStore(farmdec::Inst a64, bool w32, bool fp, bool nontemporal) {
     farmdec::AddrMode mode = fad_get_addrmode(a64.flags);
     farmdec::ExtendType ext = fad_get_mem_extend(a64.flags); // General load/stores
     farmdec::FPSize fsz = fad_get_prec(a64.flags);           // FP load/stores
@@ -1402,34 +1435,34 @@ void Lifter::LiftLoadStore(farmdec::Inst a64, bool w32, bool fp) {
 
     case farmdec::A64_LDP:
     case farmdec::A64_LDXP: // TODO: exclusive access
-        Load(a64.rt2, w32, memty, irb.CreateConstGEP1_64(memty, ptr, 1), ext, mo);
+        Load(a64.rt2, w32, memty, irb.CreateConstGEP1_64(memty, ptr, 1), ext, mo, nontemporal);
         /* fallthrough */
     case farmdec::A64_LDR:
     case farmdec::A64_LDXR: // TODO: exclusive access
-        Load(a64.rt, w32, memty, ptr, ext, mo);
+        Load(a64.rt, w32, memty, ptr, ext, mo, nontemporal);
         break;
 
     case farmdec::A64_STP:
     case farmdec::A64_STXP: // TODO: exclusive access
-        Store(irb.CreateConstGEP1_64(memty, ptr, 1), irb.CreateTruncOrBitCast(GetGp(a64.rt2, w32), memty), mo);
+        Store(irb.CreateConstGEP1_64(memty, ptr, 1), irb.CreateTruncOrBitCast(GetGp(a64.rt2, w32), memty), mo, nontemporal);
         /* fallthrough */
     case farmdec::A64_STR:
     case farmdec::A64_STXR: // TODO: exclusive access
-        Store(ptr, irb.CreateTruncOrBitCast(GetGp(a64.rt, w32), memty), mo);
+        Store(ptr, irb.CreateTruncOrBitCast(GetGp(a64.rt, w32), memty), mo, nontemporal);
         break;
 
     case farmdec::A64_LDP_FP:
-        Load(a64.rt2, memty, irb.CreateConstGEP1_64(memty, ptr, 1), mo);
+        Load(a64.rt2, memty, irb.CreateConstGEP1_64(memty, ptr, 1), mo, nontemporal);
         /* fallthrough */
     case farmdec::A64_LDR_FP:
-        Load(a64.rt, memty, ptr, mo);
+        Load(a64.rt, memty, ptr, mo, nontemporal);
         break;
 
     case farmdec::A64_STP_FP:
-        Store(irb.CreateConstGEP1_64(memty, ptr, 1), GetScalar(a64.rt2, fsz), mo);
+        Store(irb.CreateConstGEP1_64(memty, ptr, 1), GetScalar(a64.rt2, fsz), mo, nontemporal);
         /* fallthrough */
     case farmdec::A64_STR_FP:
-        Store(ptr, GetScalar(a64.rt, fsz), mo);
+        Store(ptr, GetScalar(a64.rt, fsz), mo, nontemporal);
         break;
     }
 }
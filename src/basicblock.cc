@@ -25,7 +25,10 @@
 
 #include "facet.h"
 #include "regfile.h"
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/SmallVector.h>
 #include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/CFG.h>
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/Intrinsics.h>
@@ -34,6 +37,7 @@
 #include <cstdio>
 #include <deque>
 #include <set>
+#include <tuple>
 #include <vector>
 
 
@@ -47,21 +51,101 @@
 
 namespace rellume {
 
-BasicBlock::BasicBlock(llvm::Function* fn, Phis phi_mode, Arch arch)
-        : regfile(arch) {
+llvm::Value* PhiTracker::Resolve(llvm::Value* value) const {
+    while (auto* phi = llvm::dyn_cast<llvm::PHINode>(value)) {
+        auto it = replaced.find(phi);
+        if (it == replaced.end())
+            break;
+        value = it->second;
+    }
+    return value;
+}
+
+llvm::Value* PhiTracker::TryRemoveTrivial(llvm::PHINode* phi) {
+    llvm::Value* same = nullptr;
+    for (llvm::Value* value : phi->incoming_values()) {
+        if (value == same || value == phi)
+            continue;
+        if (same)
+            return phi; // The PHI merges at least two values.
+        same = value;
+    }
+    // The PHI is unreachable or only references itself.
+    if (!same)
+        same = llvm::UndefValue::get(phi->getType());
+
+    llvm::SmallVector<llvm::PHINode*, 8> phi_users;
+    for (llvm::User* user : phi->users())
+        if (auto* user_phi = llvm::dyn_cast<llvm::PHINode>(user))
+            if (user_phi != phi)
+                phi_users.push_back(user_phi);
+
+    phi->replaceAllUsesWith(same);
+    replaced[phi] = same;
+    num_removed++;
+
+    // Users might have become trivial now. Skip PHIs which are still being
+    // constructed, these are handled once all their operands are known.
+    for (llvm::PHINode* user_phi : phi_users) {
+        unsigned num_preds = llvm::pred_size(user_phi->getParent());
+        if (!IsRemoved(user_phi) && user_phi->getNumIncomingValues() == num_preds)
+            TryRemoveTrivial(user_phi);
+    }
+
+    return Resolve(same);
+}
+
+void PhiTracker::Finalize() {
+    for (llvm::PHINode* phi : phis) {
+        if (!IsRemoved(phi))
+            continue;
+        // Uses can be added after the replacement, e.g. by register files.
+        phi->replaceAllUsesWith(Resolve(phi));
+        phi->eraseFromParent();
+    }
+
+    // Erase PHIs which ended up without users, e.g. when only a removed PHI
+    // used them. Unused PHIs are not erased earlier, as register files might
+    // still refer to them.
+    llvm::SmallPtrSet<llvm::PHINode*, 32> erased;
+    llvm::SmallVector<llvm::PHINode*, 32> worklist;
+    for (llvm::PHINode* phi : phis)
+        if (!IsRemoved(phi))
+            worklist.push_back(phi);
+    while (!worklist.empty()) {
+        llvm::PHINode* phi = worklist.pop_back_val();
+        if (erased.count(phi) || !phi->use_empty())
+            continue;
+        for (llvm::Value* value : phi->incoming_values())
+            if (auto* op_phi = llvm::dyn_cast<llvm::PHINode>(value))
+                if (op_phi != phi)
+                    worklist.push_back(op_phi);
+        phi->eraseFromParent();
+        erased.insert(phi);
+        num_removed++;
+    }
+
+    phis.clear();
+    replaced.clear();
+}
+
+BasicBlock::BasicBlock(llvm::Function* fn, Phis phi_mode, Arch arch,
+                       PhiTracker& phi_tracker, BlockArena& arena)
+        : regfile(arch, arena.raw), phi_tracker(phi_tracker), sealed(false) {
     llvm_block = llvm::BasicBlock::Create(fn->getContext(), "", fn, nullptr);
     regfile.SetInsertBlock(llvm_block);
 
     if (phi_mode != Phis::NONE) {
-        // Initialize all registers with a generator which adds a PHI node when
-        // the value-facet combination is requested.
-        empty_phis.reserve(32);
-        regfile.InitWithPHIs(&empty_phis, /*all=*/phi_mode == Phis::ALL);
+        // Initialize all registers with a generator which looks up the value
+        // in the predecessors when the value-facet combination is requested.
+        regfile.InitWithGenerator(ReadRegGenerator, this,
+                                  /*all=*/phi_mode == Phis::ALL);
     }
 }
 
 void BasicBlock::BranchTo(BasicBlock& next) {
     assert(!llvm_block->getTerminator() && "attempting to add second terminator");
+    assert(!next.sealed && "attempting to add predecessor to sealed block");
 
     llvm::IRBuilder<> irb(llvm_block);
     irb.CreateBr(next.llvm_block);
@@ -78,6 +162,8 @@ void BasicBlock::BranchTo(llvm::Value* cond, BasicBlock& then,
     }
 
     assert(!llvm_block->getTerminator() && "attempting to add second terminator");
+    assert(!then.sealed && !other.sealed &&
+           "attempting to add predecessor to sealed block");
 
     llvm::IRBuilder<> irb(llvm_block);
     irb.CreateCondBr(cond, then.llvm_block, other.llvm_block);
@@ -87,31 +173,123 @@ void BasicBlock::BranchTo(llvm::Value* cond, BasicBlock& then,
     successors.push_back(&other);
 }
 
-bool BasicBlock::FillPhis() {
-    if (empty_phis.empty())
-        return false;
-
-    for (const auto& [reg, facet, phi] : empty_phis) {
-        // This makes use of the property that a RegFile will never store a PHI
-        // node using SetReg. Otherwise things will blow up, because the
-        // register file may still have a reference to the (currently) unused
-        // PHI node.
-        if (phi->user_empty()) {
-            phi->eraseFromParent();
-            continue;
+void BasicBlock::SwitchTo(llvm::Value* val, BasicBlock& def,
+        llvm::ArrayRef<std::pair<llvm::ConstantInt*, BasicBlock*>> cases) {
+    assert(!llvm_block->getTerminator() && "attempting to add second terminator");
+    assert(!def.sealed && "attempting to add predecessor to sealed block");
+
+    llvm::IRBuilder<> irb(llvm_block);
+    llvm::SwitchInst* inst = irb.CreateSwitch(val, def.llvm_block, cases.size());
+    def.predecessors.push_back(this);
+    successors.push_back(&def);
+    for (const auto& [case_val, block] : cases) {
+        assert(!block->sealed && "attempting to add predecessor to sealed block");
+        inst->addCase(case_val, block->llvm_block);
+        // PHI nodes need one entry per edge.
+        block->predecessors.push_back(this);
+        successors.push_back(block);
+    }
+}
+
+llvm::PHINode* BasicBlock::CreatePhi(Facet facet) {
+    llvm::IRBuilder<> irb(llvm_block, llvm_block->begin());
+    llvm::PHINode* phi = irb.CreatePHI(facet.Type(irb.getContext()), 4);
+    phi_tracker.Add(phi);
+    return phi;
+}
+
+llvm::Value* BasicBlock::ReadRegGenerator(ArchReg reg, Facet facet,
+                                          llvm::BasicBlock*, void* bb) {
+    return static_cast<BasicBlock*>(bb)->ReadPredecessorReg(reg, facet);
+}
+
+llvm::Value* BasicBlock::ReadPredecessorReg(ArchReg reg, Facet facet) {
+    if (!sealed) {
+        // Not all predecessors are known yet, so add operands later.
+        llvm::PHINode* phi = CreatePhi(facet);
+        incomplete_phis.push_back(std::make_tuple(reg, facet, phi));
+        return phi;
+    }
+
+    // A lookup through a cycle ends up here again. Use the PHI if there is
+    // one; a block with a single predecessor is passed once more, so that the
+    // lookup continues to the PHI of a block with multiple predecessors on the
+    // cycle, e.g. the loop header. Only a cycle without such a block, which
+    // is unreachable, comes here a third time and leaves the value undefined.
+    unsigned visits = 0;
+    for (const auto& [pending_reg, pending_facet, pending_phi] : pending_phis) {
+        if (pending_reg == reg && pending_facet == facet) {
+            if (pending_phi)
+                return pending_phi;
+            visits++;
         }
-        for (BasicBlock* pred : predecessors) {
-            llvm::Value* value = pred->regfile.GetReg(reg, facet);
-            if (facet == Facet::PTR && value->getType() != phi->getType()) {
-                llvm::IRBuilder<> irb(pred->llvm_block->getTerminator());
-                value = irb.CreatePointerCast(value, phi->getType());
-            }
-            phi->addIncoming(value, pred->llvm_block);
+    }
+    if (visits >= 2)
+        return llvm::UndefValue::get(facet.Type(llvm_block->getContext()));
+
+    if (predecessors.empty())
+        return llvm::UndefValue::get(facet.Type(llvm_block->getContext()));
+
+    if (predecessors.size() == 1) {
+        pending_phis.push_back(std::make_tuple(reg, facet, nullptr));
+        llvm::Value* value = predecessors[0]->regfile.GetReg(reg, facet);
+        pending_phis.pop_back();
+        return phi_tracker.Resolve(value);
+    }
+
+    llvm::PHINode* phi = CreatePhi(facet);
+    pending_phis.push_back(std::make_tuple(reg, facet, phi));
+    llvm::Value* value = AddPhiOperands(reg, facet, phi);
+    pending_phis.pop_back();
+    return value;
+}
+
+llvm::Value* BasicBlock::AddPhiOperands(ArchReg reg, Facet facet,
+                                        llvm::PHINode* phi) {
+    for (BasicBlock* pred : predecessors) {
+        llvm::Value* value = pred->regfile.GetReg(reg, facet);
+        value = phi_tracker.Resolve(value);
+        if (facet == Facet::PTR && value->getType() != phi->getType()) {
+            llvm::IRBuilder<> irb(pred->llvm_block->getTerminator());
+            value = irb.CreatePointerCast(value, phi->getType());
         }
+        phi->addIncoming(value, pred->llvm_block);
     }
-    empty_phis.clear();
+    return phi_tracker.TryRemoveTrivial(phi);
+}
+
+void BasicBlock::Seal() {
+    if (sealed)
+        return;
+
+    // Reading from predecessors might request more registers of this block in
+    // case of loops. As the block is sealed now, these get complete PHIs.
+    sealed = true;
+    for (const auto& [reg, facet, phi] : incomplete_phis)
+        if (!phi_tracker.IsRemoved(phi))
+            AddPhiOperands(reg, facet, phi);
+    incomplete_phis.clear();
+}
+
+void ArchBasicBlock::SwitchTo(llvm::Value* val, ArchBasicBlock& def,
+        llvm::ArrayRef<std::pair<uint64_t, ArchBasicBlock*>> cases) {
+    auto ty = llvm::cast<llvm::IntegerType>(val->getType());
+    llvm::SmallVector<std::pair<llvm::ConstantInt*, BasicBlock*>, 16> ll_cases;
+    for (const auto& [case_val, block] : cases)
+        ll_cases.emplace_back(llvm::ConstantInt::get(ty, case_val),
+                              &block->BeginBlock());
+    insert_block->SwitchTo(val, def.BeginBlock(), ll_cases);
+}
+
+BasicBlock* ArchBasicBlock::AddBlock() {
+    BasicBlock* block = new (arena.blocks.Allocate())
+        BasicBlock(fn, phi_mode, arch, phi_tracker, arena);
+    low_blocks.push_back(block);
+    return block;
+}
 
-    return true;
+llvm::BumpPtrAllocator& ArchBasicBlock::GetAllocator() {
+    return arena.raw;
 }
 
 } // namespace
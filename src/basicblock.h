@@ -27,19 +27,68 @@
 #include "arch.h"
 #include "facet.h"
 #include "regfile.h"
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Support/Allocator.h>
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include <cstdint>
 #include <tuple>
+#include <utility>
 #include <vector>
 
 
 namespace rellume {
 
+/// Function-wide state of the SSA construction. PHI nodes which turn out to be
+/// trivial are replaced immediately, but register files may still refer to
+/// them. Therefore, they are only erased in Finalize, when the register files
+/// are no longer used.
+class PhiTracker {
+public:
+    PhiTracker() : num_removed(0) {}
+
+    PhiTracker(const PhiTracker&) = delete;
+    PhiTracker& operator=(const PhiTracker&) = delete;
+
+    void Add(llvm::PHINode* phi) {
+        phis.push_back(phi);
+    }
+    /// Follow the replacements of trivial PHI nodes.
+    llvm::Value* Resolve(llvm::Value* value) const;
+    /// Replace the PHI node if all its incoming values are the same and return
+    /// its (possibly new) value. Users of a removed PHI are checked as well.
+    llvm::Value* TryRemoveTrivial(llvm::PHINode* phi);
+    bool IsRemoved(llvm::PHINode* phi) const {
+        return replaced.count(phi) != 0;
+    }
+    /// Erase replaced and unused PHI nodes.
+    void Finalize();
+
+    uint64_t NumCreated() const {
+        return phis.size();
+    }
+    uint64_t NumRemoved() const {
+        return num_removed;
+    }
+
+private:
+    std::vector<llvm::PHINode*> phis;
+    llvm::DenseMap<llvm::PHINode*, llvm::Value*> replaced;
+    uint64_t num_removed;
+};
+
+class ArchBasicBlock;
+struct BlockArena;
+
 class BasicBlock {
 public:
     enum class Phis { NONE, NATIVE, ALL };
 
-    BasicBlock(llvm::Function* fn, Phis phi_mode, Arch arch);
+    BasicBlock(llvm::Function* fn, Phis phi_mode, Arch arch,
+               PhiTracker& phi_tracker, BlockArena& arena);
 
     BasicBlock(BasicBlock&& rhs);
     BasicBlock& operator=(BasicBlock&& rhs);
@@ -49,29 +98,49 @@ public:
 
     void BranchTo(BasicBlock& next);
     void BranchTo(llvm::Value* cond, BasicBlock& then, BasicBlock& other);
-    bool FillPhis();
+    void SwitchTo(llvm::Value* val, BasicBlock& def,
+                  llvm::ArrayRef<std::pair<llvm::ConstantInt*, BasicBlock*>> cases);
+    /// Mark that all predecessors of the block are known and complete the PHI
+    /// nodes created so far. Afterwards, register values are looked up in the
+    /// predecessors as soon as they are requested.
+    void Seal();
 
     RegFile* GetRegFile() {
         return &regfile;
     }
 
-    const std::vector<BasicBlock*>& Predecessors() const {
+    llvm::ArrayRef<BasicBlock*> Predecessors() const {
         return predecessors;
     }
-    const std::vector<BasicBlock*>& Successors() const {
+    llvm::ArrayRef<BasicBlock*> Successors() const {
         return successors;
     }
 
 private:
+    using PhiDesc = std::tuple<ArchReg, Facet, llvm::PHINode*>;
+
+    static llvm::Value* ReadRegGenerator(ArchReg reg, Facet facet,
+                                         llvm::BasicBlock*, void* bb);
+    llvm::Value* ReadPredecessorReg(ArchReg reg, Facet facet);
+    llvm::Value* AddPhiOperands(ArchReg reg, Facet facet, llvm::PHINode* phi);
+    llvm::PHINode* CreatePhi(Facet facet);
+
     /// First LLVM basic block for the x86 basic block.
     llvm::BasicBlock* llvm_block;
 
     /// The register file for the basic block
     RegFile regfile;
 
-    std::vector<BasicBlock*> predecessors;
-    std::vector<BasicBlock*> successors;
-    std::vector<std::tuple<ArchReg, Facet, llvm::PHINode*>> empty_phis;
+    llvm::SmallVector<BasicBlock*, 2> predecessors;
+    llvm::SmallVector<BasicBlock*, 2> successors;
+
+    PhiTracker& phi_tracker;
+    /// Whether all predecessors are known.
+    bool sealed;
+    /// PHI nodes created before the block was sealed.
+    llvm::SmallVector<PhiDesc, 8> incomplete_phis;
+    /// PHI nodes whose operands are currently added, to break cycles.
+    llvm::SmallVector<PhiDesc, 2> pending_phis;
 };
 
 class ArchBasicBlock
@@ -80,15 +149,18 @@ private:
     llvm::Function* fn;
     BasicBlock::Phis phi_mode;
     Arch arch;
+    PhiTracker& phi_tracker;
+    BlockArena& arena;
 
-    std::vector<std::unique_ptr<BasicBlock>> low_blocks;
+    llvm::SmallVector<BasicBlock*, 1> low_blocks;
     BasicBlock* insert_block;
 
 public:
-    ArchBasicBlock(llvm::Function* fn, BasicBlock::Phis phi_mode, Arch arch)
-            : fn(fn), phi_mode(phi_mode), arch(arch) {
-        low_blocks.push_back(std::make_unique<BasicBlock>(fn, phi_mode, arch));
-        insert_block = low_blocks[0].get();
+    ArchBasicBlock(llvm::Function* fn, BasicBlock::Phis phi_mode, Arch arch,
+                   PhiTracker& phi_tracker, BlockArena& arena)
+            : fn(fn), phi_mode(phi_mode), arch(arch), phi_tracker(phi_tracker),
+              arena(arena) {
+        insert_block = AddBlock();
     }
 
     ArchBasicBlock(ArchBasicBlock&& rhs);
@@ -103,10 +175,7 @@ private:
     }
 
 public:
-    BasicBlock* AddBlock() {
-        low_blocks.push_back(std::make_unique<BasicBlock>(fn, phi_mode, arch));
-        return low_blocks[low_blocks.size()-1].get();
-    }
+    BasicBlock* AddBlock();
     BasicBlock* GetInsertBlock() {
         return insert_block;
     }
@@ -120,11 +189,30 @@ public:
     void BranchTo(llvm::Value* cond, ArchBasicBlock& then, ArchBasicBlock& other) {
         insert_block->BranchTo(cond, then.BeginBlock(), other.BeginBlock());
     }
-    bool FillPhis() {
-        bool res = false;
-        for (const auto& lb : low_blocks)
-            res |= lb->FillPhis();
-        return res;
+    /// Branch to the block of the matching case value or to def otherwise.
+    void SwitchTo(llvm::Value* val, ArchBasicBlock& def,
+                  llvm::ArrayRef<std::pair<uint64_t, ArchBasicBlock*>> cases);
+    /// Allocator for objects which live as long as the function.
+    llvm::BumpPtrAllocator& GetAllocator();
+
+    void Seal() {
+        for (BasicBlock* lb : low_blocks)
+            lb->Seal();
+    }
+};
+
+/// Storage for the basic blocks of a function and their register files. The
+/// memory is released at once when the function is destroyed.
+struct BlockArena {
+    llvm::SpecificBumpPtrAllocator<ArchBasicBlock> arch_blocks;
+    llvm::SpecificBumpPtrAllocator<BasicBlock> blocks;
+    /// Allocator for objects without destructor, e.g. register file slots.
+    llvm::BumpPtrAllocator raw;
+
+    ArchBasicBlock* CreateArchBlock(llvm::Function* fn, BasicBlock::Phis mode,
+                                    Arch arch, PhiTracker& phi_tracker) {
+        return new (arch_blocks.Allocate())
+            ArchBasicBlock(fn, mode, arch, phi_tracker, *this);
     }
 };
 
@@ -0,0 +1,262 @@
+/**
+ * This file is part of Rellume.
+ *
+ * (c) 2016-2019, Alexis Engelke <alexis.engelke@googlemail.com>
+ *
+ * Rellume is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * Rellume is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Rellume.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * \file
+ **/
+
+#include "batch.h"
+
+#include "config.h"
+#include "function.h"
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/Twine.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+
+/**
+ * \defgroup LLBatch Batch
+ * \brief Parallel lifting of many functions
+ *
+ * @{
+ **/
+
+namespace rellume {
+
+namespace {
+
+/// Call f for every LLVM value referenced by the configuration.
+template<typename F>
+void ForEachConfigValue(LLConfig& cfg, F f) {
+    f(cfg.global_base_value);
+    for (auto& item : cfg.data_sections)
+        f(item.second.global);
+    f(cfg.pc_base_value);
+    for (auto& item : cfg.instr_overrides)
+        f(item.second);
+    f(cfg.tail_function);
+    for (auto& item : cfg.known_functions)
+        f(item.second);
+    f(cfg.call_function);
+    f(cfg.syscall_implementation);
+    f(cfg.cpuinfo_function);
+    f(cfg.repne_scasb_function);
+    f(cfg.repe_cmpsb_function);
+    f(cfg.instr_marker);
+}
+
+/// Find a name prefix for the lifted functions which is not used by any
+/// global value of mod, so that they can be identified after linking.
+std::string BatchPrefix(llvm::Module* mod) {
+    for (unsigned i = 0;; i++) {
+        std::string prefix = ("__rellume_batch" + llvm::Twine(i) + "_").str();
+        auto has_prefix = [&](const llvm::GlobalValue& gv) {
+            return gv.getName().startswith(prefix);
+        };
+        if (llvm::none_of(mod->global_values(), has_prefix))
+            return prefix;
+    }
+}
+
+std::string BatchFnName(llvm::StringRef prefix, size_t idx) {
+    return (prefix + llvm::Twine(idx)).str();
+}
+
+/// Serialize declarations of all global values referenced by cfg. Workers
+/// parse this into their own context to obtain a matching configuration.
+bool CreatePrototype(llvm::Module* mod, LLConfig& cfg,
+                     llvm::SmallVectorImpl<char>& buf) {
+    llvm::Module proto("rellume_batch_proto", mod->getContext());
+    proto.setDataLayout(mod->getDataLayout());
+    proto.setTargetTriple(mod->getTargetTriple());
+
+    bool valid = true;
+    ForEachConfigValue(cfg, [&](auto*& val) {
+        if (!val)
+            return;
+        // Values with local linkage cannot be resolved when linking.
+        auto gv = llvm::dyn_cast<llvm::GlobalValue>(val);
+        if (!gv || !gv->hasName() || gv->hasLocalLinkage() ||
+            gv->getParent() != mod) {
+            valid = false;
+            return;
+        }
+        if (proto.getNamedValue(gv->getName()))
+            return;
+        if (auto fn = llvm::dyn_cast<llvm::Function>(gv)) {
+            auto decl = llvm::Function::Create(fn->getFunctionType(),
+                                               llvm::GlobalValue::ExternalLinkage,
+                                               fn->getName(), &proto);
+            decl->setCallingConv(fn->getCallingConv());
+        } else {
+            new llvm::GlobalVariable(proto, gv->getValueType(), false,
+                                     llvm::GlobalValue::ExternalLinkage,
+                                     nullptr, gv->getName(), nullptr,
+                                     gv->getThreadLocalMode(),
+                                     gv->getAddressSpace());
+        }
+    });
+    if (!valid)
+        return false;
+
+    llvm::raw_svector_ostream os(buf);
+    llvm::WriteBitcodeToFile(proto, os);
+    return true;
+}
+
+class BatchWorker {
+    const LLConfig& base_cfg;
+    llvm::ArrayRef<uintptr_t> addrs;
+    const Function::MemReader& memacc;
+    llvm::StringRef proto;
+    llvm::StringRef prefix;
+    std::atomic<size_t>& next_idx;
+
+public:
+    BatchWorker(const LLConfig& base_cfg, llvm::ArrayRef<uintptr_t> addrs,
+                const Function::MemReader& memacc, llvm::StringRef proto,
+                llvm::StringRef prefix, std::atomic<size_t>& next_idx)
+            : base_cfg(base_cfg), addrs(addrs), memacc(memacc), proto(proto),
+              prefix(prefix), next_idx(next_idx) {}
+
+    /// Bitcode of the worker module, empty if nothing was lifted.
+    llvm::SmallVector<char, 0> bitcode;
+
+    void Run() {
+        llvm::LLVMContext ctx;
+        auto mod_or_err = llvm::parseBitcodeFile(
+            llvm::MemoryBufferRef(proto, "rellume_batch_proto"), ctx);
+        if (!mod_or_err) {
+            llvm::consumeError(mod_or_err.takeError());
+            return;
+        }
+        std::unique_ptr<llvm::Module> mod = std::move(*mod_or_err);
+
+        // Map the configuration to the declarations in our context. The names
+        // of the original values are only read, which is safe while the main
+        // thread waits for the workers.
+        LLConfig cfg = base_cfg;
+        ForEachConfigValue(cfg, [&](auto*& val) {
+            using T = std::remove_pointer_t<std::remove_reference_t<decltype(val)>>;
+            if (val)
+                val = llvm::cast<T>(mod->getNamedValue(val->getName()));
+        });
+
+        bool lifted_any = false;
+        for (size_t idx; (idx = next_idx++) < addrs.size();) {
+            Function fn(mod.get(), &cfg);
+            if (fn.Decode(addrs[idx], Function::DecodeStop::ALL, memacc))
+                continue;
+            if (llvm::Function* lifted = fn.Lift()) {
+                lifted->setName(BatchFnName(prefix, idx));
+                lifted_any = true;
+            }
+        }
+
+        if (lifted_any) {
+            llvm::raw_svector_ostream os(bitcode);
+            llvm::WriteBitcodeToFile(*mod, os);
+        }
+    }
+};
+
+} // end anonymous namespace
+
+size_t LiftBatch(llvm::Module* mod, const LLConfig& cfg,
+                 llvm::ArrayRef<uintptr_t> addrs,
+                 const Function::MemReader& memacc, unsigned num_threads,
+                 llvm::MutableArrayRef<llvm::Function*> fns) {
+    std::fill(fns.begin(), fns.end(), nullptr);
+
+    LLConfig proto_cfg = cfg;
+    llvm::SmallVector<char, 0> proto;
+    if (!CreatePrototype(mod, proto_cfg, proto))
+        return addrs.size();
+
+    if (num_threads == 0)
+        num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    num_threads = std::min<size_t>(num_threads, addrs.size());
+
+    std::string prefix = BatchPrefix(mod);
+    std::atomic<size_t> next_idx{0};
+    llvm::StringRef proto_ref(proto.data(), proto.size());
+    std::vector<BatchWorker> workers;
+    workers.reserve(num_threads);
+    for (unsigned i = 0; i < num_threads; i++)
+        workers.emplace_back(cfg, addrs, memacc, proto_ref, prefix, next_idx);
+
+    // The calling thread runs the first worker itself.
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < num_threads; i++)
+        threads.emplace_back(&BatchWorker::Run, &workers[i]);
+    if (num_threads > 0)
+        workers[0].Run();
+    for (std::thread& thread : threads)
+        thread.join();
+
+    // Linking modifies mod and is therefore done sequentially.
+    for (BatchWorker& worker : workers) {
+        if (worker.bitcode.empty())
+            continue;
+        llvm::StringRef bc(worker.bitcode.data(), worker.bitcode.size());
+        auto wmod_or_err = llvm::parseBitcodeFile(
+            llvm::MemoryBufferRef(bc, "rellume_batch"), mod->getContext());
+        if (!wmod_or_err) {
+            llvm::consumeError(wmod_or_err.takeError());
+            continue;
+        }
+        llvm::Linker::linkModules(*mod, std::move(*wmod_or_err));
+    }
+
+    size_t failed = 0;
+    for (size_t idx = 0; idx < addrs.size(); idx++) {
+        llvm::Function* fn = mod->getFunction(BatchFnName(prefix, idx));
+        if (fn)
+            fn->setName(""); // lifted functions are unnamed, as in Function
+        else
+            failed++;
+        if (idx < fns.size())
+            fns[idx] = fn;
+    }
+    return failed;
+}
+
+} // namespace rellume
+
+/**
+ * @}
+ **/
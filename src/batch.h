@@ -0,0 +1,53 @@
+/**
+ * This file is part of Rellume.
+ *
+ * (c) 2016-2019, Alexis Engelke <alexis.engelke@googlemail.com>
+ *
+ * Rellume is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * Rellume is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Rellume.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * \file
+ **/
+
+#ifndef LL_BATCH_H
+#define LL_BATCH_H
+
+#include "function.h"
+#include <llvm/ADT/ArrayRef.h>
+#include <cstddef>
+#include <cstdint>
+
+
+namespace llvm {
+class Module;
+}
+
+namespace rellume {
+
+/// Lift the functions starting at addrs in parallel with num_threads worker
+/// threads (zero uses all hardware threads) and link them into mod. Each
+/// worker lifts into its own LLVMContext with a copy of the configuration, so
+/// all LLVM values referenced by cfg must be named global values of mod
+/// without local linkage. The memory reader is called concurrently. On return,
+/// fns holds the lifted functions in the order of addrs, with nullptr for
+/// failures. Returns the number of failed functions.
+size_t LiftBatch(llvm::Module* mod, const LLConfig& cfg,
+                 llvm::ArrayRef<uintptr_t> addrs,
+                 const Function::MemReader& memacc, unsigned num_threads,
+                 llvm::MutableArrayRef<llvm::Function*> fns);
+
+} // namespace rellume
+
+#endif
@@ -32,14 +32,220 @@
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Type.h>
 #include <llvm/IR/Value.h>
+#include <algorithm>
 #include <cassert>
+#include <memory>
 
 
 namespace rellume {
 
+using CPUStructEntry = std::tuple<unsigned, unsigned, ArchReg, Facet>;
+
+// Note: replace with C++20 std::span.
+template<typename T>
+class span {
+    T* ptr;
+    std::size_t len;
+public:
+    constexpr span() : ptr(nullptr), len(0) {}
+    template<std::size_t N>
+    constexpr span(T (&arr)[N]) : ptr(arr), len(N) {}
+    constexpr std::size_t size() const { return len; }
+    constexpr T* begin() const { return &ptr[0]; }
+    constexpr T* end() const { return &ptr[len]; }
+};
+
+static span<const CPUStructEntry> CPUStructEntries(Arch arch) {
+#ifdef RELLUME_WITH_X86_64
+    static const CPUStructEntry cpu_struct_entries_x86_64[] = {
+#define RELLUME_MAPPED_REG(nameu,off,reg,facet) \
+            std::make_tuple(SptrIdx::x86_64::nameu, off, reg, facet),
+#include <rellume/cpustruct-x86_64-private.inc>
+#undef RELLUME_MAPPED_REG
+    };
+#endif // RELLUME_WITH_X86_64
+
+#ifdef RELLUME_WITH_RV64
+    static const CPUStructEntry cpu_struct_entries_rv64[] = {
+#define RELLUME_MAPPED_REG(nameu,off,reg,facet) \
+            std::make_tuple(SptrIdx::rv64::nameu, off, reg, facet),
+#include <rellume/cpustruct-rv64-private.inc>
+#undef RELLUME_MAPPED_REG
+    };
+#endif // RELLUME_WITH_RV64
+
+#ifdef RELLUME_WITH_AARCH64
+    static const CPUStructEntry cpu_struct_entries_aarch64[] = {
+#define RELLUME_MAPPED_REG(nameu,off,reg,facet) \
+            std::make_tuple(SptrIdx::aarch64::nameu, off, reg, facet),
+#include <rellume/cpustruct-aarch64-private.inc>
+#undef RELLUME_MAPPED_REG
+    };
+#endif // RELLUME_WITH_AARCH64
+
+    switch (arch) {
+    default:
+        return span<const CPUStructEntry>();
+#ifdef RELLUME_WITH_X86_64
+    case Arch::X86_64:
+        return cpu_struct_entries_x86_64;
+#endif // RELLUME_WITH_X86_64
+#ifdef RELLUME_WITH_RV64
+    case Arch::RV64:
+        return cpu_struct_entries_rv64;
+#endif // RELLUME_WITH_RV64
+#ifdef RELLUME_WITH_AARCH64
+    case Arch::AArch64:
+        return cpu_struct_entries_aarch64;
+#endif // RELLUME_WITH_AARCH64
+    }
+}
+
+static span<const CPUStructEntry> CPUStructEntries(const CallConv& cconv) {
+    return CPUStructEntries(cconv.GetArch());
+}
+
+// Name, size and offset of all named CPU struct entries.
+using NamedEntry = std::tuple<const char*, unsigned, unsigned>;
+
+static span<const NamedEntry> NamedEntries(Arch arch) {
+#ifdef RELLUME_WITH_X86_64
+    static const NamedEntry named_entries_x86_64[] = {
+#define RELLUME_NAMED_REG(name,nameu,sz,off) std::make_tuple(#name, sz, off),
+#include <rellume/cpustruct-x86_64-private.inc>
+#undef RELLUME_NAMED_REG
+    };
+#endif // RELLUME_WITH_X86_64
+
+#ifdef RELLUME_WITH_RV64
+    static const NamedEntry named_entries_rv64[] = {
+#define RELLUME_NAMED_REG(name,nameu,sz,off) std::make_tuple(#name, sz, off),
+#include <rellume/cpustruct-rv64-private.inc>
+#undef RELLUME_NAMED_REG
+    };
+#endif // RELLUME_WITH_RV64
+
+#ifdef RELLUME_WITH_AARCH64
+    static const NamedEntry named_entries_aarch64[] = {
+#define RELLUME_NAMED_REG(name,nameu,sz,off) std::make_tuple(#name, sz, off),
+#include <rellume/cpustruct-aarch64-private.inc>
+#undef RELLUME_NAMED_REG
+    };
+#endif // RELLUME_WITH_AARCH64
+
+    switch (arch) {
+    default:
+        return span<const NamedEntry>();
+#ifdef RELLUME_WITH_X86_64
+    case Arch::X86_64:
+        return named_entries_x86_64;
+#endif // RELLUME_WITH_X86_64
+#ifdef RELLUME_WITH_RV64
+    case Arch::RV64:
+        return named_entries_rv64;
+#endif // RELLUME_WITH_RV64
+#ifdef RELLUME_WITH_AARCH64
+    case Arch::AArch64:
+        return named_entries_aarch64;
+#endif // RELLUME_WITH_AARCH64
+    }
+}
+
+#ifdef RELLUME_WITH_X86_64
+// Mapping of GP registers to HHVM parameters and return struct indices.
+//     RAX->RAX; RCX->RCX; RDX->RDX; RBX->RBP; RSP->R15; RBP->R13;
+//     RSI->RSI; RDI->RDI; R8->R8;   R9->R9;   R10->R10; R11->R11;
+//     RIP->RBX;
+static std::shared_ptr<const CallConv::RegDesc> HHVMRegDesc() {
+    static const uint8_t arg_indices[] = {10, 7, 6, 2, 3, 13, 5, 4, 8, 9, 11, 12};
+    static const uint8_t ret_indices[] = {8, 5, 4, 1, 13, 11, 3, 2, 6, 7, 9, 10};
+    static const auto desc = [] {
+        auto res = std::make_shared<CallConv::RegDesc>();
+        res->arch = Arch::X86_64;
+        res->llvm_cc = llvm::CallingConv::HHVM;
+        res->sptr_idx = 1;
+        res->num_params = 14;
+        res->num_rets = 14;
+        res->regs.emplace_back(ArchReg::IP, 0, 0);
+        for (unsigned i = 0; i < 12; i++)
+            res->regs.emplace_back(ArchReg::GP(i), arg_indices[i], ret_indices[i]);
+        return res;
+    }();
+    return desc;
+}
+#endif // RELLUME_WITH_X86_64
+
+CallConv::CallConv(Value value) : value(value) {
+#ifdef RELLUME_WITH_X86_64
+    if (value == X86_64_HHVM)
+        reg_desc = HHVMRegDesc();
+#endif // RELLUME_WITH_X86_64
+}
+
+CallConv CallConv::FromRegs(Arch arch, llvm::ArrayRef<ArchReg> regs) {
+    auto desc = std::make_shared<RegDesc>();
+    desc->arch = arch;
+    desc->llvm_cc = llvm::CallingConv::C;
+    desc->sptr_idx = 0;
+    desc->num_params = 1 + regs.size();
+    desc->num_rets = regs.size();
+    for (ArchReg reg : regs) {
+        bool found = false;
+        for (const auto& [sptr_idx, off, entry_reg, facet] : CPUStructEntries(arch))
+            if (entry_reg == reg && facet == Facet::I64)
+                found = true;
+        if (!found)
+            return INVALID;
+        for (const auto& entry : desc->regs)
+            if (std::get<0>(entry) == reg)
+                return INVALID;
+        unsigned idx = desc->regs.size();
+        desc->regs.emplace_back(reg, 1 + idx, idx);
+    }
+    return CallConv(REGS, std::move(desc));
+}
+
+CallConv CallConv::FromRegOffsets(Arch arch, llvm::ArrayRef<size_t> offsets) {
+    llvm::SmallVector<ArchReg, 16> regs;
+    for (size_t offset : offsets) {
+        ArchReg reg = ArchReg::INVALID;
+        for (const auto& [sptr_idx, off, entry_reg, facet] : CPUStructEntries(arch))
+            if (off == offset)
+                reg = entry_reg;
+        if (reg.Kind() == ArchReg::RegKind::INVALID)
+            return INVALID;
+        regs.push_back(reg);
+    }
+    return FromRegs(arch, regs);
+}
+
 CallConv CallConv::FromFunction(llvm::Function* fn, Arch arch) {
-    auto fn_cconv = fn->getCallingConv();
+    return FromFunction(fn, arch, INVALID);
+}
+
+// Whether fn has the signature of the calling convention cconv.
+static bool MatchesFunction(const CallConv& cconv, llvm::Function* fn) {
+    if (cconv.FnCallConv() != fn->getCallingConv())
+        return false;
+    unsigned sptr_idx = cconv.CpuStructParamIdx();
+    if (sptr_idx >= fn->arg_size())
+        return false;
+    llvm::Type* sptr_ty = fn->arg_begin()[sptr_idx].getType();
+    if (!sptr_ty->isPointerTy())
+        return false;
+    unsigned sptr_addrspace = sptr_ty->getPointerAddressSpace();
     auto fn_ty = llvm::cast<llvm::FunctionType>(fn->getType()->getPointerElementType());
+    return fn_ty == cconv.FnType(fn->getContext(), sptr_addrspace);
+}
+
+CallConv CallConv::FromFunction(llvm::Function* fn, Arch arch,
+                                const CallConv& hint) {
+    // The hint is only used if fn matches it, other functions (e.g. helpers
+    // with the CPU struct pointer as only parameter) keep their convention.
+    if (hint == REGS && hint.GetArch() == arch && MatchesFunction(hint, fn))
+        return hint;
+
+    auto fn_cconv = fn->getCallingConv();
     CallConv hunch = INVALID;
     switch (arch) {
 #ifdef RELLUME_WITH_X86_64
@@ -58,20 +264,28 @@ CallConv CallConv::FromFunction(llvm::Function* fn, Arch arch) {
     }
 
     // Verify hunch.
-    if (hunch.FnCallConv() != fn_cconv)
-        return INVALID;
-    unsigned sptr_idx = hunch.CpuStructParamIdx();
-    if (sptr_idx >= fn->arg_size())
-        return INVALID;
-    llvm::Type* sptr_ty = fn->arg_begin()[sptr_idx].getType();
-    if (!sptr_ty->isPointerTy())
-        return INVALID;
-    unsigned sptr_addrspace = sptr_ty->getPointerAddressSpace();
-    if (fn_ty != hunch.FnType(fn->getContext(), sptr_addrspace))
+    if (!MatchesFunction(hunch, fn))
         return INVALID;
     return hunch;
 }
 
+Arch CallConv::GetArch() const {
+    switch (*this) {
+    default: return Arch::INVALID;
+#ifdef RELLUME_WITH_X86_64
+    case CallConv::X86_64_SPTR: return Arch::X86_64;
+    case CallConv::X86_64_HHVM: return Arch::X86_64;
+#endif // RELLUME_WITH_X86_64
+#ifdef RELLUME_WITH_RV64
+    case CallConv::RV64_SPTR: return Arch::RV64;
+#endif // RELLUME_WITH_RV64
+#ifdef RELLUME_WITH_AARCH64
+    case CallConv::AArch64_SPTR: return Arch::AArch64;
+#endif // RELLUME_WITH_AARCH64
+    case CallConv::REGS: return reg_desc->arch;
+    }
+}
+
 llvm::FunctionType* CallConv::FnType(llvm::LLVMContext& ctx,
                                      unsigned sptr_addrspace) const {
     llvm::Type* void_ty = llvm::Type::getVoidTy(ctx);
@@ -85,12 +299,15 @@ llvm::FunctionType* CallConv::FnType(llvm::LLVMContext& ctx,
     case CallConv::RV64_SPTR:
     case CallConv::AArch64_SPTR:
         return llvm::FunctionType::get(void_ty, {i8p}, false);
-    case CallConv::X86_64_HHVM: {
-        auto ret_ty = llvm::StructType::get(i64, i64, i64, i64, i64, i64, i64,
-                                            i64, i64, i64, i64, i64, i64, i64);
-        return llvm::FunctionType::get(ret_ty, {i64, i8p, i64, i64, i64, i64,
-                                                i64, i64, i64, i64, i64, i64,
-                                                i64, i64}, false);
+    case CallConv::X86_64_HHVM:
+    case CallConv::REGS: {
+        llvm::SmallVector<llvm::Type*, 16> params(reg_desc->num_params, i64);
+        params[reg_desc->sptr_idx] = i8p;
+        llvm::SmallVector<llvm::Type*, 16> rets(reg_desc->num_rets, i64);
+        llvm::Type* ret_ty = void_ty;
+        if (!rets.empty())
+            ret_ty = llvm::StructType::get(ctx, rets);
+        return llvm::FunctionType::get(ret_ty, params, false);
     }
     }
 }
@@ -99,9 +316,10 @@ llvm::CallingConv::ID CallConv::FnCallConv() const {
     switch (*this) {
     default: return llvm::CallingConv::C;
     case CallConv::X86_64_SPTR: return llvm::CallingConv::C;
-    case CallConv::X86_64_HHVM: return llvm::CallingConv::HHVM;
+    case CallConv::X86_64_HHVM: return reg_desc->llvm_cc;
     case CallConv::RV64_SPTR: return llvm::CallingConv::C;
     case CallConv::AArch64_SPTR: return llvm::CallingConv::C;
+    case CallConv::REGS: return reg_desc->llvm_cc;
     }
 }
 
@@ -109,110 +327,87 @@ unsigned CallConv::CpuStructParamIdx() const {
     switch (*this) {
     default: return 0;
     case CallConv::X86_64_SPTR:  return 0;
-    case CallConv::X86_64_HHVM:  return 1;
+    case CallConv::X86_64_HHVM:  return reg_desc->sptr_idx;
     case CallConv::RV64_SPTR:    return 0;
     case CallConv::AArch64_SPTR: return 0;
+    case CallConv::REGS:         return reg_desc->sptr_idx;
     }
 }
 
-using CPUStructEntry = std::tuple<unsigned, unsigned, ArchReg, Facet>;
-
-// Note: replace with C++20 std::span.
-template<typename T>
-class span {
-    T* ptr;
-    std::size_t len;
-public:
-    constexpr span() : ptr(nullptr), len(0) {}
-    template<std::size_t N>
-    constexpr span(T (&arr)[N]) : ptr(arr), len(N) {}
-    constexpr std::size_t size() const { return len; }
-    constexpr T* begin() const { return &ptr[0]; }
-    constexpr T* end() const { return &ptr[len]; }
-};
-
-static span<const CPUStructEntry> CPUStructEntries(CallConv cconv) {
-#ifdef RELLUME_WITH_X86_64
-    static const CPUStructEntry cpu_struct_entries_x86_64[] = {
-#define RELLUME_MAPPED_REG(nameu,off,reg,facet) \
-            std::make_tuple(SptrIdx::x86_64::nameu, off, reg, facet),
-#include <rellume/cpustruct-x86_64-private.inc>
-#undef RELLUME_MAPPED_REG
-    };
-#endif // RELLUME_WITH_X86_64
-
-#ifdef RELLUME_WITH_RV64
-    static const CPUStructEntry cpu_struct_entries_rv64[] = {
-#define RELLUME_MAPPED_REG(nameu,off,reg,facet) \
-            std::make_tuple(SptrIdx::rv64::nameu, off, reg, facet),
-#include <rellume/cpustruct-rv64-private.inc>
-#undef RELLUME_MAPPED_REG
-    };
-#endif // RELLUME_WITH_RV64
+const std::tuple<ArchReg, unsigned, unsigned>*
+CallConv::FindReg(ArchReg reg) const {
+    if (!reg_desc)
+        return nullptr;
+    for (const auto& entry : reg_desc->regs)
+        if (std::get<0>(entry) == reg)
+            return &entry;
+    return nullptr;
+}
 
-#ifdef RELLUME_WITH_AARCH64
-    static const CPUStructEntry cpu_struct_entries_aarch64[] = {
-#define RELLUME_MAPPED_REG(nameu,off,reg,facet) \
-            std::make_tuple(SptrIdx::aarch64::nameu, off, reg, facet),
-#include <rellume/cpustruct-aarch64-private.inc>
-#undef RELLUME_MAPPED_REG
-    };
-#endif // RELLUME_WITH_AARCH64
+static unsigned CPUStructEntrySize(Facet facet) {
+    return (facet.Size() + 7) / 8;
+}
 
-    switch (cconv) {
-    default:
-        return span<const CPUStructEntry>();
-#ifdef RELLUME_WITH_X86_64
-    case CallConv::X86_64_SPTR:
-    case CallConv::X86_64_HHVM:
-        return cpu_struct_entries_x86_64;
-#endif // RELLUME_WITH_X86_64
-#ifdef RELLUME_WITH_RV64
-    case CallConv::RV64_SPTR:
-        return cpu_struct_entries_rv64;
-#endif // RELLUME_WITH_RV64
-#ifdef RELLUME_WITH_AARCH64
-    case CallConv::AArch64_SPTR:
-        return cpu_struct_entries_aarch64;
-#endif // RELLUME_WITH_AARCH64
+std::optional<unsigned> CallConv::IntRegOffset(llvm::StringRef name) const {
+    for (const auto& [entry_name, size, off] : NamedEntries(GetArch())) {
+        if (name != entry_name)
+            continue;
+        for (const auto& [sptr_idx, entry_off, reg, facet] : CPUStructEntries(*this))
+            if (entry_off == off && size <= 8 &&
+                reg.Kind() != ArchReg::RegKind::INVALID)
+                return off;
+        return std::nullopt;
     }
+    return std::nullopt;
 }
 
+bool CallConv::IsValidLayoutEntry(size_t default_off, size_t off,
+                                  size_t size) const {
+    for (const auto& [sptr_idx, entry_off, reg, facet] : CPUStructEntries(*this)) {
+        if (entry_off == default_off)
+            return size == CPUStructEntrySize(facet) && off % size == 0;
+    }
+    return false;
+}
 
-void CallConv::InitSptrs(BasicBlock* bb, FunctionInfo& fi) {
+void CallConv::InitSptrs(BasicBlock* bb, FunctionInfo& fi,
+                         const Layout& layout) {
     llvm::IRBuilder<> irb(bb->GetRegFile()->GetInsertBlock());
     unsigned as = fi.sptr_raw->getType()->getPointerAddressSpace();
     llvm::Type* i8 = irb.getInt8Ty();
 
     const auto& cpu_struct_entries = CPUStructEntries(*this);
+
+    // Entries missing in a custom layout go to a scratch area, where loads
+    // are undefined and stores are dead.
+    llvm::Value* scratch = nullptr;
+    if (!layout.empty()) {
+        unsigned size = 0;
+        for (const auto& [sptr_idx, off, reg, facet] : cpu_struct_entries)
+            size = std::max(size, off + CPUStructEntrySize(facet));
+        auto alloca = irb.CreateAlloca(llvm::ArrayType::get(i8, size));
+        alloca->setAlignment(llvm::Align(16));
+        scratch = irb.CreatePointerCast(alloca, irb.getInt8PtrTy(as));
+    }
+
     fi.sptr.resize(cpu_struct_entries.size());
     for (const auto& [sptr_idx, off, reg, facet] : cpu_struct_entries) {
-        llvm::Value* ptr = irb.CreateConstGEP1_64(i8, fi.sptr_raw, off);
+        llvm::Value* ptr;
+        auto layout_it = layout.find(off);
+        if (layout.empty())
+            ptr = irb.CreateConstGEP1_64(i8, fi.sptr_raw, off);
+        else if (layout_it != layout.end())
+            ptr = irb.CreateConstGEP1_64(i8, fi.sptr_raw, layout_it->second);
+        else
+            ptr = irb.CreateConstGEP1_64(i8, scratch, off);
         llvm::Type* ty = facet.Type(irb.getContext())->getPointerTo(as);
         fi.sptr[sptr_idx] = irb.CreatePointerCast(ptr, ty);
     }
 }
 
-// Mapping of GP registers to HHVM parameters and return struct indices.
-//     RAX->RAX; RCX->RCX; RDX->RDX; RBX->RBP; RSP->R15; RBP->R13;
-//     RSI->RSI; RDI->RDI; R8->R8;   R9->R9;   R10->R10; R11->R11;
-//     RIP->RBX; (not encoded here)
-static bool hhvm_is_host_reg(ArchReg reg) {
-    return reg == ArchReg::IP || (reg.IsGP() && reg.Index() < 12);
-}
-static uint8_t hhvm_arg_index(ArchReg reg) {
-    static const uint8_t indices[] = {10, 7, 6, 2, 3, 13, 5, 4, 8, 9, 11, 12};
-    assert(hhvm_is_host_reg(reg));
-    return (reg.IsGP() && reg.Index() < 12) ? indices[reg.Index()] : 0;
-}
-static uint8_t hhvm_ret_index(ArchReg reg) {
-    static const uint8_t indices[] = {8, 5, 4, 1, 13, 11, 3, 2, 6, 7, 9, 10};
-    assert(hhvm_is_host_reg(reg));
-    return (reg.IsGP() && reg.Index() < 12) ? indices[reg.Index()] : 0;
-}
-
 template<typename F>
-static void Pack(CallConv cconv, BasicBlock* bb, FunctionInfo& fi, F hhvm_fn) {
+static void Pack(const CallConv& cconv, BasicBlock* bb, FunctionInfo& fi,
+                 bool exit, F reg_fn) {
     RegFile& regfile = *bb->GetRegFile();
     llvm::IRBuilder<> irb(regfile.GetInsertBlock());
 
@@ -221,6 +416,7 @@ static void Pack(CallConv cconv, BasicBlock* bb, FunctionInfo& fi, F hhvm_fn) {
     CallConvPack& pack_info = fi.call_conv_packs.emplace_back();
     pack_info.block_dirty_regs = regfile.DirtyRegs();
     pack_info.bb = bb;
+    pack_info.exit = exit;
     pack_info.stores.resize(cpu_struct_entries.size());
 
     for (const auto& [sptr_idx, off, reg, facet] : cpu_struct_entries) {
@@ -229,8 +425,8 @@ static void Pack(CallConv cconv, BasicBlock* bb, FunctionInfo& fi, F hhvm_fn) {
 
         llvm::Value* reg_val = regfile.GetReg(reg, facet);
 
-        if (cconv == CallConv::X86_64_HHVM && hhvm_is_host_reg(reg)) {
-            hhvm_fn(reg, reg_val);
+        if (auto reg_entry = cconv.FindReg(reg)) {
+            reg_fn(*reg_entry, reg_val);
             continue;
         }
 
@@ -238,11 +434,14 @@ static void Pack(CallConv cconv, BasicBlock* bb, FunctionInfo& fi, F hhvm_fn) {
         regfile.DirtyRegs()[regset_idx] = false;
         regfile.CleanedRegs()[regset_idx] = true;
         pack_info.stores[sptr_idx] = irb.CreateStore(reg_val, fi.sptr[sptr_idx]);
+        fi.SetCpuAliasScope(pack_info.stores[sptr_idx]);
     }
 }
 
 template<typename F>
-static void Unpack(CallConv cconv, BasicBlock* bb, FunctionInfo& fi, F hhvm_fn) {
+static void Unpack(const CallConv& cconv, BasicBlock* bb, FunctionInfo& fi,
+                   const RegisterSet& live, const CallConv::ConstRegs* consts,
+                   F reg_fn) {
     RegFile& regfile = *bb->GetRegFile();
     llvm::IRBuilder<> irb(regfile.GetInsertBlock());
 
@@ -251,40 +450,61 @@ static void Unpack(CallConv cconv, BasicBlock* bb, FunctionInfo& fi, F hhvm_fn)
     for (const auto& [sptr_idx, off, reg, facet] : CPUStructEntries(cconv)) {
         if (reg.Kind() == ArchReg::RegKind::INVALID)
             continue;
-        if (cconv == CallConv::X86_64_HHVM && hhvm_is_host_reg(reg)) {
-            regfile.SetReg(reg, facet, hhvm_fn(reg), false);
+        llvm::Type* reg_ty = facet.Type(irb.getContext());
+        unsigned regset_idx = RegisterSetBitIdx(reg, facet);
+        if (consts && reg_ty->isIntegerTy()) {
+            auto const_it = consts->find(off);
+            if (const_it != consts->end()) {
+                auto const_val = llvm::ConstantInt::get(reg_ty, const_it->second);
+                regfile.SetReg(reg, facet, const_val, false);
+                regfile.DirtyRegs()[regset_idx] = false;
+                continue;
+            }
+        }
+        if (!live[regset_idx] && reg.Kind() != ArchReg::RegKind::IP) {
+            regfile.SetReg(reg, facet, llvm::UndefValue::get(reg_ty), false);
+            regfile.DirtyRegs()[regset_idx] = false;
+            continue;
+        }
+        if (auto reg_entry = cconv.FindReg(reg)) {
+            regfile.SetReg(reg, facet, reg_fn(*reg_entry), false);
             continue;
         }
 
-        llvm::Type* reg_ty = facet.Type(irb.getContext());
-        llvm::Value* reg_val = irb.CreateLoad(reg_ty, fi.sptr[sptr_idx]);
+        llvm::LoadInst* reg_val = irb.CreateLoad(reg_ty, fi.sptr[sptr_idx]);
+        fi.SetCpuAliasScope(reg_val);
         // Mark register as clean if it was loaded from the sptr.
         regfile.SetReg(reg, facet, reg_val, false);
-        regfile.DirtyRegs()[RegisterSetBitIdx(reg, facet)] = false;
+        regfile.DirtyRegs()[regset_idx] = false;
     }
 }
 
+using RegEntry = std::tuple<ArchReg, unsigned, unsigned>;
+
 llvm::ReturnInst* CallConv::Return(BasicBlock* bb, FunctionInfo& fi) const {
     llvm::IRBuilder<> irb(bb->GetRegFile()->GetInsertBlock());
 
-    llvm::SmallVector<llvm::Value*, 16> hhvm_ret;
-    if (*this == CallConv::X86_64_HHVM) {
-        hhvm_ret.resize(14);
-        hhvm_ret[12] = llvm::UndefValue::get(irb.getInt64Ty());
-    }
+    // Return struct elements without a register are undefined.
+    llvm::SmallVector<llvm::Value*, 16> ret_vals;
+    if (reg_desc)
+        ret_vals.resize(reg_desc->num_rets,
+                        llvm::UndefValue::get(irb.getInt64Ty()));
 
-    Pack(*this, bb, fi, [&hhvm_ret] (ArchReg reg, llvm::Value* reg_val) {
-        hhvm_ret[hhvm_ret_index(reg)] = reg_val;
+    Pack(*this, bb, fi, true, [&ret_vals] (const RegEntry& entry,
+                                           llvm::Value* reg_val) {
+        ret_vals[std::get<2>(entry)] = reg_val;
     });
 
-    if (*this == CallConv::X86_64_HHVM)
-        return irb.CreateAggregateRet(hhvm_ret.data(), hhvm_ret.size());
+    if (!ret_vals.empty())
+        return irb.CreateAggregateRet(ret_vals.data(), ret_vals.size());
     return irb.CreateRetVoid();
 }
 
-void CallConv::UnpackParams(BasicBlock* bb, FunctionInfo& fi) const {
-    Unpack(*this, bb, fi, [&fi] (ArchReg reg) {
-        return &fi.fn->arg_begin()[hhvm_arg_index(reg)];
+void CallConv::UnpackParams(BasicBlock* bb, FunctionInfo& fi,
+                            const RegisterSet& live_in,
+                            const ConstRegs& const_regs) const {
+    Unpack(*this, bb, fi, live_in, &const_regs, [&fi] (const RegEntry& entry) {
+        return &fi.fn->arg_begin()[std::get<1>(entry)];
     });
 }
 
@@ -294,12 +514,18 @@ llvm::CallInst* CallConv::Call(llvm::Function* fn, BasicBlock* bb,
     call_args.resize(fn->arg_size());
     call_args[CpuStructParamIdx()] = fi.sptr_raw;
 
-    Pack(*this, bb, fi, [&call_args] (ArchReg reg, llvm::Value* reg_val) {
-        call_args[hhvm_arg_index(reg)] = reg_val;
+    Pack(*this, bb, fi, tail_call,
+         [&call_args] (const RegEntry& entry, llvm::Value* reg_val) {
+        call_args[std::get<1>(entry)] = reg_val;
     });
 
     llvm::IRBuilder<> irb(bb->GetRegFile()->GetInsertBlock());
 
+    // Parameters without a register are undefined.
+    for (unsigned i = 0; i < call_args.size(); i++)
+        if (!call_args[i])
+            call_args[i] = llvm::UndefValue::get(fn->getFunctionType()->getParamType(i));
+
     llvm::CallInst* call = irb.CreateCall(fn->getFunctionType(), fn, call_args);
     call->setCallingConv(fn->getCallingConv());
     call->setAttributes(fn->getAttributes());
@@ -313,20 +539,39 @@ llvm::CallInst* CallConv::Call(llvm::Function* fn, BasicBlock* bb,
         return call;
     }
 
-    llvm::SmallVector<llvm::Value*, 14> hhvm_ret;
-    if (*this == CallConv::X86_64_HHVM) {
-        for (unsigned i = 0; i < 14; i++)
-            hhvm_ret.push_back(irb.CreateExtractValue(call, {i}));
+    llvm::SmallVector<llvm::Value*, 16> ret_vals;
+    if (reg_desc) {
+        for (unsigned i = 0; i < reg_desc->num_rets; i++)
+            ret_vals.push_back(irb.CreateExtractValue(call, {i}));
     }
 
-    Unpack(*this, bb, fi, [&hhvm_ret] (ArchReg reg) {
-        return hhvm_ret[hhvm_ret_index(reg)];
+    Unpack(*this, bb, fi, ~RegisterSet(), nullptr,
+           [&ret_vals] (const RegEntry& entry) {
+        return ret_vals[std::get<2>(entry)];
     });
 
     return call;
 }
 
-void CallConv::OptimizePacks(FunctionInfo& fi, BasicBlock* entry) {
+bool CallConv::RegsAtOffsets(llvm::ArrayRef<size_t> offsets,
+                             RegisterSet& regs) const {
+    regs.reset();
+    for (size_t offset : offsets) {
+        bool found = false;
+        for (const auto& [sptr_idx, off, reg, facet] : CPUStructEntries(*this)) {
+            if (off != offset || reg.Kind() == ArchReg::RegKind::INVALID)
+                continue;
+            regs[RegisterSetBitIdx(reg, facet)] = true;
+            found = true;
+        }
+        if (!found)
+            return false;
+    }
+    return true;
+}
+
+void CallConv::OptimizePacks(FunctionInfo& fi, BasicBlock* entry,
+                             const RegisterSet& live_out) {
     // Map of basic block to dirty register at (beginning, end) of the block.
     llvm::DenseMap<BasicBlock*, std::pair<RegisterSet, RegisterSet>> bb_map;
 
@@ -367,6 +612,8 @@ void CallConv::OptimizePacks(FunctionInfo& fi, BasicBlock* entry) {
 
     for (const auto& pack : fi.call_conv_packs) {
         RegisterSet regset = bb_map.lookup(pack.bb).first | pack.block_dirty_regs;
+        if (pack.exit)
+            regset &= live_out;
         for (const auto& [sptr_idx, off, reg, facet] : CPUStructEntries(*this)) {
             if (reg.Kind() == ArchReg::RegKind::INVALID)
                 continue;
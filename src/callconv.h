@@ -28,12 +28,19 @@
 #include "basicblock.h"
 #include "regfile.h"
 
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/StringRef.h>
 #include <llvm/IR/DerivedTypes.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/Type.h>
 #include <llvm/IR/Value.h>
 #include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
 #include <tuple>
+#include <unordered_map>
+#include <vector>
 
 
 namespace rellume {
@@ -47,41 +54,106 @@ public:
     ///
     /// SPTR: Cdecl callconv with one argument, the CPU struct pointer (sptr). See
     /// FunctionInfo.
+    ///
+    /// REGS: Registers listed in a RegDesc are passed as i64 parameters after
+    /// the CPU struct pointer and returned in a struct of i64, see FromRegs.
     enum Value {
-        INVALID, X86_64_SPTR, X86_64_HHVM, RV64_SPTR, AArch64_SPTR,
+        INVALID, X86_64_SPTR, X86_64_HHVM, RV64_SPTR, AArch64_SPTR, REGS,
+    };
+
+    /// Registers which are passed as LLVM parameters and returned as elements
+    /// of an LLVM struct instead of through the CPU struct. All other
+    /// parameters and return values have type i64.
+    struct RegDesc {
+        Arch arch;
+        llvm::CallingConv::ID llvm_cc;
+        unsigned sptr_idx;
+        unsigned num_params;
+        unsigned num_rets;
+        /// Register, parameter index and return struct index.
+        std::vector<std::tuple<ArchReg, unsigned, unsigned>> regs;
     };
 
+    /// Calling convention where regs (GP registers or the instruction
+    /// pointer) are passed in this order after the CPU struct pointer.
+    /// Returns INVALID if a register is not stored in the CPU struct as I64 or
+    /// listed twice.
+    static CallConv FromRegs(Arch arch, llvm::ArrayRef<ArchReg> regs);
+    /// Like FromRegs, with the registers given by their CPU struct offsets.
+    static CallConv FromRegOffsets(Arch arch, llvm::ArrayRef<size_t> offsets);
+
+    /// Determine the calling convention of fn. As REGS cannot be inferred from
+    /// the function type, hint is returned if its function type matches.
     static CallConv FromFunction(llvm::Function* fn, Arch arch);
+    static CallConv FromFunction(llvm::Function* fn, Arch arch,
+                                 const CallConv& hint);
+
+    Arch GetArch() const;
 
     llvm::FunctionType* FnType(llvm::LLVMContext& ctx,
                                unsigned sptr_addrspace) const;
     llvm::CallingConv::ID FnCallConv() const;
     unsigned CpuStructParamIdx() const;
 
-    void InitSptrs(BasicBlock* bb, FunctionInfo& fi);
+    /// Constant values of registers at function entry, indexed by their offset
+    /// in the (default) CPU struct layout.
+    using ConstRegs = std::unordered_map<unsigned, uint64_t>;
+    /// Default CPU struct offset of the integer register with the given name,
+    /// or std::nullopt if there is no such register.
+    std::optional<unsigned> IntRegOffset(llvm::StringRef name) const;
+
+    /// Custom CPU struct layout: offsets of the CPU struct entries, indexed by
+    /// their offset in the default layout.
+    using Layout = std::unordered_map<unsigned, unsigned>;
+    /// Whether an entry of the given size is at default_off in the default
+    /// layout, and off is naturally aligned for it.
+    bool IsValidLayoutEntry(size_t default_off, size_t off, size_t size) const;
+
+    /// Create pointers to the CPU struct entries. With a custom layout, entries
+    /// not in the layout are stored in a scratch alloca of the function.
+    void InitSptrs(BasicBlock* bb, FunctionInfo& fi, const Layout& layout);
 
     // Pack values from regfile into the CPU struct. The return value for the
     // function is returned (or NULL for void).
     llvm::ReturnInst* Return(BasicBlock* bb, FunctionInfo& fi) const;
 
     // Unpack values from val (usually the function) into the register file. For
-    // SPTR, val can also be the CPU struct pointer directly.
-    void UnpackParams(BasicBlock* bb, FunctionInfo& fi) const;
+    // SPTR, val can also be the CPU struct pointer directly. Registers not in
+    // live_in are not loaded and undefined instead, registers in const_regs
+    // are set to their constant value.
+    void UnpackParams(BasicBlock* bb, FunctionInfo& fi,
+                      const RegisterSet& live_in,
+                      const ConstRegs& const_regs) const;
 
     /// Call the function fn at the end of block bb of the lifted function fi.
     llvm::CallInst* Call(llvm::Function* fn, BasicBlock* bb, FunctionInfo& fi,
                          bool tail_call = false);
 
     /// Optimize a function's CallConvPacks to minimize the number of store
-    /// instructions passed to the LLVM optimizer.
-    void OptimizePacks(FunctionInfo& fi, BasicBlock* entry);
+    /// instructions passed to the LLVM optimizer. Registers not in live_out
+    /// are not stored when leaving the function.
+    void OptimizePacks(FunctionInfo& fi, BasicBlock* entry,
+                       const RegisterSet& live_out);
+
+    /// Compute the set of registers stored at the given CPU struct offsets.
+    /// Returns false if an offset does not refer to a register.
+    bool RegsAtOffsets(llvm::ArrayRef<size_t> offsets, RegisterSet& regs) const;
 
     CallConv() = default;
-    constexpr CallConv(Value value) : value(value) {}
+    CallConv(Value value);
     operator Value() const { return value; }
     explicit operator bool() = delete;
+    /// Entry of reg in the register description, or nullptr if reg is passed
+    /// through the CPU struct.
+    const std::tuple<ArchReg, unsigned, unsigned>* FindReg(ArchReg reg) const;
+
 private:
-    Value value;
+    CallConv(Value value, std::shared_ptr<const RegDesc> reg_desc)
+        : value(value), reg_desc(std::move(reg_desc)) {}
+
+    Value value = INVALID;
+    /// Shared between copies, set for X86_64_HHVM and REGS.
+    std::shared_ptr<const RegDesc> reg_desc;
 };
 
 } // namespace
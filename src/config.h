@@ -26,9 +26,13 @@
 
 #include "arch.h"
 #include "callconv.h"
+#include "regfile.h"
 #include <cstdbool>
 #include <cstdint>
+#include <functional>
+#include <map>
 #include <unordered_map>
+#include <vector>
 
 
 namespace llvm {
@@ -54,10 +58,28 @@ struct LLConfig {
     bool full_facets = false;
     /// Verify the IR after lifting.
     bool verify_ir = false;
+    /// Move stack frame slots which are only accessed at constant offsets from
+    /// the stack pointer into an alloca, see PromoteStackFrame.
+    bool promote_stack_frame = false;
+    /// Assume that guest memory accesses never alias the CPU struct, and mark
+    /// them with alias scope metadata accordingly.
+    bool cpu_struct_noalias = false;
     /// Don't use absolute instruction addresses to set RIP. The actual RIP is
     /// supplied as in the RIP register field of the CPU struct.
     bool position_independent_code = false;
 
+    /// Registers read by the lifted function before writing them. Others are
+    /// not loaded from the CPU struct at entry; the instruction pointer is
+    /// always loaded.
+    RegisterSet live_in = ~RegisterSet();
+    /// Registers read after leaving the lifted function through a return or a
+    /// tail call. Others are not stored to the CPU struct at exits.
+    RegisterSet live_out = ~RegisterSet();
+    /// Registers with a known constant value at function entry, indexed by
+    /// their offset in the default CPU struct layout. These are not loaded
+    /// from the CPU struct.
+    CallConv::ConstRegs const_regs;
+
     /// Instruction Set Architecture of the code to lift.
     Arch arch = Arch::DEFAULT;
 
@@ -65,18 +87,52 @@ struct LLConfig {
     CallConv callconv = CallConv::X86_64_SPTR;
     /// Address space for CPU struct pointer parameter
     unsigned sptr_addrspace = 0;
+    /// Custom layout of the CPU struct, empty for the default layout.
+    CallConv::Layout cpu_struct_layout;
+    /// Size of the CPU struct with the custom layout.
+    size_t cpu_struct_size = 0;
+    /// Alignment of the CPU struct with the custom layout, i.e. the size of
+    /// its largest entry.
+    size_t cpu_struct_align = 1;
 
     /// The global offset base
     uintptr_t global_base_addr = 0;
     /// The global variable used to access constant memory regions. Points to
     /// globalOffsetBase.
     llvm::Value* global_base_value = nullptr;
+    /// Read-only memory ranges with known contents, indexed by their start
+    /// address. Loads entirely within one range are folded into constants.
+    /// The ranges must not overlap.
+    std::map<uint64_t, std::vector<uint8_t>> const_memory;
+    /// Reader for read-only memory outside of const_memory, e.g. .rodata or a
+    /// relocated GOT. Returns the number of bytes copied, which is less than
+    /// requested if the range is not entirely read-only. Must be thread-safe
+    /// when used for batch lifting.
+    std::function<size_t(uintptr_t, uint8_t*, size_t)> const_memory_reader;
+
+    /// A data section of the guest program represented by an LLVM global.
+    struct DataSection {
+        uint64_t size;
+        llvm::Value* global;
+    };
+    /// Known data sections, indexed by their start address. Constant addresses
+    /// inside a section become a GEP on its global instead of an inttoptr.
+    /// Sections must not overlap.
+    std::map<uint64_t, DataSection> data_sections;
 
     /// Base address for PC-relative addressing.
     uintptr_t pc_base_addr = 0;
     /// Base address value for PC-relative addressing.
     llvm::Value* pc_base_value = nullptr;
 
+    /// For indirect branches and returns with an unknown target, first switch
+    /// over all addresses of lifted blocks before leaving the function.
+    bool indirect_branch_switch = false;
+    /// Known (e.g., profiled) targets of indirect branches, indexed by the
+    /// address of the branch instruction. These are decoded and dispatched to
+    /// directly with a switch.
+    std::unordered_map<uint64_t, std::vector<uint64_t>> indirect_targets;
+
     /// Overridden implementations for specific instruction. The function must
     /// take a pointer to the CPU state as a single argument.
     std::unordered_map<uint32_t, llvm::Function*> instr_overrides;
@@ -85,6 +141,13 @@ struct LLConfig {
     /// returning.
     llvm::Function* tail_function = nullptr;
 
+    /// Already lifted functions, indexed by their entry address. Branches to
+    /// a constant address outside of the lifted function which matches one of
+    /// these become a direct tail call instead of leaving through the
+    /// tail_function or a return. The functions must have the same signature
+    /// as the lifted function.
+    std::unordered_map<uint64_t, llvm::Function*> known_functions;
+
     /// If non-null, this function is called on a call instruction. Decoding
     /// continues after the CALL instruction as if the instruction did not
     /// modify control flow (albeit checking that the RIP matches). A return
@@ -104,6 +167,15 @@ struct LLConfig {
     ///     { i64 (ecx:eax), i64 (ebx:edx) } (i32 %eax, i32 %ecx)
     llvm::Function* cpuinfo_function = nullptr;
 
+    /// Optional helper functions for REPNE SCASB and REPE CMPSB, used for
+    /// 64-bit addressing if DF is clear and RCX is non-zero. They return the
+    /// number of compared bytes (between 1 and %count), including the byte
+    /// which terminated the comparison, if any. Signatures:
+    ///     i64 (ptr %rdi, i8 %al, i64 %count) -- stops at the first byte == %al
+    ///     i64 (ptr %rsi, ptr %rdi, i64 %count) -- stops at the first mismatch
+    llvm::Function* repne_scasb_function = nullptr;
+    llvm::Function* repe_cmpsb_function = nullptr;
+
     /// Function which is called before the instruction code is lifted. The
     /// function takes the value of RIP (which points at the end of the
     /// instruction) and a metadata containing an MDString with the FdInstr.
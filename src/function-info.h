@@ -25,13 +25,18 @@
 #define RELLUME_FUNCTION_INFO_H
 
 #include "regfile.h"
+#include <llvm/IR/Instruction.h>
+#include <llvm/IR/LLVMContext.h>
 #include <cstdbool>
 #include <cstdint>
+#include <unordered_map>
 #include <vector>
 
 
 namespace llvm {
+class BasicBlock;
 class Function;
+class MDNode;
 class StoreInst;
 class Value;
 }
@@ -78,6 +83,18 @@ struct CallConvPack {
     RegisterSet block_dirty_regs;
     BasicBlock* bb;
     std::vector<llvm::StoreInst*> stores;
+    /// Whether the pack leaves the function, i.e. a return or a tail call.
+    bool exit;
+};
+
+/// Statistics collected while lifting a function, see ll_func_get_stats.
+struct FunctionStats {
+    /// Number of PHI nodes created during SSA construction.
+    uint64_t phis_created;
+    /// Number of PHI nodes removed again, because they were trivial or unused.
+    uint64_t phis_removed;
+    /// Number of flag computations omitted, because the flag was dead.
+    uint64_t flags_skipped;
 };
 
 /// FunctionInfo holds the LLVM objects of the lifted function and its
@@ -94,6 +111,25 @@ struct FunctionInfo {
     /// The sptr argument, and its elements
     llvm::Value* sptr_raw;
     std::vector<llvm::Value*> sptr;
+    /// Alias scope lists for accesses to the CPU struct and to guest memory,
+    /// see LLConfig::cpu_struct_noalias. Null if not enabled.
+    llvm::MDNode* cpu_alias_scope;
+    llvm::MDNode* guest_alias_scope;
+
+    /// Mark an access to guest memory (including the stack) or to the CPU
+    /// struct with the alias scopes, if enabled.
+    void SetGuestAliasScope(llvm::Instruction* inst) const {
+        if (!guest_alias_scope)
+            return;
+        inst->setMetadata(llvm::LLVMContext::MD_alias_scope, guest_alias_scope);
+        inst->setMetadata(llvm::LLVMContext::MD_noalias, cpu_alias_scope);
+    }
+    void SetCpuAliasScope(llvm::Instruction* inst) const {
+        if (!cpu_alias_scope)
+            return;
+        inst->setMetadata(llvm::LLVMContext::MD_alias_scope, cpu_alias_scope);
+        inst->setMetadata(llvm::LLVMContext::MD_noalias, guest_alias_scope);
+    }
 
     /// Address of the first lifted instruction. The LLVM entry block
     /// immediately branches to it.
@@ -102,6 +138,17 @@ struct FunctionInfo {
     llvm::Value* pc_base_value;
 
     std::vector<CallConvPack> call_conv_packs;
+
+    /// Flags which may be read after the instruction currently lifted. Flags
+    /// not in this set are not computed at all.
+    RegisterSet live_flags;
+
+    /// Alignment of pointers known from preceding accesses which fault when
+    /// misaligned, see LifterBase::RecordAlignment. Only valid in align_block.
+    llvm::BasicBlock* align_block;
+    std::unordered_map<llvm::Value*, unsigned> known_align;
+
+    FunctionStats stats;
 };
 
 
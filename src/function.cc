@@ -33,20 +33,20 @@
 #include "x86-64/lifter.h"
 #include "rv64/lifter.h"
 #include "regfile.h"
+#include "stackframe.h"
 #include <llvm/ADT/DepthFirstIterator.h>
 #include <llvm/ADT/SmallVector.h>
 #include <llvm/IR/DerivedTypes.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/GlobalValue.h>
-#include <llvm/IR/InstIterator.h>
-#include <llvm/IR/Intrinsics.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Type.h>
 #include <llvm/IR/Verifier.h>
 #include <llvm/Transforms/Utils/BasicBlockUtils.h>
 #include <cassert>
 #include <cstdint>
-#include <memory>
-#include <unordered_map>
+#include <vector>
 
 
 /**
@@ -70,11 +70,20 @@ Function::Function(llvm::Module* mod, LLConfig* cfg) : cfg(cfg), fi{}
     llvm->addFnAttr(llvm::Attribute::NullPointerIsValid);
     llvm->addParamAttr(cpu_param_idx, llvm::Attribute::NoAlias);
     llvm->addParamAttr(cpu_param_idx, llvm::Attribute::NoCapture);
-    auto align_attr = llvm::Attribute::get(ctx, llvm::Attribute::Alignment, 16);
+    size_t cpu_struct_size = 0x190;
+    size_t cpu_struct_align = 16;
+    if (!cfg->cpu_struct_layout.empty()) {
+        cpu_struct_size = cfg->cpu_struct_size;
+        cpu_struct_align = cfg->cpu_struct_align;
+    }
+    auto align_attr = llvm::Attribute::get(ctx, llvm::Attribute::Alignment,
+                                           cpu_struct_align);
     llvm->addParamAttr(cpu_param_idx, align_attr);
-    llvm->addDereferenceableParamAttr(cpu_param_idx, 0x190);
+    llvm->addDereferenceableParamAttr(cpu_param_idx, cpu_struct_size);
 
     fi.fn = llvm;
+    // Without liveness information from Decode, all flags are live.
+    fi.live_flags.set();
     fi.sptr_raw = &llvm->arg_begin()[cpu_param_idx];
     if (cfg->pc_base_value) {
         fi.pc_base_addr = cfg->pc_base_addr;
@@ -83,14 +92,25 @@ Function::Function(llvm::Module* mod, LLConfig* cfg) : cfg(cfg), fi{}
         fi.pc_base_value = nullptr;
     }
 
+    if (cfg->cpu_struct_noalias) {
+        llvm::MDBuilder mdb(ctx);
+        llvm::MDNode* domain = mdb.createAnonymousAliasScopeDomain("rellume");
+        llvm::MDNode* cpu = mdb.createAnonymousAliasScope(domain, "cpu");
+        llvm::MDNode* guest = mdb.createAnonymousAliasScope(domain, "guest");
+        fi.cpu_alias_scope = llvm::MDNode::get(ctx, cpu);
+        fi.guest_alias_scope = llvm::MDNode::get(ctx, guest);
+    }
+
     // Create entry basic block as first block in the function.
-    entry_block = std::make_unique<ArchBasicBlock>(llvm,
-                                                   BasicBlock::Phis::NONE, cfg->arch);
+    entry_block = arena.CreateArchBlock(llvm, BasicBlock::Phis::NONE,
+                                        cfg->arch, phi_tracker);
 
     // Initialize the sptr pointers in the function info.
-    cfg->callconv.InitSptrs(entry_block->GetInsertBlock(), fi);
+    cfg->callconv.InitSptrs(entry_block->GetInsertBlock(), fi,
+                            cfg->cpu_struct_layout);
     // And initially fill register file.
-    cfg->callconv.UnpackParams(entry_block->GetInsertBlock(), fi);
+    cfg->callconv.UnpackParams(entry_block->GetInsertBlock(), fi, cfg->live_in,
+                               cfg->const_regs);
 }
 
 Function::~Function() {
@@ -123,14 +143,14 @@ bool Function::AddInst(uint64_t block_addr, const Instr& inst)
             fi.pc_base_value = entry_rf->GetReg(ArchReg::IP, Facet::I64);
         }
     }
-    if (block_map.find(block_addr) == block_map.end()) {
+    ArchBasicBlock*& ab_ptr = block_map[block_addr];
+    if (!ab_ptr) {
         auto phi_mode =
             cfg->full_facets ? BasicBlock::Phis::ALL : BasicBlock::Phis::NATIVE;
-        block_map[block_addr] = std::make_unique<ArchBasicBlock>(llvm, phi_mode,
-                                                                 cfg->arch);
+        ab_ptr = arena.CreateArchBlock(llvm, phi_mode, cfg->arch, phi_tracker);
     }
 
-    ArchBasicBlock& ab = *block_map[block_addr];
+    ArchBasicBlock& ab = *ab_ptr;
     switch (cfg->arch) {
 #ifdef RELLUME_WITH_X86_64
     case Arch::X86_64: return x86_64::LiftInstruction(inst, fi, *cfg, ab);
@@ -172,76 +192,169 @@ ArchBasicBlock& Function::ResolveAddr(llvm::Value* addr) {
     }
 
     if (auto const_addr = llvm::dyn_cast<llvm::ConstantInt>(addr)) {
-        auto block_it = block_map.find(addr_skew + const_addr->getZExtValue());
+        uint64_t target = addr_skew + const_addr->getZExtValue();
+        auto block_it = block_map.find(target);
         if (block_it != block_map.end())
             return *(block_it->second);
+        auto known_it = cfg->known_functions.find(target);
+        if (known_it != cfg->known_functions.end())
+            return ChainBlock(target, known_it->second);
     }
     return *exit_block;
 }
 
+ArchBasicBlock& Function::ChainBlock(uint64_t addr, llvm::Function* target) {
+    ArchBasicBlock*& ab_ptr = chain_blocks[addr];
+    if (ab_ptr)
+        return *ab_ptr;
+
+    auto phi_mode =
+        cfg->full_facets ? BasicBlock::Phis::ALL : BasicBlock::Phis::NATIVE;
+    ab_ptr = arena.CreateArchBlock(llvm, phi_mode, cfg->arch, phi_tracker);
+    // Chain directly to the other function, skipping the tail_function.
+    cfg->callconv.Call(target, ab_ptr->GetInsertBlock(), fi, true);
+    return *ab_ptr;
+}
+
+void Function::BranchIndirect(ArchBasicBlock& ab, llvm::Value* addr,
+                              llvm::ArrayRef<uint64_t> targets,
+                              ArchBasicBlock& def) {
+    llvm::SmallVector<std::pair<uint64_t, ArchBasicBlock*>, 16> cases;
+    for (uint64_t target : targets) {
+        auto block_it = block_map.find(target);
+        if (block_it != block_map.end())
+            cases.emplace_back(target - fi.pc_base_addr, block_it->second);
+    }
+    if (cases.empty()) {
+        ab.BranchTo(def);
+        return;
+    }
+
+    // Switch on the offset to the PC base, so that this also works for
+    // position-independent code. Unknown targets branch to def.
+    llvm::IRBuilder<> irb(ab.GetInsertBlock()->GetRegFile()->GetInsertBlock());
+    llvm::Value* offset = irb.CreateSub(addr, fi.pc_base_value);
+    ab.SwitchTo(offset, def, cases);
+}
+
+ArchBasicBlock& Function::DispatchBlock() {
+    if (dispatch_block)
+        return *dispatch_block;
+
+    auto phi_mode =
+        cfg->full_facets ? BasicBlock::Phis::ALL : BasicBlock::Phis::NATIVE;
+    dispatch_block = arena.CreateArchBlock(llvm, phi_mode, cfg->arch,
+                                           phi_tracker);
+
+    // Every lifted block is a possible target of an unknown branch. The target
+    // address is the instruction pointer, which gets a PHI node over all
+    // branch sites.
+    std::vector<uint64_t> block_addrs;
+    block_addrs.reserve(block_map.size());
+    for (const auto& item : block_map)
+        block_addrs.push_back(item.first);
+    llvm::sort(block_addrs);
+    RegFile* regfile = dispatch_block->GetInsertBlock()->GetRegFile();
+    llvm::Value* addr = regfile->GetReg(ArchReg::IP, Facet::I64);
+    BranchIndirect(*dispatch_block, addr, block_addrs, *exit_block);
+    return *dispatch_block;
+}
+
 llvm::Function* Function::Lift() {
     if (block_map.size() == 0)
         return nullptr;
 
     auto phi_mode =
         cfg->full_facets ? BasicBlock::Phis::ALL : BasicBlock::Phis::NATIVE;
-    exit_block = std::make_unique<ArchBasicBlock>(llvm, phi_mode, cfg->arch);
+    exit_block = arena.CreateArchBlock(llvm, phi_mode, cfg->arch, phi_tracker);
 
     // Exit block packs values together and optionally returns something.
     if (cfg->tail_function) {
-        CallConv cconv = CallConv::FromFunction(cfg->tail_function, cfg->arch);
+        CallConv cconv = CallConv::FromFunction(cfg->tail_function, cfg->arch,
+                                                cfg->callconv);
         // Force a tail call to the specified function.
         cconv.Call(cfg->tail_function, exit_block->GetInsertBlock(), fi, true);
     } else {
         cfg->callconv.Return(exit_block->GetInsertBlock(), fi);
     }
 
+    llvm::Value* entry_sp = nullptr;
+    if (cfg->promote_stack_frame) {
+        ArchReg sp_reg = ArchReg::INVALID;
+        switch (cfg->arch) {
+#ifdef RELLUME_WITH_X86_64
+        case Arch::X86_64: sp_reg = ArchReg::RSP; break;
+#endif // RELLUME_WITH_X86_64
+#ifdef RELLUME_WITH_RV64
+        case Arch::RV64: sp_reg = ArchReg::GP(2); break;
+#endif // RELLUME_WITH_RV64
+#ifdef RELLUME_WITH_AARCH64
+        case Arch::AArch64: sp_reg = ArchReg::A64_SP; break;
+#endif // RELLUME_WITH_AARCH64
+        default: break;
+        }
+        if (sp_reg.Kind() != ArchReg::RegKind::INVALID) {
+            RegFile* entry_rf = entry_block->GetInsertBlock()->GetRegFile();
+            entry_sp = entry_rf->GetReg(sp_reg, Facet::I64);
+        }
+    }
+
     entry_block->BranchTo(*block_map[fi.entry_ip]);
 
+    // Blocks found by a linear sweep are often only reachable through
+    // indirect branches.
+    bool dispatch = cfg->indirect_branch_switch || linear_sweep;
     for (auto it = block_map.begin(); it != block_map.end(); ++it) {
         RegFile* regfile = it->second->GetInsertBlock()->GetRegFile();
         if (regfile->GetInsertBlock()->getTerminator())
             continue;
         llvm::Value* next_rip = regfile->GetReg(ArchReg::IP, Facet::I64);
+        auto targets_it = indirect_targets.find(it->first);
+        // The IP of an instruction which could not be lifted is not folded
+        // (see LifterBase::SetIP); dispatching on it would loop forever.
+        bool can_dispatch = dispatch && !llvm::isa<llvm::BitCastInst>(next_rip);
         if (auto select = llvm::dyn_cast<llvm::SelectInst>(next_rip)) {
             it->second->BranchTo(select->getCondition(),
                                  ResolveAddr(select->getTrueValue()),
                                  ResolveAddr(select->getFalseValue()));
+        } else if (targets_it != indirect_targets.end() &&
+                   &ResolveAddr(next_rip) == exit_block) {
+            // Other targets may still be lifted blocks.
+            ArchBasicBlock& def = can_dispatch ? DispatchBlock() : *exit_block;
+            BranchIndirect(*it->second, next_rip, targets_it->second, def);
+        } else if (can_dispatch && !llvm::isa<llvm::Constant>(next_rip) &&
+                   &ResolveAddr(next_rip) == exit_block) {
+            // All sites share a single switch over the lifted blocks.
+            it->second->BranchTo(DispatchBlock());
         } else {
             it->second->BranchTo(ResolveAddr(next_rip));
         }
     }
 
-    cfg->callconv.OptimizePacks(fi, entry_block->GetInsertBlock());
-
-    // Walk over blocks as long as phi nodes could have been added. We stop when
-    // alls phis are filled.
-    // TODO: improve walk ordering and efficiency (e.g. by adding predecessors
-    // to the set of remaining blocks when something changed)
-    bool changed = true;
-    while (changed) {
-        changed = false;
-        for (auto& item : block_map)
-            changed |= item.second->FillPhis();
-        changed |= exit_block->FillPhis();
-    }
-
-    // Remove calls to llvm.ssa_copy, which got inserted to avoid PHI nodes in
-    // the register file.
-    for (auto it = llvm::inst_begin(llvm), e = llvm::inst_end(llvm); it != e;) {
-        llvm::Instruction* inst = &*it++;
-        auto* intr = llvm::dyn_cast<llvm::CallInst>(inst);
-        if (!intr || intr->getIntrinsicID() != llvm::Intrinsic::ssa_copy)
-          continue;
-
-        inst->replaceAllUsesWith(intr->getOperand(0));
-        inst->eraseFromParent();
-    }
+    cfg->callconv.OptimizePacks(fi, entry_block->GetInsertBlock(),
+                                cfg->live_out);
+
+    // All predecessors are known now, so seal all blocks. This completes the
+    // PHI nodes which were created while lifting the instructions.
+    entry_block->Seal();
+    for (auto& item : block_map)
+        item.second->Seal();
+    exit_block->Seal();
+    if (dispatch_block)
+        dispatch_block->Seal();
+    for (auto& item : chain_blocks)
+        item.second->Seal();
+    phi_tracker.Finalize();
+    fi.stats.phis_created = phi_tracker.NumCreated();
+    fi.stats.phis_removed = phi_tracker.NumRemoved();
 
     // Remove blocks without predecessors. This can happen if constants get
     // folded already during construction, e.g. xor eax,eax;test eax,eax;jz
     llvm::EliminateUnreachableBlocks(*llvm);
 
+    if (entry_sp)
+        PromoteStackFrame(llvm, fi.sptr_raw, entry_sp);
+
     if (cfg->verify_ir && llvm::verifyFunction(*(llvm), &llvm::errs()))
         return nullptr;
 
@@ -24,17 +24,19 @@
 #ifndef LL_FUNCTION_H
 #define LL_FUNCTION_H
 
+#include "basicblock.h"
 #include "function-info.h"
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/DenseMap.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/Value.h>
 #include <cstdint>
 #include <functional>
-#include <unordered_map>
+#include <vector>
 
 
 namespace rellume {
 
-class ArchBasicBlock;
 class Instr;
 class LLConfig;
 
@@ -55,26 +57,61 @@ public:
     bool AddInst(uint64_t block_addr, const Instr& inst);
     llvm::Function* Lift();
 
+    const FunctionStats& GetStats() const {
+        return fi.stats;
+    }
+
     // Implemented in lldecoder.cc
     enum class DecodeStop {
         INSTR,
         BASICBLOCK,
         ALL,
+        /// Sweep over all instructions of the memory regions passed to Decode
+        /// and split blocks at all discovered branch targets.
+        LINEAR,
     };
     using MemReader = std::function<size_t(uintptr_t, uint8_t*, size_t)>;
     int Decode(uintptr_t addr, DecodeStop stop, MemReader memacc = nullptr);
 
+    /// A contiguous, non-overlapping region of guest memory mapped at buf.
+    struct MemRegion {
+        uintptr_t addr;
+        const uint8_t* buf;
+        size_t size;
+    };
+    /// Decode directly from the memory regions; memacc (if set) is only used
+    /// for addresses outside of the regions.
+    int Decode(uintptr_t addr, DecodeStop stop,
+               llvm::ArrayRef<MemRegion> regions, MemReader memacc = nullptr);
+
 private:
     ArchBasicBlock& ResolveAddr(llvm::Value* addr);
+    ArchBasicBlock& ChainBlock(uint64_t addr, llvm::Function* target);
+    void BranchIndirect(ArchBasicBlock& ab, llvm::Value* addr,
+                        llvm::ArrayRef<uint64_t> targets, ArchBasicBlock& def);
+    ArchBasicBlock& DispatchBlock();
 
     LLConfig* cfg;
     FunctionInfo fi;
+    PhiTracker phi_tracker;
+    /// Owns all blocks, must outlive the pointers below.
+    BlockArena arena;
 
     llvm::Function* llvm;
     uint64_t entry_addr;
-    std::unique_ptr<ArchBasicBlock> entry_block;
-    std::unique_ptr<ArchBasicBlock> exit_block;
-    std::unordered_map<uint64_t,std::unique_ptr<ArchBasicBlock>> block_map;
+    ArchBasicBlock* entry_block = nullptr;
+    ArchBasicBlock* exit_block = nullptr;
+    /// Switch over all lifted blocks shared by indirect branches with unknown
+    /// targets, created on first use.
+    ArchBasicBlock* dispatch_block = nullptr;
+    /// Whether the blocks were decoded with DecodeStop::LINEAR.
+    bool linear_sweep = false;
+    llvm::DenseMap<uint64_t, ArchBasicBlock*> block_map;
+    /// Blocks which tail-call known functions, indexed by their address.
+    llvm::DenseMap<uint64_t, ArchBasicBlock*> chain_blocks;
+    /// Known targets of the indirect branch at the end of a block, e.g. from a
+    /// jump table, indexed by the block address.
+    llvm::DenseMap<uint64_t, std::vector<uint64_t>> indirect_targets;
 };
 
 }
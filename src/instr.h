@@ -45,6 +45,10 @@ namespace rellume {
 class Instr {
     Arch arch;
     unsigned char instlen;
+#ifdef RELLUME_WITH_AARCH64
+    /// Raw encoding, for properties not exposed by the decoder.
+    uint32_t a64_enc;
+#endif // RELLUME_WITH_AARCH64
     uint64_t addr;
     union {
 #ifdef RELLUME_WITH_X86_64
@@ -139,6 +143,10 @@ public:
         assert(arch == Arch::AArch64);
         return &_a64;
     }
+    uint32_t a64_encoding() const {
+        assert(arch == Arch::AArch64);
+        return a64_enc;
+    }
 #endif // RELLUME_WITH_AARCH64
 
     enum class Kind {
@@ -311,6 +319,7 @@ public:
 
             uint32_t binst = buf[0] | (buf[1] << 8) | (buf[2] << 16) | (buf[3] << 24);
             fad_decode(&binst, 1, &_a64);
+            a64_enc = binst;
             if (_a64.op == farmdec::A64_ERROR || _a64.op == farmdec::A64_UNKNOWN) {
                 return -1;
             }
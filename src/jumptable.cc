@@ -0,0 +1,332 @@
+/**
+ * This file is part of Rellume.
+ *
+ * (c) 2016-2019, Alexis Engelke <alexis.engelke@googlemail.com>
+ *
+ * Rellume is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * Rellume is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Rellume.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * \file
+ **/
+
+#include "jumptable.h"
+
+#include "arch.h"
+#include "instr.h"
+#include <llvm/ADT/ArrayRef.h>
+#include <cstdint>
+#include <optional>
+
+
+/**
+ * \defgroup LLJumpTable Jump Tables
+ * \brief Recognition of jump tables for indirect branches
+ *
+ * The recognition only determines the candidate targets for an indirect
+ * branch. The lifted code still computes the actual target, so a wrong guess
+ * merely leaves the function through the exit block.
+ *
+ * @{
+ **/
+
+namespace rellume {
+
+namespace {
+
+/// Abstract value of a register during jump table recognition.
+struct RegState {
+    enum Kind { UNKNOWN, INDEX, CONST, ENTRY };
+    Kind kind = UNKNOWN;
+    uint64_t value = 0; // for CONST
+    JumpTable table = {}; // for ENTRY
+};
+
+uint64_t Extend(uint64_t val, unsigned bits, bool sign) {
+    if (bits >= 64)
+        return val;
+    val &= (uint64_t{1} << bits) - 1;
+    if (sign && (val >> (bits - 1)) & 1)
+        val |= ~uint64_t{0} << bits;
+    return val;
+}
+
+#ifdef RELLUME_WITH_X86_64
+std::optional<IndexBound> BranchIndexBoundX86_64(const Instr& cmp,
+                                                 const Instr& jcc, bool taken) {
+    if (cmp.type() != FDI_CMP || !cmp.op(0).is_reg() || !cmp.op(1).is_imm())
+        return std::nullopt;
+    Instr::Reg reg = cmp.op(0).reg();
+    if (reg.rt != FD_RT_GPL || reg.ri >= 16 || cmp.op(1).imm() <= 0)
+        return std::nullopt;
+    uint64_t imm = cmp.op(1).imm();
+    switch (jcc.type()) {
+    case FDI_JA: if (!taken) return IndexBound{reg.ri, imm}; break;
+    case FDI_JBE: if (taken) return IndexBound{reg.ri, imm}; break;
+    case FDI_JNC: if (!taken) return IndexBound{reg.ri, imm - 1}; break;
+    case FDI_JC: if (taken) return IndexBound{reg.ri, imm - 1}; break;
+    default: break;
+    }
+    return std::nullopt;
+}
+
+std::optional<JumpTable> RecognizeJumpTableX86_64(llvm::ArrayRef<Instr> insts,
+                                                  const IndexBound& bound) {
+    RegState regs[16];
+    regs[bound.reg].kind = RegState::INDEX;
+
+    auto gp = [](Instr::Op op) -> int {
+        if (!op.is_reg() || op.reg().rt != FD_RT_GPL || op.reg().ri >= 16)
+            return -1;
+        return op.reg().ri;
+    };
+    // Table accessed by a memory operand [base+idx*size+disp], where base is
+    // constant and idx is the index register.
+    auto table_at = [&](const Instr& inst, Instr::Op op, JumpTable& jt) {
+        if (!op.is_mem() || op.addrsz() != 8)
+            return false;
+        Instr::Reg idx = op.index();
+        if (!idx || idx.ri >= 16 || regs[idx.ri].kind != RegState::INDEX ||
+            op.scale() != op.size())
+            return false;
+        uint64_t table = op.off();
+        if (Instr::Reg base = op.base()) {
+            if (base.ri == FD_REG_IP)
+                table += inst.end();
+            else if (base.ri < 16 && regs[base.ri].kind == RegState::CONST)
+                table += regs[base.ri].value;
+            else
+                return false;
+        }
+        jt = JumpTable{table, op.size(), false, 64, false, 0, 0, bound.max_idx};
+        return true;
+    };
+
+    for (const Instr& inst : insts.drop_back()) {
+        int dst = gp(inst.op(0));
+        if (dst < 0)
+            continue;
+        RegState res;
+        switch (inst.type()) {
+        case FDI_MOV:
+        case FDI_MOVZX:
+        case FDI_MOVSX:
+            if (int src = gp(inst.op(1)); src >= 0)
+                res = regs[src];
+            else if (inst.op(1).is_imm())
+                res.kind = RegState::CONST, res.value = inst.op(1).imm();
+            else if (table_at(inst, inst.op(1), res.table))
+                res.kind = RegState::ENTRY,
+                res.table.entry_signed = inst.type() == FDI_MOVSX;
+            break;
+        case FDI_LEA:
+            if (inst.op(1).index() || inst.op(1).addrsz() != 8)
+                break;
+            if (!inst.op(1).base())
+                res.kind = RegState::CONST, res.value = inst.op(1).off();
+            else if (inst.op(1).base().ri == FD_REG_IP)
+                res.kind = RegState::CONST,
+                res.value = inst.end() + inst.op(1).off();
+            break;
+        case FDI_ADD: {
+            int src = gp(inst.op(1));
+            if (src < 0 || inst.op(0).size() != 8)
+                break;
+            RegState& lhs = regs[dst];
+            RegState& rhs = regs[src];
+            if (lhs.kind == RegState::ENTRY && rhs.kind == RegState::CONST)
+                res = lhs, res.table.base += rhs.value;
+            else if (lhs.kind == RegState::CONST && rhs.kind == RegState::ENTRY)
+                res = rhs, res.table.base += lhs.value;
+            break;
+        }
+        default:
+            break;
+        }
+        regs[dst] = res;
+    }
+
+    const Instr& jmp = insts.back();
+    if (jmp.type() != FDI_JMP)
+        return std::nullopt;
+    JumpTable jt;
+    if (int reg = gp(jmp.op(0)); reg >= 0 && regs[reg].kind == RegState::ENTRY)
+        return regs[reg].table;
+    if (jmp.op(0).is_mem() && jmp.op(0).size() == 8 && table_at(jmp, jmp.op(0), jt))
+        return jt;
+    return std::nullopt;
+}
+#endif // RELLUME_WITH_X86_64
+
+#ifdef RELLUME_WITH_AARCH64
+std::optional<IndexBound> BranchIndexBoundAArch64(const farmdec::Inst& cmp,
+                                                  const farmdec::Inst& jcc,
+                                                  bool taken) {
+    if (cmp.op != farmdec::A64_CMP_IMM || jcc.op != farmdec::A64_BCOND)
+        return std::nullopt;
+    if (cmp.rn >= 31 || cmp.imm == 0)
+        return std::nullopt;
+    uint64_t imm = cmp.imm;
+    switch (fad_get_cond(jcc.flags)) {
+    case farmdec::COND_HI: if (!taken) return IndexBound{cmp.rn, imm}; break;
+    case farmdec::COND_LS: if (taken) return IndexBound{cmp.rn, imm}; break;
+    case farmdec::COND_HS: if (!taken) return IndexBound{cmp.rn, imm - 1}; break;
+    case farmdec::COND_LO: if (taken) return IndexBound{cmp.rn, imm - 1}; break;
+    default: break;
+    }
+    return std::nullopt;
+}
+
+bool IsSignExtend(farmdec::ExtendType ext) {
+    return ext == farmdec::SXTB || ext == farmdec::SXTH ||
+           ext == farmdec::SXTW || ext == farmdec::SXTX;
+}
+
+std::optional<JumpTable> RecognizeJumpTableAArch64(llvm::ArrayRef<Instr> insts,
+                                                   const IndexBound& bound) {
+    RegState regs[31];
+    regs[bound.reg].kind = RegState::INDEX;
+    auto reg = [&](farmdec::Reg r) -> RegState {
+        return r < 31 ? regs[r] : RegState{};
+    };
+
+    for (const Instr& inst : insts.drop_back()) {
+        const farmdec::Inst& a64 = *static_cast<const farmdec::Inst*>(inst);
+        bool w32 = a64.flags & farmdec::W32;
+        farmdec::Reg dst = a64.rd;
+        RegState res;
+        switch (a64.op) {
+        case farmdec::A64_ADR:
+            res.kind = RegState::CONST, res.value = inst.start() + a64.offset;
+            break;
+        case farmdec::A64_ADRP:
+            res.kind = RegState::CONST;
+            res.value = (inst.start() & ~uint64_t{4095}) + a64.offset;
+            break;
+        case farmdec::A64_ADD_IMM:
+            if (!w32 && reg(a64.rn).kind == RegState::CONST)
+                res.kind = RegState::CONST, res.value = reg(a64.rn).value + a64.imm;
+            break;
+        case farmdec::A64_MOV_REG:
+            res = reg(a64.rm);
+            break;
+        case farmdec::A64_LDR: {
+            dst = a64.rt;
+            farmdec::AddrMode mode = fad_get_addrmode(a64.flags);
+            farmdec::ExtendType ext = fad_get_mem_extend(a64.flags);
+            unsigned size = 1 << (ext & 3);
+            unsigned lsl;
+            if (mode == farmdec::AM_OFF_REG)
+                lsl = a64.shift.amount;
+            else if (mode == farmdec::AM_OFF_EXT)
+                lsl = a64.extend.lsl;
+            else
+                break;
+            // The offset register must be the index, not a byte offset.
+            if ((1u << lsl) != size && !(lsl == 0 && size == 1))
+                break;
+            if (reg(a64.rn).kind != RegState::CONST ||
+                reg(a64.rm).kind != RegState::INDEX)
+                break;
+            res.kind = RegState::ENTRY;
+            res.table = JumpTable{reg(a64.rn).value, size, IsSignExtend(ext),
+                                  64, false, 0, 0, bound.max_idx};
+            break;
+        }
+        case farmdec::A64_ADD_SHIFTED:
+        case farmdec::A64_ADD_EXT: {
+            RegState lhs = reg(a64.rn);
+            RegState rhs = reg(a64.rm);
+            if (w32 || lhs.kind != RegState::CONST ||
+                rhs.kind != RegState::ENTRY || rhs.table.base != 0)
+                break;
+            res = rhs;
+            res.table.base = lhs.value;
+            if (a64.op == farmdec::A64_ADD_EXT) {
+                auto ext = static_cast<farmdec::ExtendType>(a64.extend.type);
+                res.table.ext_bits = 8 << (ext & 3);
+                res.table.ext_signed = IsSignExtend(ext);
+                res.table.shift = a64.extend.lsl;
+            } else if (a64.shift.type == farmdec::SH_LSL) {
+                res.table.shift = a64.shift.amount;
+            } else {
+                res.kind = RegState::UNKNOWN;
+            }
+            break;
+        }
+        default:
+            // Conservatively forget the destination of loads, too.
+            if (a64.rt < 31)
+                regs[a64.rt] = RegState{};
+            break;
+        }
+        if (dst < 31)
+            regs[dst] = res;
+    }
+
+    const farmdec::Inst& br = *static_cast<const farmdec::Inst*>(insts.back());
+    if (br.op == farmdec::A64_BR && reg(br.rn).kind == RegState::ENTRY)
+        return reg(br.rn).table;
+    return std::nullopt;
+}
+#endif // RELLUME_WITH_AARCH64
+
+} // end anonymous namespace
+
+uint64_t JumpTable::Target(uint64_t entry) const {
+    uint64_t val = Extend(entry, entry_size * 8, entry_signed);
+    val = Extend(val, ext_bits, ext_signed);
+    return base + (val << shift);
+}
+
+std::optional<IndexBound> BranchIndexBound(Arch arch, const Instr& cmp,
+                                           const Instr& jcc, bool taken) {
+    switch (arch) {
+#ifdef RELLUME_WITH_X86_64
+    case Arch::X86_64:
+        return BranchIndexBoundX86_64(cmp, jcc, taken);
+#endif // RELLUME_WITH_X86_64
+#ifdef RELLUME_WITH_AARCH64
+    case Arch::AArch64:
+        return BranchIndexBoundAArch64(*static_cast<const farmdec::Inst*>(cmp),
+                                       *static_cast<const farmdec::Inst*>(jcc),
+                                       taken);
+#endif // RELLUME_WITH_AARCH64
+    default:
+        return std::nullopt;
+    }
+}
+
+std::optional<JumpTable> RecognizeJumpTable(Arch arch,
+                                            llvm::ArrayRef<Instr> insts,
+                                            const IndexBound& bound) {
+    switch (arch) {
+#ifdef RELLUME_WITH_X86_64
+    case Arch::X86_64:
+        return RecognizeJumpTableX86_64(insts, bound);
+#endif // RELLUME_WITH_X86_64
+#ifdef RELLUME_WITH_AARCH64
+    case Arch::AArch64:
+        return RecognizeJumpTableAArch64(insts, bound);
+#endif // RELLUME_WITH_AARCH64
+    default:
+        return std::nullopt;
+    }
+}
+
+} // namespace rellume
+
+/**
+ * @}
+ **/
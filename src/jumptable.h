@@ -0,0 +1,75 @@
+/**
+ * This file is part of Rellume.
+ *
+ * (c) 2016-2019, Alexis Engelke <alexis.engelke@googlemail.com>
+ *
+ * Rellume is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * Rellume is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Rellume.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * \file
+ **/
+
+#ifndef RELLUME_JUMPTABLE_H
+#define RELLUME_JUMPTABLE_H
+
+#include "arch.h"
+#include <llvm/ADT/ArrayRef.h>
+#include <cstdint>
+#include <optional>
+
+
+namespace rellume {
+
+class Instr;
+
+/// Upper bound of an index register, established by a compare and an unsigned
+/// conditional branch.
+struct IndexBound {
+    unsigned reg;
+    uint64_t max_idx;
+};
+
+/// Jump table of an indirect branch. The targets are computed as
+///   base + (ext(load(table + idx * entry_size)) << shift), idx <= max_idx,
+/// where the loaded entry is first sign- or zero-extended from its size and
+/// ext optionally extends again from ext_bits.
+struct JumpTable {
+    uint64_t table;
+    unsigned entry_size;
+    bool entry_signed;
+    unsigned ext_bits;
+    bool ext_signed;
+    unsigned shift;
+    uint64_t base;
+    uint64_t max_idx;
+
+    /// Compute the target from the raw table entry.
+    uint64_t Target(uint64_t entry) const;
+};
+
+/// Get the bound that the conditional branch jcc after cmp establishes for its
+/// target (if taken is true) or its fall-through successor.
+std::optional<IndexBound> BranchIndexBound(Arch arch, const Instr& cmp,
+                                           const Instr& jcc, bool taken);
+
+/// Recognize a jump table for the indirect branch at the end of insts, where
+/// bound holds at the first instruction.
+std::optional<JumpTable> RecognizeJumpTable(Arch arch,
+                                            llvm::ArrayRef<Instr> insts,
+                                            const IndexBound& bound);
+
+} // namespace rellume
+
+#endif
@@ -26,8 +26,18 @@
 #include "function-info.h"
 #include "instr.h"
 
+#include <llvm/ADT/APInt.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Analysis/ValueTracking.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DataLayout.h>
 #include <llvm/IR/Instruction.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Operator.h>
+#include <llvm/Support/KnownBits.h>
 #include <llvm/Transforms/Utils/Cloning.h>
+#include <algorithm>
+#include <optional>
 
 namespace rellume {
 
@@ -45,6 +55,22 @@ llvm::Value* LifterBase::AddrConst(uint64_t addr, llvm::PointerType* ptr_ty) {
     if (addr == 0)
         return llvm::ConstantPointerNull::get(ptr_ty);
 
+    // Addresses inside known data sections are relative to their global.
+    auto section_it = cfg.data_sections.upper_bound(addr);
+    if (section_it != cfg.data_sections.begin()) {
+        --section_it;
+        const auto& [start, section] = *section_it;
+        if (addr - start < section.size) {
+            // The global can have any type, offsets are in bytes.
+            unsigned as = section.global->getType()->getPointerAddressSpace();
+            auto base = irb.CreatePointerCast(section.global,
+                                              irb.getInt8PtrTy(as));
+            auto offset = irb.getInt64(addr - start);
+            auto ptr = irb.CreateGEP(irb.getInt8Ty(), base, offset);
+            return irb.CreatePointerCast(ptr, ptr_ty);
+        }
+    }
+
     if (cfg.global_base_value) {
         auto offset = irb.getInt64(addr - cfg.global_base_addr);
         auto ptr = irb.CreateGEP(irb.getInt8Ty(), cfg.global_base_value, offset);
@@ -54,8 +80,167 @@ llvm::Value* LifterBase::AddrConst(uint64_t addr, llvm::PointerType* ptr_ty) {
     return irb.CreateIntToPtr(irb.getInt64(addr), ptr_ty);
 }
 
+/// Strip constant offsets from a pointer or an address. Returns the base
+/// value and adds the stripped offset to off.
+static llvm::Value* StripConstOffset(const llvm::DataLayout& dl,
+                                     llvm::Value* v, int64_t& off) {
+    while (true) {
+        if (auto gep = llvm::dyn_cast<llvm::GEPOperator>(v)) {
+            llvm::APInt gep_off(64, 0);
+            if (!gep->accumulateConstantOffset(dl, gep_off))
+                return v;
+            off += gep_off.getSExtValue();
+            v = gep->getPointerOperand();
+            continue;
+        }
+        auto op = llvm::dyn_cast<llvm::Operator>(v);
+        if (!op)
+            return v;
+        switch (op->getOpcode()) {
+        case llvm::Instruction::BitCast:
+        case llvm::Instruction::IntToPtr:
+        case llvm::Instruction::PtrToInt:
+            if (dl.getTypeSizeInBits(op->getType()) != 64 ||
+                dl.getTypeSizeInBits(op->getOperand(0)->getType()) != 64)
+                return v;
+            v = op->getOperand(0);
+            break;
+        case llvm::Instruction::Add:
+        case llvm::Instruction::Sub:
+            if (auto c = llvm::dyn_cast<llvm::ConstantInt>(op->getOperand(1))) {
+                int64_t c_val = c->getSExtValue();
+                off += op->getOpcode() == llvm::Instruction::Add ? c_val : -c_val;
+                v = op->getOperand(0);
+                break;
+            }
+            return v;
+        default:
+            return v;
+        }
+    }
+}
+
+unsigned LifterBase::KnownAlignment(llvm::Value* ptr) {
+    // Larger alignments are not useful for code generation.
+    constexpr unsigned max_align_log2 = 6;
+
+    const llvm::DataLayout& dl = fi.fn->getParent()->getDataLayout();
+    int64_t off = 0;
+    llvm::Value* base = StripConstOffset(dl, ptr, off);
+
+    llvm::KnownBits known_bits = llvm::computeKnownBits(base, dl);
+    unsigned base_align_log2 = std::min(known_bits.countMinTrailingZeros(),
+                                        max_align_log2);
+    unsigned base_align = 1u << base_align_log2;
+    if (fi.align_block == irb.GetInsertBlock()) {
+        auto known_it = fi.known_align.find(base);
+        if (known_it != fi.known_align.end())
+            base_align = std::max(base_align, known_it->second);
+    }
+
+    if (off == 0)
+        return base_align;
+    // The alignment of the offset is its lowest set bit.
+    uint64_t off_bits = static_cast<uint64_t>(off);
+    return std::min<uint64_t>(base_align, off_bits & -off_bits);
+}
+
+void LifterBase::RecordAlignment(llvm::Value* ptr, unsigned align) {
+    if (fi.align_block != irb.GetInsertBlock()) {
+        fi.align_block = irb.GetInsertBlock();
+        fi.known_align.clear();
+    }
+
+    const llvm::DataLayout& dl = fi.fn->getParent()->getDataLayout();
+    int64_t off = 0;
+    llvm::Value* base = StripConstOffset(dl, ptr, off);
+    if (off % align != 0)
+        return;
+    unsigned& known = fi.known_align[base];
+    known = std::max(known, align);
+}
+
+std::optional<uint64_t> LifterBase::ConstAddr(llvm::Value* ptr) {
+    const llvm::DataLayout& dl = fi.fn->getParent()->getDataLayout();
+    llvm::APInt offset(64, 0);
+    llvm::Value* base = ptr->stripAndAccumulateConstantOffsets(dl, offset,
+                                                               true);
+    uint64_t addr = offset.getZExtValue();
+    if (llvm::isa<llvm::ConstantPointerNull>(base))
+        return addr;
+    if (cfg.global_base_value && base == cfg.global_base_value)
+        return addr + cfg.global_base_addr;
+    if (auto cast = llvm::dyn_cast<llvm::Operator>(base);
+        cast && cast->getOpcode() == llvm::Instruction::IntToPtr) {
+        llvm::Value* int_addr = cast->getOperand(0);
+        if (auto const_addr = llvm::dyn_cast<llvm::ConstantInt>(int_addr))
+            return addr + const_addr->getZExtValue();
+        // Position-independent code: the address is relative to the PC base.
+        if (auto add = llvm::dyn_cast<llvm::Operator>(int_addr);
+            add && add->getOpcode() == llvm::Instruction::Add &&
+            add->getOperand(0) == fi.pc_base_value) {
+            auto const_off = llvm::dyn_cast<llvm::ConstantInt>(add->getOperand(1));
+            if (!const_off)
+                return std::nullopt;
+            addr += const_off->getZExtValue();
+            int_addr = add->getOperand(0);
+        }
+        if (int_addr == fi.pc_base_value)
+            return addr + fi.pc_base_addr;
+        return std::nullopt;
+    }
+    for (const auto& [start, section] : cfg.data_sections)
+        if (base == section.global)
+            return addr + start;
+    return std::nullopt;
+}
+
+bool LifterBase::ReadConstMemory(uint64_t addr, size_t size, uint8_t* buf) {
+    auto range_it = cfg.const_memory.upper_bound(addr);
+    if (range_it != cfg.const_memory.begin()) {
+        --range_it;
+        const std::vector<uint8_t>& bytes = range_it->second;
+        uint64_t range_off = addr - range_it->first;
+        if (range_off < bytes.size() && bytes.size() - range_off >= size) {
+            std::copy_n(bytes.begin() + range_off, size, buf);
+            return true;
+        }
+    }
+
+    if (cfg.const_memory_reader)
+        return cfg.const_memory_reader(addr, buf, size) == size;
+    return false;
+}
+
+llvm::Constant* LifterBase::ConstLoad(llvm::Type* ty, llvm::Value* ptr) {
+    if (cfg.const_memory.empty() && !cfg.const_memory_reader)
+        return nullptr;
+    if (!ty->isIntOrIntVectorTy() && !ty->isFPOrFPVectorTy())
+        return nullptr;
+    // Other address spaces are used for segmented memory accesses.
+    if (ptr->getType()->getPointerAddressSpace() != 0)
+        return nullptr;
+
+    unsigned size = ty->getPrimitiveSizeInBits() / 8;
+    if (size == 0 || ty->getPrimitiveSizeInBits() != size * 8)
+        return nullptr;
+    std::optional<uint64_t> addr = ConstAddr(ptr);
+    if (!addr)
+        return nullptr;
+    llvm::SmallVector<uint8_t, 16> bytes(size);
+    if (!ReadConstMemory(*addr, size, bytes.data()))
+        return nullptr;
+
+    // All supported guest architectures are little-endian.
+    llvm::APInt value(size * 8, 0);
+    for (unsigned i = 0; i < size; i++)
+        value |= llvm::APInt(size * 8, bytes[i]).shl(i * 8);
+    auto const_int = llvm::ConstantInt::get(ty->getContext(), value);
+    return llvm::ConstantExpr::getBitCast(const_int, ty);
+}
+
 void LifterBase::CallExternalFunction(llvm::Function* fn) {
-    CallConv cconv = CallConv::FromFunction(fn, cfg.arch);
+    CallConv cconv = CallConv::FromFunction(fn, cfg.arch, cfg.callconv);
     llvm::CallInst* call = cconv.Call(fn, ablock.GetInsertBlock(), fi);
     assert(call && "failed to create call for external function");
 
@@ -35,6 +35,7 @@
 #include <llvm/IR/Instruction.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Operator.h>
+#include <optional>
 #include <vector>
 
 namespace rellume {
@@ -87,9 +88,24 @@ protected:
     llvm::Value* GetFlag(Facet facet) {
         return GetReg(ArchReg::EFLAGS, facet);
     }
+    /// Whether a flag can be read after the current instruction.
+    bool FlagLive(Facet facet) {
+        return fi.live_flags[RegisterSetBitIdx(ArchReg::EFLAGS, facet)];
+    }
     void SetFlag(Facet facet, llvm::Value* value) {
+        if (!FlagLive(facet)) {
+            fi.stats.flags_skipped++;
+            return;
+        }
         SetRegFacet(ArchReg::EFLAGS, facet, value);
     }
+    void SetFlagDeferred(Facet facet, RegFile::Generator gen, void* data) {
+        if (!FlagLive(facet)) {
+            fi.stats.flags_skipped++;
+            return;
+        }
+        regfile->SetRegDeferred(ArchReg::EFLAGS, facet, gen, data);
+    }
     void SetFlagUndef(std::initializer_list<Facet> facets) {
         llvm::Value* undef = llvm::UndefValue::get(irb.getInt1Ty());
         for (const auto facet : facets) {
@@ -107,6 +123,29 @@ protected:
 
     llvm::Value* AddrConst(uint64_t addr, llvm::PointerType* ptr_ty);
 
+    /// Mark a load or store as non-temporal, i.e. not to be kept in the cache.
+    void SetNonTemporal(llvm::Instruction* inst) {
+        llvm::Metadata* one = llvm::ConstantAsMetadata::get(irb.getInt32(1));
+        llvm::MDNode* node = llvm::MDNode::get(irb.getContext(), one);
+        inst->setMetadata(llvm::LLVMContext::MD_nontemporal, node);
+    }
+
+    /// Alignment of ptr in bytes, as far as known from the computation of the
+    /// address or from preceding accesses in the same LLVM basic block.
+    unsigned KnownAlignment(llvm::Value* ptr);
+    /// Record that ptr is aligned to align bytes, because the access at the
+    /// current position would have faulted otherwise.
+    void RecordAlignment(llvm::Value* ptr, unsigned align);
+
+    /// Guest address of ptr, if it is constant.
+    std::optional<uint64_t> ConstAddr(llvm::Value* ptr);
+    /// Read size bytes of read-only memory at addr into buf. Returns false if
+    /// the range is not known to be read-only.
+    bool ReadConstMemory(uint64_t addr, size_t size, uint8_t* buf);
+    /// Fold a load of ty from ptr into a constant if ptr is a constant address
+    /// of read-only memory. Returns nullptr otherwise.
+    llvm::Constant* ConstLoad(llvm::Type* ty, llvm::Value* ptr);
+
     // Helper function for older LLVM versions
     llvm::Value* CreateUnaryIntrinsic(llvm::Intrinsic::ID id, llvm::Value* v) {
         // TODO: remove this helper function
@@ -23,44 +23,235 @@
 #include "basicblock.h"
 #include "config.h"
 #include "instr.h"
+#include "jumptable.h"
+#include "regfile.h"
+#ifdef RELLUME_WITH_X86_64
+#include "x86-64/lifter.h"
+#endif // RELLUME_WITH_X86_64
 
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallVector.h>
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
 #include <deque>
+#include <iterator>
 #include <unordered_map>
 #include <vector>
 
 namespace rellume {
 
+namespace {
+
+using BlockList = std::vector<std::pair<size_t, size_t>>;
+using AddrMap = std::unordered_map<uintptr_t, std::pair<size_t, size_t>>;
+
+/// Maximum number of jump table entries read for an indirect branch.
+constexpr uint64_t max_jump_table_size = 4096;
+
+#ifdef RELLUME_WITH_X86_64
+/// Backward liveness analysis of the flags on the decoded CFG. Returns the set
+/// of flags live after each instruction, including the flags read by the
+/// instruction itself. All flags are live at exits and at unknown successors.
+std::vector<RegisterSet> FlagLiveness(const LLConfig& cfg,
+                                      std::vector<Instr>& insts,
+                                      const BlockList& blocks,
+                                      const AddrMap& addr_map) {
+    std::vector<RegisterSet> inst_use(insts.size());
+    std::vector<RegisterSet> inst_def(insts.size());
+    RegisterSet all_flags;
+    for (size_t i = 0; i < insts.size(); i++) {
+        x86_64::InstrFlags(insts[i], cfg, inst_use[i], inst_def[i]);
+        all_flags |= inst_use[i] | inst_def[i];
+    }
+
+    // Successor block indices, -1 stands for an exit.
+    std::vector<std::pair<long, long>> succs(blocks.size());
+    auto block_at = [&](uintptr_t addr) -> long {
+        auto it = addr_map.find(addr);
+        if (it == addr_map.end())
+            return -1;
+        auto [block_idx, inst_idx] = it->second;
+        return blocks[block_idx].first == inst_idx ? long(block_idx) : -1;
+    };
+    for (size_t i = 0; i < blocks.size(); i++) {
+        Instr& last = insts[blocks[i].second - 1];
+        auto jmp_target = last.JumpTarget();
+        switch (last.Kind()) {
+        case Instr::Kind::COND_BRANCH:
+            succs[i].first = block_at(last.end());
+            succs[i].second = jmp_target ? block_at(*jmp_target) : -1;
+            break;
+        case Instr::Kind::BRANCH:
+            succs[i].first = succs[i].second =
+                jmp_target ? block_at(*jmp_target) : -1;
+            break;
+        case Instr::Kind::OTHER:
+            succs[i].first = succs[i].second = block_at(last.end());
+            break;
+        default:
+            succs[i].first = succs[i].second = -1;
+            break;
+        }
+    }
+
+    // Summarize the blocks: gen is read before written, kill is written.
+    std::vector<RegisterSet> gen(blocks.size()), kill(blocks.size());
+    for (size_t i = 0; i < blocks.size(); i++) {
+        for (size_t j = blocks[i].second; j-- > blocks[i].first;) {
+            gen[i] = inst_use[j] | (gen[i] & ~inst_def[j]);
+            kill[i] |= inst_def[j];
+        }
+    }
+
+    std::vector<RegisterSet> live_in(blocks.size());
+    auto live_out = [&](size_t i) {
+        long s1 = succs[i].first, s2 = succs[i].second;
+        return (s1 < 0 ? all_flags : live_in[s1]) |
+               (s2 < 0 ? all_flags : live_in[s2]);
+    };
+    // Blocks are mostly ordered by address, so iterate in reverse order.
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = blocks.size(); i-- > 0;) {
+            RegisterSet new_in = gen[i] | (live_out(i) & ~kill[i]);
+            if (new_in != live_in[i]) {
+                live_in[i] = new_in;
+                changed = true;
+            }
+        }
+    }
+
+    std::vector<RegisterSet> live_after(insts.size());
+    for (size_t i = 0; i < blocks.size(); i++) {
+        RegisterSet live = live_out(i);
+        for (size_t j = blocks[i].second; j-- > blocks[i].first;) {
+            live_after[j] = live | inst_use[j];
+            live = inst_use[j] | (live & ~inst_def[j]);
+        }
+    }
+    return live_after;
+}
+#endif // RELLUME_WITH_X86_64
+
+} // end anonymous namespace
+
 int Function::Decode(uintptr_t addr, DecodeStop stop, MemReader memacc) {
+    return Decode(addr, stop, {}, memacc);
+}
+
+int Function::Decode(uintptr_t addr, DecodeStop stop,
+                     llvm::ArrayRef<MemRegion> regions, MemReader memacc) {
     Instr inst;
     uint8_t inst_buf[15];
 
+    llvm::SmallVector<MemRegion, 4> sorted_regions(regions.begin(),
+                                                   regions.end());
+    llvm::sort(sorted_regions, [](const MemRegion& a, const MemRegion& b) {
+        return a.addr < b.addr;
+    });
+    auto in_region = [](const MemRegion* region, uintptr_t fetch_addr) {
+        return region && fetch_addr - region->addr < region->size;
+    };
+    auto find_region = [&](uintptr_t fetch_addr) -> const MemRegion* {
+        auto it = llvm::upper_bound(sorted_regions, fetch_addr,
+                                    [](uintptr_t a, const MemRegion& r) {
+            return a < r.addr;
+        });
+        if (it == sorted_regions.begin() || !in_region(&*std::prev(it), fetch_addr))
+            return nullptr;
+        return &*std::prev(it);
+    };
+    // Consecutive instructions are almost always in the same region.
+    const MemRegion* cur_region = nullptr;
+    // Get the instruction bytes at fetch_addr, without copying if possible.
+    auto fetch = [&](uintptr_t fetch_addr, size_t& buf_sz) -> const uint8_t* {
+        if (!in_region(cur_region, fetch_addr))
+            cur_region = find_region(fetch_addr);
+        if (cur_region) {
+            size_t off = fetch_addr - cur_region->addr;
+            buf_sz = std::min(cur_region->size - off, sizeof(inst_buf));
+            // Instructions crossing the region end are read via memacc.
+            if (buf_sz == sizeof(inst_buf) || !memacc)
+                return cur_region->buf + off;
+        }
+        if (!memacc)
+            return nullptr;
+        buf_sz = memacc(fetch_addr, inst_buf, sizeof(inst_buf));
+        return inst_buf;
+    };
+
+    // A linear sweep continues after undecodable bytes at the next possible
+    // instruction boundary.
+    size_t inst_align = 1;
+#ifdef RELLUME_WITH_RV64
+    if (cfg->arch == Arch::RV64)
+        inst_align = 2;
+#endif // RELLUME_WITH_RV64
+#ifdef RELLUME_WITH_AARCH64
+    if (cfg->arch == Arch::AArch64)
+        inst_align = 4;
+#endif // RELLUME_WITH_AARCH64
+
     std::deque<uintptr_t> addr_queue;
     addr_queue.push_back(addr);
+    if (stop == DecodeStop::LINEAR) {
+        linear_sweep = true;
+        for (const MemRegion& region : sorted_regions)
+            addr_queue.push_back(region.addr);
+    }
 
     std::vector<Instr> insts;
     // List of (start_idx,end_idx) (non-inclusive end)
-    std::vector<std::pair<size_t, size_t>> blocks;
+    BlockList blocks;
 
     // Mapping from address to (block_idx, instr_idx)
-    std::unordered_map<uintptr_t, std::pair<size_t, size_t>> addr_map;
+    AddrMap addr_map;
+
+    // Read a jump table entry; tables are usually in one of the regions.
+    auto read_entry = [&](uintptr_t entry_addr, unsigned size, uint64_t& val) {
+        uint8_t entry_buf[8];
+        if (const MemRegion* region = find_region(entry_addr);
+            region && entry_addr - region->addr + size <= region->size) {
+            std::memcpy(entry_buf, region->buf + (entry_addr - region->addr), size);
+        } else if (!memacc || memacc(entry_addr, entry_buf, size) != size) {
+            return false;
+        }
+        val = 0;
+        for (unsigned i = 0; i < size; i++)
+            val |= uint64_t{entry_buf[i]} << (i * 8);
+        return true;
+    };
+    // Index bounds established by conditional branches for their successors.
+    std::unordered_map<uintptr_t, IndexBound> index_bounds;
+    // Jump table and profiled targets, indexed by the address of the indirect
+    // branch.
+    std::unordered_map<uintptr_t, std::vector<uint64_t>> table_targets;
 
     while (!addr_queue.empty()) {
         uintptr_t cur_addr = addr_queue.front();
         addr_queue.pop_front();
 
         size_t cur_block_start = insts.size();
+        // For a linear sweep, the address after the current block, if any.
+        uintptr_t sweep_addr = 0;
 
         auto cur_addr_entry = addr_map.find(cur_addr);
         while (cur_addr_entry == addr_map.end()) {
-            size_t inst_buf_sz = memacc(cur_addr, inst_buf, sizeof(inst_buf));
+            size_t inst_buf_sz = 0;
+            const uint8_t* buf = fetch(cur_addr, inst_buf_sz);
             // Sanity check.
-            if (inst_buf_sz == 0 || inst_buf_sz > sizeof(inst_buf))
+            if (!buf || inst_buf_sz == 0 || inst_buf_sz > sizeof(inst_buf)) {
+                sweep_addr = 0;
                 break;
+            }
 
-            int ret = inst.DecodeFrom(cfg->arch, inst_buf, inst_buf_sz, cur_addr);
-            if (ret < 0) // invalid or unknown instruction
+            int ret = inst.DecodeFrom(cfg->arch, buf, inst_buf_sz, cur_addr);
+            if (ret < 0) { // invalid or unknown instruction
+                sweep_addr = cur_addr + inst_align;
                 break;
+            }
 
             addr_map[cur_addr] = std::make_pair(blocks.size(), insts.size());
             insts.push_back(inst);
@@ -68,15 +259,55 @@ int Function::Decode(uintptr_t addr, DecodeStop stop, MemReader memacc) {
             if (stop == DecodeStop::INSTR)
                 break;
 
+            sweep_addr = cur_addr + inst.len();
             switch (inst.Kind()) {
             case Instr::Kind::COND_BRANCH:
                 addr_queue.push_back(cur_addr + inst.len());
+                if (insts.size() - cur_block_start >= 2) {
+                    const Instr& cmp = insts[insts.size() - 2];
+                    auto jmp_target = inst.JumpTarget();
+                    if (auto bound = BranchIndexBound(cfg->arch, cmp, inst, false))
+                        index_bounds[inst.end()] = *bound;
+                    if (auto bound = BranchIndexBound(cfg->arch, cmp, inst, true);
+                        bound && jmp_target)
+                        index_bounds[*jmp_target] = *bound;
+                }
                 /* FALLTHROUGH */
             case Instr::Kind::BRANCH:
-                if (auto jmp_target = inst.JumpTarget())
+                if (auto jmp_target = inst.JumpTarget()) {
                     addr_queue.push_back(jmp_target.value());
+                } else if (auto bound_it = index_bounds.find(insts[cur_block_start].start());
+                           bound_it != index_bounds.end()) {
+                    llvm::ArrayRef<Instr> block_insts(insts);
+                    auto table = RecognizeJumpTable(cfg->arch,
+                                                    block_insts.slice(cur_block_start),
+                                                    bound_it->second);
+                    if (table && table->max_idx < max_jump_table_size) {
+                        std::vector<uint64_t>& targets = table_targets[inst.start()];
+                        for (uint64_t i = 0; i <= table->max_idx; i++) {
+                            uint64_t entry;
+                            if (!read_entry(table->table + i * table->entry_size,
+                                            table->entry_size, entry))
+                                break;
+                            uint64_t target = table->Target(entry);
+                            targets.push_back(target);
+                            addr_queue.push_back(target);
+                        }
+                    }
+                }
                 /* FALLTHROUGH */
             case Instr::Kind::UNKNOWN:
+                // Indirect branches and returns may have profiled targets.
+                if (!cfg->indirect_targets.empty() && !inst.JumpTarget()) {
+                    auto site_it = cfg->indirect_targets.find(inst.start());
+                    if (site_it != cfg->indirect_targets.end()) {
+                        std::vector<uint64_t>& targets = table_targets[inst.start()];
+                        targets.insert(targets.end(), site_it->second.begin(),
+                                       site_it->second.end());
+                        addr_queue.insert(addr_queue.end(), site_it->second.begin(),
+                                          site_it->second.end());
+                    }
+                }
                 goto end_block;
             case Instr::Kind::CALL:
                 if (cfg->call_function)
@@ -95,6 +326,12 @@ int Function::Decode(uintptr_t addr, DecodeStop stop, MemReader memacc) {
         if (insts.size() != cur_block_start)
             blocks.push_back(std::make_pair(cur_block_start, insts.size()));
 
+        // Continue the sweep after the end of the block, unless the next
+        // instruction is already part of another block.
+        if (stop == DecodeStop::LINEAR && cur_addr_entry == addr_map.end() &&
+            sweep_addr && find_region(sweep_addr))
+            addr_queue.push_back(sweep_addr);
+
         if (cur_addr_entry != addr_map.end()) {
             auto& other_blk = blocks[cur_addr_entry->second.first];
             size_t split_idx = cur_addr_entry->second.second;
@@ -112,14 +349,32 @@ int Function::Decode(uintptr_t addr, DecodeStop stop, MemReader memacc) {
             addr_queue.clear();
     }
 
+    // Store indirect branch targets for the block that ends with the branch,
+    // after all blocks are split.
+    for (auto& [branch_addr, targets] : table_targets) {
+        llvm::sort(targets);
+        targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+        size_t block_idx = addr_map[branch_addr].first;
+        uint64_t block_addr = insts[blocks[block_idx].first].start();
+        indirect_targets[block_addr] = std::move(targets);
+    }
+
+    std::vector<RegisterSet> live_flags;
+#ifdef RELLUME_WITH_X86_64
+    if (cfg->arch == Arch::X86_64)
+        live_flags = FlagLiveness(*cfg, insts, blocks, addr_map);
+#endif // RELLUME_WITH_X86_64
+
     bool first_inst = true;
-    for (auto it = blocks.begin(); it != blocks.end(); it++) {
+    bool failed = false;
+    for (auto it = blocks.begin(); it != blocks.end() && !failed; it++) {
         uint64_t block_addr = insts[it->first].start();
         for (size_t j = it->first; j < it->second; j++) {
+            if (!live_flags.empty())
+                fi.live_flags = live_flags[j];
             if (!AddInst(block_addr, insts[j])) {
                 // If we fail on the first instruction, propagate error.
-                if (first_inst)
-                    return 1;
+                failed = first_inst;
                 // Otherwise continue with other basic blocks.
                 break;
             }
@@ -127,6 +382,9 @@ int Function::Decode(uintptr_t addr, DecodeStop stop, MemReader memacc) {
         }
     }
 
+    // Instructions added later through AddInst may read all flags.
+    fi.live_flags.set();
+
     // If we didn't lift a single instruction, return error code.
     if (first_inst)
         return 1;
@@ -31,14 +31,11 @@
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Instructions.h>
-#include <llvm/IR/Intrinsics.h>
 
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
-#include <cstring>
-#include <memory>
-#include <tuple>
-#include <type_traits>
+#include <initializer_list>
 
 namespace rellume {
 
@@ -70,235 +67,129 @@ unsigned RegisterSetBitIdx(ArchReg reg, Facet facet) {
     return 0xffffffff;
 }
 
-class DeferredValueBase {
-public:
-    using Generator = llvm::Value* (*)(ArchReg, Facet, llvm::BasicBlock*, void*);
-
-protected:
-    // If value is nullptr, then the generator (unless that is null as well)
-    // is used to get the actual value.
-    void* values[3];
-    Generator generator;
-
-public:
-    DeferredValueBase() {}
-    DeferredValueBase(llvm::Value* value) : values{value}, generator(nullptr) {}
-    explicit DeferredValueBase(Generator generator) : generator(generator) {
-        assert(generator && "deferred value with null generator");
-    }
-
-    DeferredValueBase(DeferredValueBase&& rhs) = default;
-    DeferredValueBase& operator=(DeferredValueBase&& rhs) = default;
-
-    DeferredValueBase(DeferredValueBase const&) = delete;
-    DeferredValueBase& operator=(const DeferredValueBase&) = delete;
+namespace {
 
-    llvm::Value* get(ArchReg reg, Facet facet, llvm::BasicBlock* bb) {
-        if (generator) {
-            values[0] = generator(reg, facet, bb, values);
-            assert(values[0] != nullptr && "generator returned nullptr");
-            generator = nullptr;
-        }
-        return static_cast<llvm::Value*>(values[0]);
+/// Slot indices of the facets of a register kind, generated from facet.inc.
+struct SlotTable {
+    constexpr SlotTable(std::initializer_list<Facet::Value> facets)
+            : slots(), num(0) {
+        for (unsigned i = 0; i < Facet::MAX; i++)
+            slots[i] = -1;
+        for (Facet::Value facet : facets)
+            slots[facet] = num++;
     }
-    explicit operator bool() const { return generator || values[0]; }
+    int8_t slots[Facet::MAX];
+    unsigned num;
 };
 
-template<typename T>
-class DeferredValue : public DeferredValueBase {
-public:
-    using Generator = llvm::Value* (*)(ArchReg, Facet, llvm::BasicBlock*, T*);
-    DeferredValue(Generator generator, T data)
-        : DeferredValueBase(
-              reinterpret_cast<DeferredValueBase::Generator>(generator)) {
-        static_assert(std::is_trivially_copyable<T>::value,
-                      "invalid defer arg type");
-        static_assert(sizeof(T) <= sizeof(values), "defer arg type too big");
-        static_assert(alignof(T) <= alignof(void*),
-                      "defer arg type misaligned");
-        *reinterpret_cast<T*>(values) = data;
-    }
+constexpr SlotTable gp_slots{
+#define REGFILE_GP_FACET(fc) Facet::fc,
+#include "facet.inc"
+#undef REGFILE_GP_FACET
 };
-
-template<typename R, Facet::Value... E>
-class ValueMap {
-    template<typename T, int N, int M>
-    struct LookupTable {
-        constexpr LookupTable(std::initializer_list<T> il) : f(), b() {
-            int i = 0;
-            for (auto elem : il) {
-                f[i] = elem;
-                b[static_cast<int>(elem)] = 1 + i++;
-            }
-        }
-        T f[N];
-        unsigned b[M];
-    };
-
-    static const LookupTable<Facet::Value, sizeof...(E), Facet::MAX> table;
-    R values[sizeof...(E)];
-
-public:
-    bool has(Facet v) const { return table.b[static_cast<int>(v)] > 0; }
-    R& operator[](Facet v) {
-        assert(has(v));
-        return values[table.b[static_cast<int>(v)] - 1];
-    }
-    template<typename F>
-    void setAll(const F& init_func) {
-        for (unsigned i = 0; i < sizeof...(E); i++)
-            values[i] = init_func(table.f[i]);
-    }
-    void clear() {
-        setAll([](Facet f) { return nullptr; });
-    }
+constexpr SlotTable vec_slots{
+#define REGFILE_VEC_FACET(fc) Facet::fc,
+#include "facet.inc"
+#undef REGFILE_VEC_FACET
 };
-template<typename R, Facet::Value... E>
-const typename ValueMap<R, E...>::template LookupTable<Facet::Value,
-                                                       sizeof...(E), Facet::MAX>
-    ValueMap<R, E...>::table({E...});
-
-template<typename R>
-using ValueMapGp = ValueMap<R, Facet::I64, Facet::I32, Facet::I16, Facet::I8, Facet::I8H, Facet::PTR>;
-
-template<typename R>
-using ValueMapSse = ValueMap<R, Facet::I128,
-#if LL_VECTOR_REGISTER_SIZE >= 256
-    Facet::I256,
-#endif
-    Facet::I8, Facet::V16I8,
-    Facet::I16, Facet::V8I16,
-    Facet::I32, Facet::V4I32,
-    Facet::I64, Facet::V2I64,
-    Facet::F32, Facet::V4F32,
-    Facet::F64, Facet::V2F64
->;
-
-template<typename R>
-using ValueMapFlags = ValueMap<R, Facet::ZF, Facet::SF, Facet::PF, Facet::CF, Facet::OF, Facet::AF, Facet::DF>;
-
-
-class RegFile::impl {
-public:
-    impl(Arch arch) : insert_block(nullptr), reg_ip(), flags(), dirty_regs(),
-                      cleaned_regs() {
-        unsigned ngp, nvec;
-        switch (arch) {
+constexpr SlotTable flag_slots{
+#define REGFILE_FLAG_FACET(fc) Facet::fc,
+#include "facet.inc"
+#undef REGFILE_FLAG_FACET
+};
+
+// The instruction pointer occupies the first slot, followed by the flags and
+// the general-purpose registers. Vector registers start at vec_base.
+constexpr unsigned flag_base = 1;
+constexpr unsigned gp_base = flag_base + flag_slots.num;
+
+} // end anonymous namespace
+
+RegFile::RegFile(Arch arch, llvm::BumpPtrAllocator& alloc)
+        : insert_block(nullptr), dirty_regs(), cleaned_regs() {
+    unsigned ngp, nvec;
+    switch (arch) {
 #ifdef RELLUME_WITH_X86_64
-        case Arch::X86_64: ngp = 16; nvec = 16; ivec_facet = Facet::V2I64; break;
+    case Arch::X86_64: ngp = 16; nvec = 16; ivec_facet = Facet::V2I64; break;
 #endif // RELLUME_WITH_X86_64
 #ifdef RELLUME_WITH_RV64
-        case Arch::RV64: ngp = 32; nvec = 32; ivec_facet = Facet::I64; break;
+    case Arch::RV64: ngp = 32; nvec = 32; ivec_facet = Facet::I64; break;
 #endif // RELLUME_WITH_RV64
 #ifdef RELLUME_WITH_AARCH64
-        case Arch::AArch64: ngp = 32; nvec = 32; ivec_facet = Facet::V2I64; break;
+    case Arch::AArch64: ngp = 32; nvec = 32; ivec_facet = Facet::V2I64; break;
 #endif // RELLUME_WITH_AARCH64
-        default: assert(false);
-        }
-        regs_gp.resize(ngp);
-        regs_sse.resize(nvec);
+    default: assert(false); ngp = nvec = 0; break;
     }
-
-    llvm::BasicBlock* GetInsertBlock() { return insert_block; }
-    void SetInsertBlock(llvm::BasicBlock* n) { insert_block = n; }
-
-    void Clear();
-    void InitWithPHIs(std::vector<PhiDesc>*, bool all_facets);
-
-    llvm::Value* GetReg(ArchReg reg, Facet facet);
-    void SetReg(ArchReg reg, Facet facet, llvm::Value*, bool clear_facets);
-
-    RegisterSet& DirtyRegs() { return dirty_regs; }
-    RegisterSet& CleanedRegs() { return cleaned_regs; }
-
-private:
-    llvm::BasicBlock* insert_block;
-    std::vector<ValueMapGp<DeferredValueBase>> regs_gp;
-    std::vector<ValueMapSse<DeferredValueBase>> regs_sse;
-    DeferredValueBase reg_ip;
-    ValueMapFlags<DeferredValueBase> flags;
-
-    Facet ivec_facet;
-
-    RegisterSet dirty_regs;
-    RegisterSet cleaned_regs;
-
-    DeferredValueBase* AccessRegFacet(ArchReg reg, Facet facet);
-    llvm::Value* GetRegFacet(ArchReg reg, Facet facet);
-};
-
-void RegFile::impl::Clear() {
-    for (auto& reg : regs_gp)
-        reg.clear();
-    for (auto& reg : regs_sse)
-        reg.clear();
-    reg_ip = nullptr;
-    flags.clear();
+    vec_base = gp_base + ngp * gp_slots.num;
+    num_slots = vec_base + nvec * vec_slots.num;
+    slots = alloc.Allocate<Slot>(num_slots);
+    Clear();
 }
 
-void RegFile::impl::InitWithPHIs(std::vector<PhiDesc>* desc_vec,
-                                 bool all_facets) {
-    auto fn = [desc_vec](Facet) {
-        using DeferData = std::vector<PhiDesc>*;
-        return DeferredValue<DeferData>(
-            [](ArchReg reg, Facet facet, llvm::BasicBlock* bb,
-               DeferData* defer_data) {
-                llvm::IRBuilder<> irb(bb, bb->begin());
-                auto phi = irb.CreatePHI(facet.Type(irb.getContext()), 4);
-                (*defer_data)->push_back(std::make_tuple(reg, facet, phi));
-                return llvm::cast<llvm::Value>(phi);
-            },
-            desc_vec);
-    };
+void RegFile::Clear() {
+    std::fill_n(slots, num_slots, Slot{nullptr, nullptr});
+}
 
+void RegFile::InitWithGenerator(Generator gen, void* data, bool all_facets) {
+    Slot init{data, gen};
     if (all_facets) {
-        for (auto& reg : regs_gp)
-            reg.setAll(fn);
-        for (auto& reg : regs_sse)
-            reg.setAll(fn);
-    } else {
-        for (auto& reg : regs_gp)
-            reg[Facet::I64] = fn(Facet::I64);
-        for (auto& reg : regs_sse)
-            reg[ivec_facet] = fn(ivec_facet);
+        std::fill_n(slots, num_slots, init);
+        return;
     }
 
-    flags.setAll(fn);
-    reg_ip = fn(Facet::I64);
+    slots[0] = init;
+    for (unsigned i = 0; i < flag_slots.num; i++)
+        slots[flag_base + i] = init;
+    for (unsigned i = gp_base; i < vec_base; i += gp_slots.num)
+        slots[i + gp_slots.slots[Facet::I64]] = init;
+    for (unsigned i = vec_base; i < num_slots; i += vec_slots.num)
+        slots[i + vec_slots.slots[ivec_facet]] = init;
 }
 
-DeferredValueBase* RegFile::impl::AccessRegFacet(ArchReg reg, Facet facet) {
-    unsigned idx = reg.Index();
+RegFile::Slot* RegFile::AccessRegFacet(ArchReg reg, Facet facet) {
+    unsigned idx;
+    int slot;
     switch (reg.Kind()) {
     case ArchReg::RegKind::GP:
-        if (regs_gp[idx].has(facet))
-            return &regs_gp[idx][facet];
-        return nullptr;
+        slot = gp_slots.slots[facet];
+        idx = gp_base + reg.Index() * gp_slots.num + slot;
+        assert(idx < vec_base && "gp register out of range");
+        break;
     case ArchReg::RegKind::IP:
-        if (facet == Facet::I64)
-            return &reg_ip;
-        return nullptr;
+        slot = facet == Facet::I64 ? 0 : -1;
+        idx = 0;
+        break;
     case ArchReg::RegKind::EFLAGS:
-        if (flags.has(facet))
-            return &flags[facet];
-        return nullptr;
+        slot = flag_slots.slots[facet];
+        idx = flag_base + slot;
+        break;
     case ArchReg::RegKind::VEC:
-        if (regs_sse[idx].has(facet))
-            return &regs_sse[idx][facet];
-        return nullptr;
+        slot = vec_slots.slots[facet];
+        idx = vec_base + reg.Index() * vec_slots.num + slot;
+        assert(idx < num_slots && "vector register out of range");
+        break;
     default:
         return nullptr;
     }
+    return slot >= 0 ? &slots[idx] : nullptr;
 }
 
-llvm::Value* RegFile::impl::GetRegFacet(ArchReg reg, Facet facet) {
-    DeferredValueBase* def_val = AccessRegFacet(reg, facet);
-    if (def_val)
-        return def_val->get(reg, facet, insert_block);
-    return nullptr;
+llvm::Value* RegFile::GetRegFacet(ArchReg reg, Facet facet) {
+    Slot* slot = AccessRegFacet(reg, facet);
+    if (!slot)
+        return nullptr;
+    if (slot->generator) {
+        // The generator may recursively request the same value, which then
+        // overwrites the slot; but the arguments are evaluated before.
+        llvm::Value* value = slot->generator(reg, facet, insert_block,
+                                             slot->value);
+        assert(value != nullptr && "generator returned nullptr");
+        *slot = Slot{value, nullptr};
+    }
+    return static_cast<llvm::Value*>(slot->value);
 }
 
-llvm::Value* RegFile::impl::GetReg(ArchReg reg, Facet facet) {
+llvm::Value* RegFile::GetReg(ArchReg reg, Facet facet) {
     // If we store the selected facet in our register file and the facet is
     // valid, return it immediately.
     if (llvm::Value* res = GetRegFacet(reg, facet))
@@ -335,8 +226,8 @@ llvm::Value* RegFile::impl::GetReg(ArchReg reg, Facet facet) {
             break;
         }
 
-        if (DeferredValueBase* facet_entry = AccessRegFacet(reg, facet))
-            *facet_entry = res;
+        if (Slot* facet_slot = AccessRegFacet(reg, facet))
+            *facet_slot = Slot{res, nullptr};
         return res;
     } else if (reg.Kind() == ArchReg::RegKind::IP) {
         llvm::Value* native = GetRegFacet(reg, Facet::I64);
@@ -392,8 +283,8 @@ llvm::Value* RegFile::impl::GetReg(ArchReg reg, Facet facet) {
             }
         }
 
-        if (DeferredValueBase* facet_entry = AccessRegFacet(reg, facet))
-            *facet_entry = res;
+        if (Slot* facet_slot = AccessRegFacet(reg, facet))
+            *facet_slot = Slot{res, nullptr};
         return res;
     } else {
         assert(false && "GetReg with invalid register kind");
@@ -402,7 +293,7 @@ llvm::Value* RegFile::impl::GetReg(ArchReg reg, Facet facet) {
     return nullptr;
 }
 
-void RegFile::impl::SetReg(ArchReg reg, Facet facet, llvm::Value* value,
+void RegFile::SetReg(ArchReg reg, Facet facet, llvm::Value* value,
                            bool clearOthers) {
     if (facet == Facet::PTR)
         assert(value->getType()->isPointerTy());
@@ -412,41 +303,38 @@ void RegFile::impl::SetReg(ArchReg reg, Facet facet, llvm::Value* value,
     if (clearOthers) {
         if (reg.Kind() == ArchReg::RegKind::GP) {
             assert(facet == Facet::I64);
-            regs_gp[reg.Index()].clear();
+            Slot* first = &slots[gp_base + reg.Index() * gp_slots.num];
+            std::fill_n(first, gp_slots.num, Slot{nullptr, nullptr});
         } else if (reg.Kind() == ArchReg::RegKind::VEC) {
             assert(facet == ivec_facet);
-            regs_sse[reg.Index()].clear();
+            Slot* first = &slots[vec_base + reg.Index() * vec_slots.num];
+            std::fill_n(first, vec_slots.num, Slot{nullptr, nullptr});
         }
     }
 
-    if (llvm::isa<llvm::PHINode>(value)) {
-        llvm::IRBuilder<> irb(insert_block);
-        value = irb.CreateUnaryIntrinsic(llvm::Intrinsic::ssa_copy, value);
-    }
-
-    DeferredValueBase* facet_entry = AccessRegFacet(reg, facet);
-    if (!clearOthers && !facet_entry)
+    Slot* facet_slot = AccessRegFacet(reg, facet);
+    if (!clearOthers && !facet_slot)
         return; // It's an optional facet we don't keep in the regfile.
-    assert(facet_entry && "attempt to store invalid facet");
-    *facet_entry = value;
+    assert(facet_slot && "attempt to store invalid facet");
+    *facet_slot = Slot{value, nullptr};
 
     dirty_regs[RegisterSetBitIdx(reg, facet)] = true;
 }
 
-RegFile::RegFile(Arch arch) : pimpl{std::make_unique<impl>(arch)} {}
-RegFile::~RegFile() {}
+void RegFile::SetRegDeferred(ArchReg reg, Facet facet, Generator gen,
+                             void* data) {
+    Slot* facet_slot = AccessRegFacet(reg, facet);
+    assert(facet_slot && "attempt to store invalid facet");
+    *facet_slot = Slot{data, gen};
 
-llvm::BasicBlock* RegFile::GetInsertBlock() { return pimpl->GetInsertBlock(); }
-void RegFile::SetInsertBlock(llvm::BasicBlock* n) { pimpl->SetInsertBlock(n); }
-void RegFile::Clear() { pimpl->Clear(); }
-void RegFile::InitWithPHIs(std::vector<PhiDesc>* desc_vec, bool all_facets) {
-    pimpl->InitWithPHIs(desc_vec, all_facets);
+    dirty_regs[RegisterSetBitIdx(reg, facet)] = true;
 }
-llvm::Value* RegFile::GetReg(ArchReg r, Facet f) { return pimpl->GetReg(r, f); }
-void RegFile::SetReg(ArchReg reg, Facet facet, llvm::Value* value, bool clear) {
-    pimpl->SetReg(reg, facet, value, clear);
+
+void* RegFile::GetRegDeferred(ArchReg reg, Facet facet, Generator gen) {
+    Slot* slot = AccessRegFacet(reg, facet);
+    if (!slot || slot->generator != gen)
+        return nullptr;
+    return slot->value;
 }
-RegisterSet& RegFile::DirtyRegs() { return pimpl->DirtyRegs(); }
-RegisterSet& RegFile::CleanedRegs() { return pimpl->CleanedRegs(); }
 
 } // namespace rellume
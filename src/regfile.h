@@ -30,10 +30,9 @@
 
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/Value.h>
+#include <llvm/Support/Allocator.h>
 
 #include <bitset>
-#include <tuple>
-#include <vector>
 
 namespace rellume {
 
@@ -111,34 +110,71 @@ unsigned RegisterSetBitIdx(ArchReg reg, Facet facet);
 
 class RegFile {
 public:
-    RegFile(Arch arch);
-    ~RegFile();
+    /// Create a register file, the register slots are allocated from alloc.
+    RegFile(Arch arch, llvm::BumpPtrAllocator& alloc);
 
-    RegFile(RegFile&& rhs);
-    RegFile& operator=(RegFile&& rhs);
+    RegFile(RegFile&& rhs) = default;
+    RegFile& operator=(RegFile&& rhs) = default;
 
     RegFile(const RegFile&) = delete;
     RegFile& operator=(const RegFile&) = delete;
 
-    llvm::BasicBlock* GetInsertBlock();
-    void SetInsertBlock(llvm::BasicBlock* new_block);
+    llvm::BasicBlock* GetInsertBlock() {
+        return insert_block;
+    }
+    void SetInsertBlock(llvm::BasicBlock* new_block) {
+        insert_block = new_block;
+    }
 
     void Clear();
-    using PhiDesc = std::tuple<ArchReg, Facet, llvm::PHINode*>;
-    void InitWithPHIs(std::vector<PhiDesc>*, bool all_facets);
+    /// Generator for values which are only computed when requested. It is
+    /// called with the insert block of the register file.
+    using Generator = llvm::Value* (*)(ArchReg, Facet, llvm::BasicBlock*,
+                                       void* data);
+    /// Initialize all registers with a generator, which is called when a
+    /// register is read before it is written. Unless all_facets is set, only
+    /// native facets are initialized, other facets are derived from these.
+    void InitWithGenerator(Generator gen, void* data, bool all_facets);
 
     llvm::Value* GetReg(ArchReg reg, Facet facet);
     void SetReg(ArchReg reg, Facet facet, llvm::Value*, bool clear_facets);
+    /// Set a register facet to a value which is computed by gen only when it
+    /// is read. Other facets of the register are not modified.
+    void SetRegDeferred(ArchReg reg, Facet facet, Generator gen, void* data);
+    /// If a register facet is a deferred value of gen which is not computed
+    /// yet, return the data of the generator; otherwise, return nullptr.
+    void* GetRegDeferred(ArchReg reg, Facet facet, Generator gen);
 
     /// Modified registers not yet recorded in a CallConvPack in the FunctionInfo.
-    RegisterSet& DirtyRegs();
+    RegisterSet& DirtyRegs() {
+        return dirty_regs;
+    }
 
     /// Registers that have been packed into a CallConvPack.
-    RegisterSet& CleanedRegs();
+    RegisterSet& CleanedRegs() {
+        return cleaned_regs;
+    }
 
 private:
-    class impl;
-    std::unique_ptr<impl> pimpl;
+    /// The value of a register facet. If a generator is set, value is the data
+    /// for the generator, which computes the actual value on first access.
+    struct Slot {
+        void* value;
+        Generator generator;
+    };
+
+    Slot* AccessRegFacet(ArchReg reg, Facet facet);
+    llvm::Value* GetRegFacet(ArchReg reg, Facet facet);
+
+    llvm::BasicBlock* insert_block;
+    /// Slots of all register facets, see AccessRegFacet for the layout.
+    Slot* slots;
+    unsigned num_slots;
+    unsigned vec_base;
+    Facet ivec_facet;
+
+    RegisterSet dirty_regs;
+    RegisterSet cleaned_regs;
 };
 
 } // namespace rellume
@@ -23,18 +23,23 @@
 
 #include "rellume/rellume.h"
 
+#include "batch.h"
 #include "callconv.h"
 #include "config.h"
 #include "function.h"
 #include "instr.h"
+#include "wrapper.h"
 
 #include <llvm-c/Core.h>
+#include <llvm/ADT/SmallVector.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Value.h>
 
+#include <algorithm>
 #include <cstdbool>
 #include <cstdint>
 #include <cstring>
+#include <vector>
 
 namespace {
 static rellume::LLConfig* unwrap(LLConfig* fn) {
@@ -56,6 +61,34 @@ void ll_config_set_hhvm(LLConfig* cfg, bool hhvm) {
 void ll_config_set_sptr_addrspace(LLConfig* cfg, unsigned addrspace) {
     unwrap(cfg)->sptr_addrspace = addrspace;
 }
+bool ll_config_set_reg_callconv(LLConfig* cfg, size_t count,
+                                const size_t* offsets) {
+    auto callconv = rellume::CallConv::FromRegOffsets(unwrap(cfg)->arch,
+                                                      llvm::makeArrayRef(offsets, count));
+    if (callconv == rellume::CallConv::INVALID)
+        return false;
+    unwrap(cfg)->callconv = callconv;
+    return true;
+}
+bool ll_config_set_cpu_struct_layout(LLConfig* cfg, size_t count,
+                                     const LLCpuStructEntry* entries) {
+    rellume::CallConv::Layout layout;
+    size_t size = 0;
+    size_t align = 1;
+    for (size_t i = 0; i < count; i++) {
+        const LLCpuStructEntry& entry = entries[i];
+        if (!unwrap(cfg)->callconv.IsValidLayoutEntry(entry.default_offset,
+                                                      entry.offset, entry.size))
+            return false;
+        layout[entry.default_offset] = entry.offset;
+        size = std::max(size, entry.offset + entry.size);
+        align = std::max(align, entry.size);
+    }
+    unwrap(cfg)->cpu_struct_layout = std::move(layout);
+    unwrap(cfg)->cpu_struct_size = size;
+    unwrap(cfg)->cpu_struct_align = align;
+    return true;
+}
 void ll_config_enable_overflow_intrinsics(LLConfig* cfg, bool enable) {
     unwrap(cfg)->enableOverflowIntrinsics = enable;
 }
@@ -65,6 +98,12 @@ void ll_config_enable_fast_math(LLConfig* cfg, bool enable) {
 void ll_config_enable_verify_ir(LLConfig* cfg, bool enable) {
     unwrap(cfg)->verify_ir = enable;
 }
+void ll_config_enable_stack_promotion(LLConfig* cfg, bool enable) {
+    unwrap(cfg)->promote_stack_frame = enable;
+}
+void ll_config_enable_cpu_struct_noalias(LLConfig* cfg, bool enable) {
+    unwrap(cfg)->cpu_struct_noalias = enable;
+}
 void ll_config_set_position_independent_code(LLConfig* cfg, bool enable) {
     unwrap(cfg)->position_independent_code = enable;
 }
@@ -73,6 +112,34 @@ void ll_config_set_global_base(LLConfig* cfg, uintptr_t base,
     unwrap(cfg)->global_base_addr = base;
     unwrap(cfg)->global_base_value = llvm::unwrap(value);
 }
+bool ll_config_set_reg_constant(LLConfig* cfg, const char* reg,
+                                uint64_t value) {
+    auto offset = unwrap(cfg)->callconv.IntRegOffset(reg);
+    if (!offset)
+        return false;
+    unwrap(cfg)->const_regs[*offset] = value;
+    return true;
+}
+void ll_config_add_const_memory(LLConfig* cfg, uintptr_t addr, size_t size,
+                                const void* bytes) {
+    auto bytes_u8 = static_cast<const uint8_t*>(bytes);
+    unwrap(cfg)->const_memory[addr].assign(bytes_u8, bytes_u8 + size);
+}
+void ll_config_set_const_memory_cb(LLConfig* cfg, RellumeMemAccessCb mem_acc,
+                                   void* user_arg) {
+    if (!mem_acc) {
+        unwrap(cfg)->const_memory_reader = nullptr;
+        return;
+    }
+    unwrap(cfg)->const_memory_reader = [=](uintptr_t addr, uint8_t* buf,
+                                           size_t size) {
+        return mem_acc(addr, buf, size, user_arg);
+    };
+}
+void ll_config_add_data_section(LLConfig* cfg, uintptr_t addr, size_t size,
+                                LLVMValueRef global) {
+    unwrap(cfg)->data_sections[addr] = {size, llvm::unwrap(global)};
+}
 void ll_config_set_pc_base(LLConfig* cfg, uintptr_t base, LLVMValueRef value) {
     unwrap(cfg)->pc_base_addr = base;
     unwrap(cfg)->pc_base_value = llvm::unwrap(value);
@@ -89,6 +156,10 @@ void ll_config_set_call_func(LLConfig* cfg, LLVMValueRef value) {
     llvm::Value* uw_value = llvm::unwrap(value);
     unwrap(cfg)->call_function = llvm::cast_or_null<llvm::Function>(uw_value);
 }
+void ll_config_add_known_function(LLConfig* cfg, uintptr_t addr,
+                                  LLVMValueRef value) {
+    unwrap(cfg)->known_functions[addr] = llvm::unwrap<llvm::Function>(value);
+}
 void ll_config_set_syscall_impl(LLConfig* cfg, LLVMValueRef value) {
     unwrap(cfg)->syscall_implementation = llvm::unwrap<llvm::Function>(value);
 }
@@ -96,6 +167,14 @@ void ll_config_set_cpuinfo_func(LLConfig* cfg, LLVMValueRef value) {
     llvm::Value* uw_value = llvm::unwrap(value);
     unwrap(cfg)->cpuinfo_function = llvm::cast_or_null<llvm::Function>(uw_value);
 }
+void ll_config_set_repne_scasb_func(LLConfig* cfg, LLVMValueRef value) {
+    llvm::Value* uw_value = llvm::unwrap(value);
+    unwrap(cfg)->repne_scasb_function = llvm::cast_or_null<llvm::Function>(uw_value);
+}
+void ll_config_set_repe_cmpsb_func(LLConfig* cfg, LLVMValueRef value) {
+    llvm::Value* uw_value = llvm::unwrap(value);
+    unwrap(cfg)->repe_cmpsb_function = llvm::cast_or_null<llvm::Function>(uw_value);
+}
 void ll_config_set_instr_marker(LLConfig* cfg, LLVMValueRef value) {
     if (value)
         unwrap(cfg)->instr_marker = llvm::unwrap<llvm::Function>(value);
@@ -111,6 +190,31 @@ void ll_config_set_use_native_segment_base(LLConfig* cfg, bool enable) {
 void ll_config_enable_full_facets(LLConfig* cfg, bool enable) {
     unwrap(cfg)->full_facets = enable;
 }
+static bool ll_regs_at_offsets(LLConfig* cfg, size_t count,
+                               const size_t* offsets,
+                               rellume::RegisterSet& regs) {
+    rellume::RegisterSet new_regs;
+    auto offset_ref = llvm::makeArrayRef(offsets, count);
+    if (!unwrap(cfg)->callconv.RegsAtOffsets(offset_ref, new_regs))
+        return false;
+    regs = new_regs;
+    return true;
+}
+bool ll_config_set_live_in(LLConfig* cfg, size_t count,
+                           const size_t* offsets) {
+    return ll_regs_at_offsets(cfg, count, offsets, unwrap(cfg)->live_in);
+}
+bool ll_config_set_live_out(LLConfig* cfg, size_t count,
+                            const size_t* offsets) {
+    return ll_regs_at_offsets(cfg, count, offsets, unwrap(cfg)->live_out);
+}
+void ll_config_enable_indirect_branch_switch(LLConfig* cfg, bool enable) {
+    unwrap(cfg)->indirect_branch_switch = enable;
+}
+void ll_config_add_indirect_branch_target(LLConfig* cfg, uintptr_t site,
+                                          uintptr_t target) {
+    unwrap(cfg)->indirect_targets[site].push_back(target);
+}
 bool ll_config_set_architecture(LLConfig* cfg, const char *s) {
     if (!strcmp(s, "x86-64") || !strcmp(s, "x86_64")) {
 #ifdef RELLUME_WITH_X86_64
@@ -149,9 +253,8 @@ int ll_func_add_instr(LLFunc* func, uintptr_t block_addr, uintptr_t addr,
     return unwrap(func)->AddInst(block_addr, addr, bufsz, buf);
 }
 
-static int ll_func_decode(LLFunc* func, uintptr_t addr,
-                          rellume::Function::DecodeStop stop,
-                          RellumeMemAccessCb mem_acc, void* user_arg) {
+static rellume::Function::MemReader ll_mem_reader(RellumeMemAccessCb mem_acc,
+                                                  void* user_arg) {
     rellume::Function::MemReader rl_memacc;
     if (mem_acc) {
         rl_memacc = [=](uintptr_t maddr, uint8_t* buf, size_t buf_sz) {
@@ -163,7 +266,13 @@ static int ll_func_decode(LLFunc* func, uintptr_t addr,
             return buf_sz;
         };
     }
-    return unwrap(func)->Decode(addr, stop, rl_memacc);
+    return rl_memacc;
+}
+
+static int ll_func_decode(LLFunc* func, uintptr_t addr,
+                          rellume::Function::DecodeStop stop,
+                          RellumeMemAccessCb mem_acc, void* user_arg) {
+    return unwrap(func)->Decode(addr, stop, ll_mem_reader(mem_acc, user_arg));
 }
 int ll_func_decode_instr(LLFunc* func, uintptr_t addr,
                          RellumeMemAccessCb mem_acc, void* user_arg) {
@@ -180,3 +289,60 @@ int ll_func_decode_cfg(LLFunc* func, uintptr_t addr, RellumeMemAccessCb mem_acc,
     return ll_func_decode(func, addr, rellume::Function::DecodeStop::ALL,
                           mem_acc, user_arg);
 }
+
+static int ll_func_decode_regions(LLFunc* func, uintptr_t addr,
+                                  rellume::Function::DecodeStop stop,
+                                  size_t num_regions, const LLMemRegion* regions,
+                                  RellumeMemAccessCb mem_acc, void* user_arg) {
+    llvm::SmallVector<rellume::Function::MemRegion, 4> rl_regions;
+    for (size_t i = 0; i < num_regions; i++)
+        rl_regions.push_back({regions[i].addr, regions[i].buf, regions[i].size});
+    rellume::Function::MemReader rl_memacc = nullptr;
+    if (mem_acc)
+        rl_memacc = ll_mem_reader(mem_acc, user_arg);
+    return unwrap(func)->Decode(addr, stop, rl_regions, rl_memacc);
+}
+int ll_func_decode_cfg_range(LLFunc* func, uintptr_t addr, size_t num_regions,
+                             const LLMemRegion* regions,
+                             RellumeMemAccessCb mem_acc, void* user_arg) {
+    return ll_func_decode_regions(func, addr, rellume::Function::DecodeStop::ALL,
+                                  num_regions, regions, mem_acc, user_arg);
+}
+int ll_func_decode_linear(LLFunc* func, uintptr_t addr, size_t num_regions,
+                          const LLMemRegion* regions,
+                          RellumeMemAccessCb mem_acc, void* user_arg) {
+    return ll_func_decode_regions(func, addr,
+                                  rellume::Function::DecodeStop::LINEAR,
+                                  num_regions, regions, mem_acc, user_arg);
+}
+
+size_t ll_func_lift_batch(LLVMModuleRef mod, LLConfig* cfg, size_t count,
+                          const uintptr_t* addrs, RellumeMemAccessCb mem_acc,
+                          void* user_arg, unsigned num_threads,
+                          LLVMValueRef* fns) {
+    std::vector<llvm::Function*> rl_fns(count);
+    size_t failed = rellume::LiftBatch(llvm::unwrap(mod), *unwrap(cfg),
+                                       llvm::makeArrayRef(addrs, count),
+                                       ll_mem_reader(mem_acc, user_arg),
+                                       num_threads, rl_fns);
+    if (fns)
+        for (size_t i = 0; i < count; i++)
+            fns[i] = llvm::wrap(rl_fns[i]);
+    return failed;
+}
+
+LLVMValueRef ll_func_wrap_native(LLVMValueRef fn, LLVMTypeRef fn_ty,
+                                 uintptr_t entry, size_t stack_size,
+                                 const char* name) {
+    auto llvm_fn = llvm::unwrap<llvm::Function>(fn);
+    auto llvm_fn_ty = llvm::unwrap<llvm::FunctionType>(fn_ty);
+    return llvm::wrap(rellume::CreateNativeWrapper(llvm_fn, llvm_fn_ty, entry,
+                                                   stack_size, name));
+}
+
+void ll_func_get_stats(LLFunc* func, LLFuncStats* stats) {
+    const rellume::FunctionStats& fn_stats = unwrap(func)->GetStats();
+    stats->phis_created = fn_stats.phis_created;
+    stats->phis_removed = fn_stats.phis_removed;
+    stats->flags_skipped = fn_stats.flags_skipped;
+}
@@ -117,20 +117,35 @@ public:
     }
     void LiftLoad(const FrvInst* rvi, llvm::Instruction::CastOps ext, Facet f) {
         llvm::Type* ty = f.Type(irb.getContext());
-        llvm::Value* ld = irb.CreateLoad(ty, Addr(rvi, ty->getPointerTo()));
+        llvm::Value* addr = Addr(rvi, ty->getPointerTo());
+        llvm::Value* ld = ConstLoad(ty, addr);
+        if (!ld) {
+            llvm::LoadInst* load = irb.CreateLoad(ty, addr);
+            fi.SetGuestAliasScope(load);
+            ld = load;
+        }
         StoreGp(rvi->rd, irb.CreateCast(ext, ld, irb.getInt64Ty()));
     }
     void LiftLoadFp(const FrvInst* rvi, Facet f) {
         llvm::Type* ty = f.Type(irb.getContext());
-        StoreFp(rvi->rd, irb.CreateLoad(ty, Addr(rvi, ty->getPointerTo())));
+        llvm::Value* addr = Addr(rvi, ty->getPointerTo());
+        llvm::Value* ld = ConstLoad(ty, addr);
+        if (!ld) {
+            llvm::LoadInst* load = irb.CreateLoad(ty, addr);
+            fi.SetGuestAliasScope(load);
+            ld = load;
+        }
+        StoreFp(rvi->rd, ld);
     }
     void LiftStore(const FrvInst* rvi, Facet f) {
         llvm::Type* ty = f.Type(irb.getContext());
-        irb.CreateStore(LoadGp(rvi->rs2, f), Addr(rvi, ty->getPointerTo()));
+        auto store = irb.CreateStore(LoadGp(rvi->rs2, f), Addr(rvi, ty->getPointerTo()));
+        fi.SetGuestAliasScope(store);
     }
     void LiftStoreFp(const FrvInst* rvi, Facet f) {
         llvm::Type* ty = f.Type(irb.getContext());
-        irb.CreateStore(LoadFp(rvi->rs2, f), Addr(rvi, ty->getPointerTo()));
+        auto store = irb.CreateStore(LoadFp(rvi->rs2, f), Addr(rvi, ty->getPointerTo()));
+        fi.SetGuestAliasScope(store);
     }
     void LiftBranch(const Instr& inst, llvm::CmpInst::Predicate pred) {
         const FrvInst* rvi = inst;
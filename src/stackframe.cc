@@ -0,0 +1,332 @@
+/**
+ * This file is part of Rellume.
+ *
+ * (c) 2016-2019, Alexis Engelke <alexis.engelke@googlemail.com>
+ *
+ * Rellume is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * Rellume is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Rellume.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * \file
+ **/
+
+#include "stackframe.h"
+
+#include <llvm/ADT/APInt.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/PostOrderIterator.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/CFG.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DataLayout.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IntrinsicInst.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Operator.h>
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+
+
+/**
+ * \defgroup LLStackFrame Stack Frame Promotion
+ * \brief Promotion of stack frame slots to an alloca
+ *
+ * The stack pointer is tracked as constant offset from its value at function
+ * entry through all arithmetic, pointer casts and PHI nodes. If all uses of
+ * such values are memory accesses, further offset computations, comparisons
+ * or stores into the CPU struct, no other code can observe the frame and the
+ * frame slots can be accessed in an alloca instead.
+ *
+ * Only leaf functions are supported: after a call, the stack pointer is
+ * reloaded from the CPU struct and may have been changed by the callee, so
+ * that the frame is no longer at a known offset.
+ *
+ * @{
+ **/
+
+namespace rellume {
+
+namespace {
+
+constexpr int64_t max_frame_size = 0x10000;
+
+/// Offset of a value from the entry stack pointer. A missing entry means not
+/// yet known, std::nullopt that the value is not a frame address.
+using FrameOffsets = llvm::DenseMap<llvm::Value*, std::optional<int64_t>>;
+
+/// Whether ptr points into the CPU struct; off is set to the offset.
+bool IsCPUStructPtr(const llvm::DataLayout& dl, llvm::Value* ptr,
+                    llvm::Value* sptr_raw, int64_t& off) {
+    llvm::APInt ap_off(dl.getIndexTypeSizeInBits(ptr->getType()), 0);
+    llvm::Value* base = ptr->stripAndAccumulateConstantOffsets(dl, ap_off, true);
+    off = ap_off.getSExtValue();
+    return base == sptr_raw;
+}
+
+std::optional<int64_t> ComputeOffset(const llvm::DataLayout& dl,
+                                     FrameOffsets& offsets,
+                                     llvm::Instruction* inst) {
+    auto offset_of = [&offsets] (llvm::Value* v) -> std::optional<int64_t> {
+        auto it = offsets.find(v);
+        return it != offsets.end() ? it->second : std::nullopt;
+    };
+
+    switch (inst->getOpcode()) {
+    case llvm::Instruction::Add:
+    case llvm::Instruction::Sub: {
+        auto cnst = llvm::dyn_cast<llvm::ConstantInt>(inst->getOperand(1));
+        auto base = offset_of(inst->getOperand(0));
+        if (!base && inst->getOpcode() == llvm::Instruction::Add) {
+            cnst = llvm::dyn_cast<llvm::ConstantInt>(inst->getOperand(0));
+            base = offset_of(inst->getOperand(1));
+        }
+        if (!base || !cnst || cnst->getBitWidth() != 64)
+            return std::nullopt;
+        if (inst->getOpcode() == llvm::Instruction::Sub)
+            return *base - cnst->getSExtValue();
+        return *base + cnst->getSExtValue();
+    }
+    case llvm::Instruction::PtrToInt:
+        if (!inst->getType()->isIntegerTy(64))
+            return std::nullopt;
+        return offset_of(inst->getOperand(0));
+    case llvm::Instruction::IntToPtr:
+    case llvm::Instruction::BitCast:
+        return offset_of(inst->getOperand(0));
+    case llvm::Instruction::GetElementPtr: {
+        auto gep = llvm::cast<llvm::GEPOperator>(inst);
+        auto base = offset_of(gep->getPointerOperand());
+        llvm::APInt ap_off(dl.getIndexTypeSizeInBits(gep->getType()), 0);
+        if (!base || !gep->accumulateConstantOffset(dl, ap_off))
+            return std::nullopt;
+        return *base + ap_off.getSExtValue();
+    }
+    case llvm::Instruction::Select: {
+        auto true_off = offset_of(inst->getOperand(1));
+        auto false_off = offset_of(inst->getOperand(2));
+        if (!true_off || true_off != false_off)
+            return std::nullopt;
+        return true_off;
+    }
+    case llvm::Instruction::PHI: {
+        // Optimistically ignore incoming values which are not known yet, they
+        // are defined later in a loop.
+        std::optional<int64_t> res;
+        for (llvm::Value* incoming : llvm::cast<llvm::PHINode>(inst)->incoming_values()) {
+            auto it = offsets.find(incoming);
+            if (it == offsets.end() && llvm::isa<llvm::Instruction>(incoming))
+                continue;
+            if (it == offsets.end() || !it->second)
+                return std::nullopt;
+            if (res && res != it->second)
+                return std::nullopt;
+            res = it->second;
+        }
+        return res;
+    }
+    default:
+        return std::nullopt;
+    }
+}
+
+} // end anonymous namespace
+
+bool PromoteStackFrame(llvm::Function* fn, llvm::Value* sptr_raw,
+                       llvm::Value* entry_sp) {
+    const llvm::DataLayout& dl = fn->getParent()->getDataLayout();
+
+    // The stack pointer must not be reloaded from the CPU struct, e.g. after a
+    // call, otherwise accesses through it could alias the frame.
+    auto entry_load = llvm::dyn_cast<llvm::LoadInst>(entry_sp);
+    int64_t sp_slot;
+    if (!entry_load || !entry_sp->getType()->isIntegerTy(64) ||
+        !IsCPUStructPtr(dl, entry_load->getPointerOperand(), sptr_raw, sp_slot))
+        return false;
+
+    FrameOffsets offsets;
+    offsets[entry_sp] = 0;
+    llvm::ReversePostOrderTraversal<llvm::Function*> rpot(fn);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (llvm::BasicBlock* bb : rpot) {
+            for (llvm::Instruction& inst : *bb) {
+                if (&inst == entry_sp)
+                    continue;
+                auto new_off = ComputeOffset(dl, offsets, &inst);
+                auto [it, inserted] = offsets.try_emplace(&inst, new_off);
+                if (inserted) {
+                    changed |= new_off.has_value();
+                } else if (it->second && it->second != new_off) {
+                    // Conflicting offsets: the value is no frame address.
+                    it->second = std::nullopt;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    struct Access {
+        llvm::Instruction* inst;
+        unsigned ptr_idx;
+        int64_t off;
+        int64_t size;
+    };
+    llvm::SmallVector<Access, 32> accesses;
+    llvm::SmallVector<llvm::Instruction*, 8> spills;
+    int64_t min_off = 0;
+    for (llvm::BasicBlock* bb : rpot) {
+        for (llvm::Instruction& inst : *bb) {
+            auto is_frame = [&offsets] (llvm::Value* v) {
+                auto it = offsets.find(v);
+                return it != offsets.end() && it->second;
+            };
+
+            if (auto load = llvm::dyn_cast<llvm::LoadInst>(&inst)) {
+                int64_t slot;
+                if (&inst != entry_sp &&
+                    IsCPUStructPtr(dl, load->getPointerOperand(), sptr_raw, slot) &&
+                    slot == sp_slot)
+                    return false;
+            } else if (llvm::isa<llvm::ReturnInst>(inst)) {
+                // Musttail calls are spilled before the call.
+                if (!bb->getTerminatingMustTailCall())
+                    spills.push_back(&inst);
+            } else if (auto call = llvm::dyn_cast<llvm::CallInst>(&inst)) {
+                if (!llvm::isa<llvm::IntrinsicInst>(call)) {
+                    // The callee could access the frame, only leaf functions
+                    // are supported.
+                    if (!call->isMustTailCall())
+                        return false;
+                    spills.push_back(&inst);
+                }
+            }
+
+            if (is_frame(&inst))
+                continue;
+            for (unsigned i = 0; i < inst.getNumOperands(); i++) {
+                llvm::Value* op = inst.getOperand(i);
+                if (!is_frame(op))
+                    continue;
+                if (llvm::isa<llvm::ICmpInst>(inst))
+                    continue;
+
+                auto load = llvm::dyn_cast<llvm::LoadInst>(&inst);
+                auto store = llvm::dyn_cast<llvm::StoreInst>(&inst);
+                if (store && i == 0) {
+                    // Storing the address is fine for the CPU struct.
+                    int64_t slot;
+                    if (!IsCPUStructPtr(dl, store->getPointerOperand(), sptr_raw, slot))
+                        return false;
+                    continue;
+                }
+                if ((!load || !load->isSimple()) && (!store || !store->isSimple()))
+                    return false;
+                if (op->getType()->getPointerAddressSpace() != 0)
+                    return false;
+
+                llvm::Type* ty = load ? load->getType()
+                                      : store->getValueOperand()->getType();
+                int64_t off = *offsets[op];
+                int64_t size = dl.getTypeStoreSize(ty).getFixedSize();
+                // Slots at and above the entry stack pointer belong to the
+                // caller and stay in memory.
+                if (off >= 0)
+                    continue;
+                if (off + size > 0 || off < -max_frame_size)
+                    return false;
+                accesses.push_back(Access{&inst, i, off, size});
+                min_off = std::min(min_off, off);
+            }
+        }
+    }
+
+    if (accesses.empty())
+        return false;
+
+    // Only the accessed bytes are copied between guest stack and frame, in
+    // as few contiguous ranges as possible.
+    llvm::SmallVector<std::pair<int64_t, int64_t>, 8> ranges;
+    for (const Access& access : accesses)
+        ranges.emplace_back(access.off, access.off + access.size);
+    llvm::sort(ranges);
+    size_t num_ranges = 0;
+    for (const auto& range : ranges) {
+        if (num_ranges && range.first <= ranges[num_ranges - 1].second) {
+            int64_t& end = ranges[num_ranges - 1].second;
+            end = std::max(end, range.second);
+        } else {
+            ranges[num_ranges++] = range;
+        }
+    }
+    ranges.resize(num_ranges);
+
+    llvm::IRBuilder<> irb(&*fn->getEntryBlock().getFirstInsertionPt());
+    uint64_t frame_size = -min_off;
+    auto frame_ty = llvm::ArrayType::get(irb.getInt8Ty(), frame_size);
+    auto frame = irb.CreateAlloca(frame_ty);
+    frame->setAlignment(llvm::Align(16));
+    llvm::Value* frame_ptr = irb.CreatePointerCast(frame, irb.getInt8PtrTy());
+
+    // Slots may be read before they are written, e.g. data left in the red
+    // zone, so the frame starts with the contents of the guest stack.
+    irb.SetInsertPoint(entry_load->getNextNode());
+    llvm::Value* guest_addr = irb.CreateAdd(entry_sp, irb.getInt64(min_off));
+    llvm::Value* guest_ptr = irb.CreateIntToPtr(guest_addr, irb.getInt8PtrTy());
+    auto copy_ranges = [&] (bool to_frame) {
+        for (const auto& [start, end] : ranges) {
+            uint64_t frame_off = start - min_off;
+            llvm::Value* frame_slot =
+                irb.CreateConstGEP1_64(irb.getInt8Ty(), frame_ptr, frame_off);
+            llvm::Value* guest_slot =
+                irb.CreateConstGEP1_64(irb.getInt8Ty(), guest_ptr, frame_off);
+            llvm::Align frame_align = llvm::commonAlignment(llvm::Align(16),
+                                                            frame_off);
+            if (to_frame)
+                irb.CreateMemCpy(frame_slot, frame_align, guest_slot,
+                                 llvm::MaybeAlign(), end - start);
+            else
+                irb.CreateMemCpy(guest_slot, llvm::MaybeAlign(), frame_slot,
+                                 frame_align, end - start);
+        }
+    };
+    copy_ranges(true);
+
+    for (const Access& access : accesses) {
+        irb.SetInsertPoint(access.inst);
+        llvm::Value* old_ptr = access.inst->getOperand(access.ptr_idx);
+        llvm::Value* ptr = irb.CreateConstGEP1_64(irb.getInt8Ty(), frame_ptr,
+                                                  access.off - min_off);
+        ptr = irb.CreatePointerCast(ptr, old_ptr->getType());
+        access.inst->setOperand(access.ptr_idx, ptr);
+    }
+
+    for (llvm::Instruction* inst : spills) {
+        irb.SetInsertPoint(inst);
+        copy_ranges(false);
+    }
+
+    return true;
+}
+
+} // namespace rellume
+
+/**
+ * @}
+ **/
@@ -0,0 +1,47 @@
+/**
+ * This file is part of Rellume.
+ *
+ * (c) 2016-2019, Alexis Engelke <alexis.engelke@googlemail.com>
+ *
+ * Rellume is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * Rellume is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Rellume.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * \file
+ **/
+
+#ifndef RELLUME_STACKFRAME_H
+#define RELLUME_STACKFRAME_H
+
+namespace llvm {
+class Function;
+class Value;
+}
+
+namespace rellume {
+
+/// Move the stack frame of the lifted function fn into an alloca, so that the
+/// LLVM optimizer can promote frame slots to registers. sptr_raw is the CPU
+/// struct pointer and entry_sp the stack pointer loaded from it in the entry
+/// block. The frame is the memory below entry_sp which is only accessed at
+/// constant offsets from entry_sp. It is copied from the guest stack at entry
+/// and written back before exits and tail calls. Returns false if the frame
+/// address escapes, the function contains other calls or the function accesses
+/// no frame slots; the function is not modified then.
+bool PromoteStackFrame(llvm::Function* fn, llvm::Value* sptr_raw,
+                       llvm::Value* entry_sp);
+
+} // namespace rellume
+
+#endif
@@ -0,0 +1,214 @@
+/**
+ * This file is part of Rellume.
+ *
+ * (c) 2016-2019, Alexis Engelke <alexis.engelke@googlemail.com>
+ *
+ * Rellume is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * Rellume is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Rellume.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * \file
+ **/
+
+#include "wrapper.h"
+
+#include "arch.h"
+#include "callconv.h"
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/Twine.h>
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Type.h>
+#include <cstddef>
+#include <cstdint>
+
+
+/**
+ * \defgroup LLWrapper Native Wrapper
+ * \brief Wrappers with native signatures for lifted functions
+ *
+ * @{
+ **/
+
+namespace rellume {
+
+#ifdef RELLUME_WITH_X86_64
+
+namespace {
+
+namespace SptrOff {
+    enum : unsigned {
+#define RELLUME_NAMED_REG(name,nameu,sz,off) nameu = off,
+#include <rellume/cpustruct-x86_64-private.inc>
+#undef RELLUME_NAMED_REG
+        STRUCT_SIZE = XMM15 + 16,
+        // Size attached to the CPU struct parameter by Function.
+        DEFAULT_SIZE = 0x190,
+    };
+}
+
+bool IsSupportedType(llvm::Type* ty) {
+    if (ty->isIntegerTy())
+        return ty->getIntegerBitWidth() <= 64;
+    return ty->isPointerTy() || ty->isFloatTy() || ty->isDoubleTy();
+}
+
+} // end anonymous namespace
+
+llvm::Function* CreateNativeWrapper(llvm::Function* fn,
+                                    llvm::FunctionType* fn_ty,
+                                    uint64_t entry_addr, size_t stack_size,
+                                    const llvm::Twine& name) {
+    if (CallConv::FromFunction(fn, Arch::X86_64) != CallConv::X86_64_SPTR)
+        return nullptr;
+    // The register offsets below are those of the default CPU struct layout,
+    // functions lifted with a custom layout have a different struct size.
+    if (fn->getParamDereferenceableBytes(0) != SptrOff::DEFAULT_SIZE)
+        return nullptr;
+    if (fn_ty->isVarArg())
+        return nullptr;
+    llvm::Type* ret_ty = fn_ty->getReturnType();
+    if (!ret_ty->isVoidTy() && !IsSupportedType(ret_ty))
+        return nullptr;
+    for (llvm::Type* param_ty : fn_ty->params())
+        if (!IsSupportedType(param_ty))
+            return nullptr;
+
+    // An existing declaration is defined instead, keeping its attributes.
+    llvm::Function* wrapper = fn->getParent()->getFunction(name.str());
+    bool declared = wrapper != nullptr;
+    if (declared && (!wrapper->isDeclaration() ||
+                     wrapper->getFunctionType() != fn_ty))
+        return nullptr;
+    if (!declared)
+        wrapper = llvm::Function::Create(fn_ty, llvm::GlobalValue::ExternalLinkage,
+                                         name, fn->getParent());
+    auto bb = llvm::BasicBlock::Create(fn->getContext(), "", wrapper);
+    llvm::IRBuilder<> irb(bb);
+    llvm::Type* i8 = irb.getInt8Ty();
+    llvm::Type* i64 = irb.getInt64Ty();
+
+    auto sptr_ty = llvm::ArrayType::get(i8, SptrOff::STRUCT_SIZE);
+    llvm::AllocaInst* sptr = irb.CreateAlloca(sptr_ty);
+    sptr->setAlignment(llvm::Align(16));
+    stack_size = (stack_size + 15) & ~size_t{15};
+    llvm::AllocaInst* stack = irb.CreateAlloca(llvm::ArrayType::get(i8, stack_size));
+    stack->setAlignment(llvm::Align(16));
+
+    auto elem_ptr = [&irb] (llvm::AllocaInst* base, uint64_t off) {
+        return irb.CreateConstInBoundsGEP2_64(base->getAllocatedType(), base,
+                                              0, off);
+    };
+    auto store = [&] (llvm::AllocaInst* base, uint64_t off, llvm::Value* val) {
+        llvm::Value* ptr = elem_ptr(base, off);
+        ptr = irb.CreatePointerCast(ptr, val->getType()->getPointerTo());
+        irb.CreateStore(val, ptr);
+    };
+
+    // Integer and pointer arguments go into the six argument registers, float
+    // and double into XMM0-XMM7. All others are passed on the stack.
+    static const unsigned gp_args[] = {
+        SptrOff::RDI, SptrOff::RSI, SptrOff::RDX,
+        SptrOff::RCX, SptrOff::R8, SptrOff::R9,
+    };
+    unsigned gp_idx = 0, xmm_idx = 0;
+    llvm::SmallVector<llvm::Value*, 8> stack_args;
+    for (llvm::Argument& arg : wrapper->args()) {
+        llvm::Value* val = &arg;
+        if (val->getType()->isPointerTy())
+            val = irb.CreatePtrToInt(val, i64);
+        else if (arg.hasSExtAttr())
+            val = irb.CreateSExt(val, i64);
+        else if (val->getType()->isIntegerTy())
+            val = irb.CreateZExt(val, i64);
+
+        if (val->getType()->isIntegerTy() && gp_idx < 6)
+            store(sptr, gp_args[gp_idx++], val);
+        else if (!val->getType()->isIntegerTy() && xmm_idx < 8)
+            store(sptr, SptrOff::XMM0 + 16 * xmm_idx++, val);
+        else
+            stack_args.push_back(val);
+    }
+
+    // The return address is at the stack pointer, followed by the arguments.
+    // At function entry, the stack pointer is 8 mod 16.
+    uint64_t args_size = (8 * stack_args.size() + 15) & ~uint64_t{15};
+    if (args_size + 8 > stack_size) {
+        if (declared)
+            wrapper->deleteBody();
+        else
+            wrapper->eraseFromParent();
+        return nullptr;
+    }
+    uint64_t sp_off = stack_size - args_size - 8;
+    store(stack, sp_off, irb.getInt64(0));
+    for (size_t i = 0; i < stack_args.size(); i++)
+        store(stack, sp_off + 8 + 8 * i, stack_args[i]);
+
+    llvm::Value* sp = irb.CreatePtrToInt(elem_ptr(stack, sp_off), i64);
+    store(sptr, SptrOff::RSP, sp);
+    store(sptr, SptrOff::RIP, irb.getInt64(entry_addr));
+    store(sptr, SptrOff::DF, irb.getInt8(0));
+
+    llvm::Type* sptr_param_ty = fn->getFunctionType()->getParamType(0);
+    llvm::Value* sptr_arg = irb.CreatePointerCast(sptr, sptr_param_ty);
+    llvm::CallInst* call = irb.CreateCall(fn->getFunctionType(), fn, {sptr_arg});
+    call->setCallingConv(fn->getCallingConv());
+    // The always-inliner of the new pass manager only considers functions
+    // with the attribute, not call sites.
+    if (!fn->hasFnAttribute(llvm::Attribute::NoInline))
+        fn->addFnAttr(llvm::Attribute::AlwaysInline);
+#if LL_LLVM_MAJOR >= 14
+    call->addFnAttr(llvm::Attribute::AlwaysInline);
+#else
+    call->addAttribute(llvm::AttributeList::FunctionIndex,
+                       llvm::Attribute::AlwaysInline);
+#endif
+
+    if (ret_ty->isVoidTy()) {
+        irb.CreateRetVoid();
+        return wrapper;
+    }
+
+    unsigned ret_off = ret_ty->isFloatingPointTy() ? SptrOff::XMM0 : SptrOff::RAX;
+    llvm::Type* load_ty = ret_ty->isPointerTy() ? i64 : ret_ty;
+    llvm::Value* ret_ptr = irb.CreatePointerCast(elem_ptr(sptr, ret_off),
+                                                 load_ty->getPointerTo());
+    llvm::Value* ret = irb.CreateLoad(load_ty, ret_ptr);
+    if (ret_ty->isPointerTy())
+        ret = irb.CreateIntToPtr(ret, ret_ty);
+    irb.CreateRet(ret);
+    return wrapper;
+}
+
+#else // RELLUME_WITH_X86_64
+
+llvm::Function* CreateNativeWrapper(llvm::Function* /*fn*/,
+                                    llvm::FunctionType* /*fn_ty*/,
+                                    uint64_t /*entry_addr*/,
+                                    size_t /*stack_size*/,
+                                    const llvm::Twine& /*name*/) {
+    return nullptr;
+}
+
+#endif // RELLUME_WITH_X86_64
+
+} // namespace rellume
+
+/**
+ * @}
+ **/
@@ -0,0 +1,56 @@
+/**
+ * This file is part of Rellume.
+ *
+ * (c) 2016-2019, Alexis Engelke <alexis.engelke@googlemail.com>
+ *
+ * Rellume is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * Rellume is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Rellume.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * \file
+ **/
+
+#ifndef RELLUME_WRAPPER_H
+#define RELLUME_WRAPPER_H
+
+#include <cstddef>
+#include <cstdint>
+
+
+namespace llvm {
+class Function;
+class FunctionType;
+class Twine;
+}
+
+namespace rellume {
+
+/// Create a function with the native signature fn_ty, which calls the lifted
+/// function fn according to the System V x86-64 ABI. The CPU struct and a
+/// guest stack of stack_size bytes are allocas of the wrapper, so that after
+/// inlining fn into the wrapper, the optimizer can promote the registers. The
+/// instruction pointer is set to entry_addr. Only integer (up to 64 bit),
+/// pointer, float and double parameters and return values are supported.
+/// An existing declaration named name is defined, so that its signext
+/// parameter attributes can select the extension of narrow integers.
+/// Returns nullptr if fn does not use the x86-64 SPTR calling convention and
+/// the default CPU struct layout, or fn_ty is not supported.
+llvm::Function* CreateNativeWrapper(llvm::Function* fn,
+                                    llvm::FunctionType* fn_ty,
+                                    uint64_t entry_addr, size_t stack_size,
+                                    const llvm::Twine& name);
+
+} // namespace rellume
+
+#endif
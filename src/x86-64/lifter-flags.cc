@@ -23,8 +23,10 @@
 
 #include "x86-64/lifter-private.h"
 
+#include "config.h"
 #include "instr.h"
 #include "regfile.h"
+#include "x86-64/lifter.h"
 #include <llvm/IR/Intrinsics.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Module.h>
@@ -54,54 +56,165 @@ static llvm::Value* FlagAux(llvm::IRBuilder<>& irb, llvm::Value* res,
     return irb.CreateICmpNE(masked, llvm::Constant::getNullValue(res->getType()));
 }
 
-void Lifter::FlagCalcSAPLogic(llvm::Value* res) {
+static llvm::Value* FlagGenerator(ArchReg reg, Facet facet,
+                                  llvm::BasicBlock* bb, void* data) {
+    const FlagDesc& desc = *static_cast<const FlagDesc*>(data);
+    llvm::IRBuilder<> irb(bb);
+    if (llvm::Instruction* terminator = bb->getTerminator())
+        irb.SetInsertPoint(terminator);
+
+    llvm::Value* res = desc.res;
+    llvm::Value* lhs = desc.lhs;
+    llvm::Value* rhs = desc.rhs;
     auto zero = llvm::Constant::getNullValue(res->getType());
-    SetFlag(Facet::SF, irb.CreateICmpSLT(res, zero));
-    SetFlag(Facet::PF, FlagParity(irb, res));
+    switch (facet) {
+    case Facet::ZF:
+        if (desc.alt_zf)
+            return irb.CreateICmpEQ(lhs, rhs);
+        return irb.CreateICmpEQ(res, zero);
+    case Facet::SF:
+        return irb.CreateICmpSLT(res, zero);
+    case Facet::PF:
+        return FlagParity(irb, res);
+    case Facet::AF:
+        assert(desc.kind != FlagDesc::LOGIC && "AF of logic op is undefined");
+        return FlagAux(irb, res, lhs, rhs);
+    case Facet::CF:
+        if (desc.kind == FlagDesc::ADD)
+            return irb.CreateICmpULT(res, lhs);
+        assert(desc.kind == FlagDesc::SUB && "CF of logic op is not deferred");
+        return irb.CreateICmpULT(lhs, rhs);
+    case Facet::OF:
+        if (desc.kind == FlagDesc::ADD) {
+            if (desc.overflow_intrinsics) {
+                llvm::Intrinsic::ID id = llvm::Intrinsic::sadd_with_overflow;
+                llvm::Value* packed = irb.CreateBinaryIntrinsic(id, lhs, rhs);
+                return irb.CreateExtractValue(packed, 1);
+            }
+            llvm::Value* tmp1 = irb.CreateNot(irb.CreateXor(lhs, rhs));
+            llvm::Value* tmp2 = irb.CreateAnd(tmp1, irb.CreateXor(res, lhs));
+            return irb.CreateICmpSLT(tmp2, zero);
+        }
+        assert(desc.kind == FlagDesc::SUB && "OF of logic op is not deferred");
+        // Set overflow flag using arithmetic comparisons
+        return irb.CreateICmpNE(irb.CreateICmpSLT(res, zero),
+                                irb.CreateICmpSLT(lhs, rhs));
+    default:
+        assert(false && "invalid deferred flag");
+        return nullptr;
+    }
+}
+
+void Lifter::FlagDefer(const FlagDesc& desc,
+                       std::initializer_list<Facet> facets) {
+    // The descriptor is shared by all flags and lives as long as the function,
+    // as the flags might only be computed when lifting is complete.
+    auto* stored = ablock.GetAllocator().Allocate<FlagDesc>();
+    *stored = desc;
+    for (const auto facet : facets)
+        SetFlagDeferred(facet, FlagGenerator, stored);
+}
+
+void Lifter::FlagCalcSAPLogic(llvm::Value* res) {
+    FlagDefer(FlagDesc{FlagDesc::LOGIC, false, false, res, nullptr, nullptr},
+              {Facet::SF, Facet::PF});
     SetFlagUndef({Facet::AF});
 }
 
 void Lifter::FlagCalcAdd(llvm::Value* res, llvm::Value* lhs,
                          llvm::Value* rhs, bool skip_carry) {
-    auto zero = llvm::Constant::getNullValue(res->getType());
-    SetFlag(Facet::ZF, irb.CreateICmpEQ(res, zero));
-    SetFlag(Facet::SF, irb.CreateICmpSLT(res, zero));
-    SetFlag(Facet::PF, FlagParity(irb, res));
-    SetFlag(Facet::AF, FlagAux(irb, res, lhs, rhs));
-    if (!skip_carry)
-        SetFlag(Facet::CF, irb.CreateICmpULT(res, lhs));
-
-    if (cfg.enableOverflowIntrinsics) {
-        llvm::Intrinsic::ID id = llvm::Intrinsic::sadd_with_overflow;
-        llvm::Value* packed = irb.CreateBinaryIntrinsic(id, lhs, rhs);
-        SetFlag(Facet::OF, irb.CreateExtractValue(packed, 1));
-    } else {
-        llvm::Value* tmp1 = irb.CreateNot(irb.CreateXor(lhs, rhs));
-        llvm::Value* tmp2 = irb.CreateAnd(tmp1, irb.CreateXor(res, lhs));
-        SetFlag(Facet::OF, irb.CreateICmpSLT(tmp2, zero));
-    }
+    FlagDesc desc{FlagDesc::ADD, false, cfg.enableOverflowIntrinsics, res,
+                  lhs, rhs};
+    if (skip_carry)
+        FlagDefer(desc, {Facet::ZF, Facet::SF, Facet::PF, Facet::AF, Facet::OF});
+    else
+        FlagDefer(desc, {Facet::ZF, Facet::SF, Facet::PF, Facet::AF, Facet::CF,
+                         Facet::OF});
 }
 
 void Lifter::FlagCalcSub(llvm::Value* res, llvm::Value* lhs,
                          llvm::Value* rhs, bool skip_carry, bool alt_zf) {
-    auto zero = llvm::Constant::getNullValue(res->getType());
-    llvm::Value* sf = irb.CreateICmpSLT(res, zero);  // also used for OF
-
-    if (alt_zf)
-        SetFlag(Facet::ZF, irb.CreateICmpEQ(lhs, rhs));
+    FlagDesc desc{FlagDesc::SUB, alt_zf, false, res, lhs, rhs};
+    if (skip_carry)
+        FlagDefer(desc, {Facet::ZF, Facet::SF, Facet::PF, Facet::AF, Facet::OF});
     else
-        SetFlag(Facet::ZF, irb.CreateICmpEQ(res, zero));
-    SetFlag(Facet::SF, sf);
-    SetFlag(Facet::PF, FlagParity(irb, res));
-    SetFlag(Facet::AF, FlagAux(irb, res, lhs, rhs));
-    if (!skip_carry)
-        SetFlag(Facet::CF, irb.CreateICmpULT(lhs, rhs));
-
-    // Set overflow flag using arithmetic comparisons
-    SetFlag(Facet::OF, irb.CreateICmpNE(sf, irb.CreateICmpSLT(lhs, rhs)));
+        FlagDefer(desc, {Facet::ZF, Facet::SF, Facet::PF, Facet::AF, Facet::CF,
+                         Facet::OF});
+}
+
+// Compute a condition with a single comparison of the operands of the last
+// flag-setting operation, if the flags it depends on are still deferred. This
+// gives, e.g., icmp slt for cmp+jl, instead of comparing SF and OF.
+llvm::Value* Lifter::FlagCondFused(Condition cond) {
+    auto deferred = [this](Facet facet) {
+        void* data = regfile->GetRegDeferred(ArchReg::EFLAGS, facet,
+                                             FlagGenerator);
+        return static_cast<const FlagDesc*>(data);
+    };
+    auto is_false = [this](Facet facet) {
+        return GetFlag(facet) == irb.getFalse();
+    };
+
+    auto base = static_cast<Condition>(static_cast<int>(cond) & ~1);
+    if (base == Condition::O || base == Condition::P)
+        return nullptr;
+    bool need_zf = base == Condition::Z || base == Condition::BE ||
+                   base == Condition::LE;
+    bool need_sf = base == Condition::S || base == Condition::L ||
+                   base == Condition::LE;
+    bool need_cf = base == Condition::C || base == Condition::BE;
+    bool need_of = base == Condition::L || base == Condition::LE;
+
+    const FlagDesc* desc = deferred(need_zf ? Facet::ZF :
+                                    need_sf ? Facet::SF : Facet::CF);
+    if (!desc || desc->kind == FlagDesc::ADD)
+        return nullptr;
+    // ZF and SF of logic operations are set separately, compare the result.
+    const FlagDesc* sf_desc = deferred(Facet::SF);
+    if (need_sf && sf_desc != desc &&
+        !(sf_desc && desc->kind == FlagDesc::LOGIC &&
+          sf_desc->kind == FlagDesc::LOGIC && sf_desc->res == desc->res))
+        return nullptr;
+
+    llvm::Value* lhs;
+    llvm::Value* rhs;
+    auto zero = llvm::Constant::getNullValue(desc->res->getType());
+    if (desc->kind == FlagDesc::SUB) {
+        if (need_cf && deferred(Facet::CF) != desc)
+            return nullptr;
+        if (need_of && deferred(Facet::OF) != desc)
+            return nullptr;
+        lhs = base == Condition::S ? desc->res : desc->lhs;
+        rhs = base == Condition::S ? zero : desc->rhs;
+    } else {
+        // Logic operations clear CF and OF, all conditions depend on res.
+        if (need_cf && !is_false(Facet::CF))
+            return nullptr;
+        if (need_of && !is_false(Facet::OF))
+            return nullptr;
+        lhs = desc->res;
+        rhs = zero;
+    }
+
+    llvm::CmpInst::Predicate pred;
+    switch (base) {
+    case Condition::Z:  pred = llvm::CmpInst::ICMP_EQ; break;
+    case Condition::C:  pred = llvm::CmpInst::ICMP_ULT; break;
+    case Condition::BE: pred = llvm::CmpInst::ICMP_ULE; break;
+    case Condition::S:  pred = llvm::CmpInst::ICMP_SLT; break;
+    case Condition::L:  pred = llvm::CmpInst::ICMP_SLT; break;
+    case Condition::LE: pred = llvm::CmpInst::ICMP_SLE; break;
+    default: assert(0); return nullptr;
+    }
+    if (static_cast<int>(cond) & 1)
+        pred = llvm::CmpInst::getInversePredicate(pred);
+    return irb.CreateICmp(pred, lhs, rhs);
 }
 
 llvm::Value* Lifter::FlagCond(Condition cond) {
+    if (llvm::Value* fused = FlagCondFused(cond))
+        return fused;
+
     llvm::Value* result = nullptr;
     switch (static_cast<Condition>(static_cast<int>(cond) & ~1)) {
     case Condition::O:  result = GetFlag(Facet::OF); break;
@@ -143,6 +256,226 @@ void Lifter::FlagFromReg(llvm::Value* val) {
     }
 }
 
+static RegisterSet FlagSet(std::initializer_list<Facet> facets) {
+    RegisterSet res;
+    for (const auto facet : facets)
+        res[RegisterSetBitIdx(ArchReg::EFLAGS, facet)] = true;
+    return res;
+}
+
+void InstrFlags(const Instr& inst, const LLConfig& cfg, RegisterSet& use,
+                RegisterSet& def) noexcept {
+    const RegisterSet status = FlagSet({Facet::OF, Facet::SF, Facet::ZF,
+                                        Facet::AF, Facet::PF, Facet::CF});
+    const RegisterSet all = status | FlagSet({Facet::DF});
+
+    use = RegisterSet{};
+    def = RegisterSet{};
+    // Overridden implementations get the flags through the CPU struct.
+    if (cfg.instr_overrides.find(inst.type()) != cfg.instr_overrides.end()) {
+        use = all;
+        return;
+    }
+
+    switch (inst.type()) {
+    default:
+        // Conservatively assume that everything else needs all flags, this
+        // includes calls, returns, and instructions we cannot lift at all.
+        use = all;
+        break;
+
+    case FDI_NOP:
+    case FDI_RDSSP:
+    case FDI_ENDBR64:
+    case FDI_PUSH:
+    case FDI_POP:
+    case FDI_LEAVE:
+    case FDI_MOV:
+    case FDI_MOVABS:
+    case FDI_MOVZX:
+    case FDI_MOVSX:
+    case FDI_MOVNTI:
+    case FDI_MOVBE:
+    case FDI_XCHG:
+    case FDI_LEA:
+    case FDI_XLATB:
+    case FDI_NOT:
+    case FDI_BSWAP:
+    case FDI_C_EX:
+    case FDI_C_SEP:
+    case FDI_JMP:
+    case FDI_JCXZ:
+    case FDI_LOOP:
+    case FDI_LFENCE:
+    case FDI_SFENCE:
+    case FDI_MFENCE:
+    case FDI_PREFETCHT0:
+    case FDI_PREFETCHT1:
+    case FDI_PREFETCHT2:
+    case FDI_PREFETCHNTA:
+    case FDI_PREFETCHW:
+    case FDI_SSE_MOVD:
+    case FDI_SSE_MOVQ:
+    case FDI_SSE_MOVSS:
+    case FDI_SSE_MOVSD:
+    case FDI_SSE_MOVUPS:
+    case FDI_SSE_MOVUPD:
+    case FDI_SSE_MOVAPS:
+    case FDI_SSE_MOVAPD:
+    case FDI_SSE_MOVDQU:
+    case FDI_SSE_MOVDQA:
+    case FDI_SSE_PXOR:
+    case FDI_SSE_POR:
+    case FDI_SSE_PAND:
+    case FDI_SSE_XORPS:
+    case FDI_SSE_XORPD:
+    case FDI_SSE_ANDPS:
+    case FDI_SSE_ANDPD:
+    case FDI_SSE_ADDSS:
+    case FDI_SSE_ADDSD:
+    case FDI_SSE_SUBSS:
+    case FDI_SSE_SUBSD:
+    case FDI_SSE_MULSS:
+    case FDI_SSE_MULSD:
+    case FDI_SSE_DIVSS:
+    case FDI_SSE_DIVSD:
+    case FDI_SSE_CVTSS2SD:
+    case FDI_SSE_CVTSD2SS:
+    case FDI_SSE_CVTTSD2SI:
+    case FDI_SSE_CVTTSS2SI:
+    case FDI_SSE_CVTSI2SD:
+    case FDI_SSE_CVTSI2SS:
+        break;
+
+    case FDI_ADD:
+    case FDI_SUB:
+    case FDI_CMP:
+    case FDI_XADD:
+    case FDI_NEG:
+    case FDI_AND:
+    case FDI_OR:
+    case FDI_XOR:
+    case FDI_TEST:
+    case FDI_IMUL:
+    case FDI_MUL:
+    case FDI_IDIV:
+    case FDI_DIV:
+    case FDI_SHL:
+    case FDI_SHR:
+    case FDI_SAR:
+    case FDI_SHLD:
+    case FDI_SHRD:
+    case FDI_BSF:
+    case FDI_TZCNT:
+    case FDI_BSR:
+    case FDI_LZCNT:
+    case FDI_SSE_COMISS:
+    case FDI_SSE_COMISD:
+    case FDI_SSE_UCOMISS:
+    case FDI_SSE_UCOMISD:
+        def = status;
+        break;
+    case FDI_ADC:
+    case FDI_SBB:
+        use = FlagSet({Facet::CF});
+        def = status;
+        break;
+    case FDI_CMPXCHG:
+        // ZF is read again to select the value of the destination register.
+        use = FlagSet({Facet::ZF});
+        def = status;
+        break;
+    case FDI_INC:
+    case FDI_DEC:
+        def = status & ~FlagSet({Facet::CF});
+        break;
+    case FDI_ROL:
+    case FDI_ROR:
+        def = FlagSet({Facet::OF, Facet::CF});
+        break;
+    case FDI_BT:
+    case FDI_BTC:
+    case FDI_BTR:
+    case FDI_BTS:
+        def = status & ~FlagSet({Facet::ZF});
+        break;
+
+    case FDI_CLC:
+    case FDI_STC:
+        def = FlagSet({Facet::CF});
+        break;
+    case FDI_CMC:
+        use = FlagSet({Facet::CF});
+        def = use;
+        break;
+    case FDI_CLD:
+    case FDI_STD:
+        def = FlagSet({Facet::DF});
+        break;
+    case FDI_SAHF:
+        def = FlagSet({Facet::SF, Facet::ZF, Facet::AF, Facet::PF, Facet::CF});
+        break;
+
+    case FDI_LODS:
+    case FDI_STOS:
+    case FDI_MOVS:
+        use = FlagSet({Facet::DF});
+        break;
+    case FDI_SCAS:
+    case FDI_CMPS:
+        // With a REP prefix, the flags remain unmodified if the count is zero.
+        use = FlagSet({Facet::DF, Facet::ZF});
+        if (!inst.has_rep() && !inst.has_repnz())
+            def = status;
+        break;
+
+    case FDI_LOOPZ:
+    case FDI_LOOPNZ:
+        use = FlagSet({Facet::ZF});
+        break;
+    case FDI_JO: case FDI_JNO:
+    case FDI_CMOVO: case FDI_CMOVNO:
+    case FDI_SETO: case FDI_SETNO:
+        use = FlagSet({Facet::OF});
+        break;
+    case FDI_JC: case FDI_JNC:
+    case FDI_CMOVC: case FDI_CMOVNC:
+    case FDI_SETC: case FDI_SETNC:
+        use = FlagSet({Facet::CF});
+        break;
+    case FDI_JZ: case FDI_JNZ:
+    case FDI_CMOVZ: case FDI_CMOVNZ:
+    case FDI_SETZ: case FDI_SETNZ:
+        use = FlagSet({Facet::ZF});
+        break;
+    case FDI_JBE: case FDI_JA:
+    case FDI_CMOVBE: case FDI_CMOVA:
+    case FDI_SETBE: case FDI_SETA:
+        use = FlagSet({Facet::CF, Facet::ZF});
+        break;
+    case FDI_JS: case FDI_JNS:
+    case FDI_CMOVS: case FDI_CMOVNS:
+    case FDI_SETS: case FDI_SETNS:
+        use = FlagSet({Facet::SF});
+        break;
+    case FDI_JP: case FDI_JNP:
+    case FDI_CMOVP: case FDI_CMOVNP:
+    case FDI_SETP: case FDI_SETNP:
+        use = FlagSet({Facet::PF});
+        break;
+    case FDI_JL: case FDI_JGE:
+    case FDI_CMOVL: case FDI_CMOVGE:
+    case FDI_SETL: case FDI_SETGE:
+        use = FlagSet({Facet::SF, Facet::OF});
+        break;
+    case FDI_JLE: case FDI_JG:
+    case FDI_CMOVLE: case FDI_CMOVG:
+    case FDI_SETLE: case FDI_SETG:
+        use = FlagSet({Facet::ZF, Facet::SF, Facet::OF});
+        break;
+    }
+}
+
 } // namespace::x86_64
 
 /**
@@ -50,6 +50,15 @@ void Lifter::LiftMovgp(const Instr& inst, llvm::Instruction::CastOps cast) {
     OpStoreGp(inst.op(0), irb.CreateCast(cast, val, tgt_ty));
 }
 
+void Lifter::LiftMovnti(const Instr& inst) {
+    llvm::Value* val = OpLoad(inst.op(1), Facet::I);
+    llvm::Value* addr = OpAddr(inst.op(0), val->getType());
+    llvm::StoreInst* store = irb.CreateStore(val, addr);
+    fi.SetGuestAliasScope(store);
+    OpSetAlignment(store, addr, val->getType(), ALIGN_NONE);
+    SetNonTemporal(store);
+}
+
 // Implementation of ADD, ADC, SUB, SBB, CMP, and XADD
 void Lifter::LiftArith(const Instr& inst, bool sub) {
     llvm::Value* op1;
@@ -688,8 +697,28 @@ void Lifter::LiftRdtsc(const Instr& inst) {
     SetReg(ArchReg::RDX, Facet::I64, hi);
 }
 
+llvm::Value* Lifter::RepAddr(ArchReg reg, unsigned addrsz) {
+    if (addrsz == 8)
+        return irb.CreatePointerCast(GetReg(reg, Facet::PTR), irb.getInt8PtrTy());
+    // With 32-bit addresses, the upper half of the register is ignored.
+    llvm::Value* addr = irb.CreateZExt(GetReg(reg, Facet::I32), irb.getInt64Ty());
+    return irb.CreateIntToPtr(addr, irb.getInt8PtrTy());
+}
+
+void Lifter::RepSetAddr(ArchReg reg, unsigned addrsz, llvm::Value* ptr) {
+    if (addrsz == 8) {
+        SetRegPtr(reg, ptr);
+        return;
+    }
+    llvm::Value* addr = irb.CreatePtrToInt(ptr, irb.getInt64Ty());
+    StoreGp(reg, irb.CreateTrunc(addr, irb.getInt32Ty()));
+}
+
 Lifter::RepInfo Lifter::RepBegin(const Instr& inst) {
     RepInfo info = {};
+    // Only 64-bit and 32-bit addresses are possible in 64-bit mode.
+    info.addrsz = inst.addrsz() == 4 ? 4 : 8;
+    Facet count_facet = info.addrsz == 4 ? Facet::I32 : Facet::I64;
 
     bool condrep = inst.type() == FDI_SCAS || inst.type() == FDI_CMPS;
     if (inst.has_rep())
@@ -705,7 +734,7 @@ Lifter::RepInfo Lifter::RepBegin(const Instr& inst) {
         info.cont_block = ablock.AddBlock();
         info.ip = GetReg(ArchReg::IP, Facet::I64);
 
-        llvm::Value* count = GetReg(ArchReg::RCX, Facet::I64);
+        llvm::Value* count = GetReg(ArchReg::RCX, count_facet);
         llvm::Value* zero = llvm::Constant::getNullValue(count->getType());
         llvm::Value* enter_loop = irb.CreateICmpNE(count, zero);
         ablock.GetInsertBlock()->BranchTo(enter_loop, *info.loop_block,
@@ -717,9 +746,9 @@ Lifter::RepInfo Lifter::RepBegin(const Instr& inst) {
     info.ty = irb.getIntNTy(inst.opsz() * 8);
     llvm::Type* op_ty = info.ty->getPointerTo();
     if (inst.type() != FDI_LODS)
-        info.di = irb.CreatePointerCast(GetReg(ArchReg::RDI, Facet::PTR), op_ty);
+        info.di = irb.CreatePointerCast(RepAddr(ArchReg::RDI, info.addrsz), op_ty);
     if (inst.type() != FDI_STOS && inst.type() != FDI_SCAS)
-        info.si = irb.CreatePointerCast(GetReg(ArchReg::RSI, Facet::PTR), op_ty);
+        info.si = irb.CreatePointerCast(RepAddr(ArchReg::RSI, info.addrsz), op_ty);
 
     return info;
 }
@@ -730,18 +759,25 @@ void Lifter::RepEnd(RepInfo info) {
     llvm::Value* adj = irb.CreateSelect(df, irb.getInt64(-1), irb.getInt64(1));
 
     if (info.di)
-        SetRegPtr(ArchReg::RDI, irb.CreateGEP(info.ty, info.di, adj));
+        RepSetAddr(ArchReg::RDI, info.addrsz, irb.CreateGEP(info.ty, info.di, adj));
     if (info.si)
-        SetRegPtr(ArchReg::RSI, irb.CreateGEP(info.ty, info.si, adj));
+        RepSetAddr(ArchReg::RSI, info.addrsz, irb.CreateGEP(info.ty, info.si, adj));
 
     // If instruction has REP/REPZ/REPNZ, add branching logic
     if (info.mode == RepInfo::NO_REP)
         return;
 
     // Decrement count and check.
-    llvm::Value* count = GetReg(ArchReg::RCX, Facet::I64);
-    count = irb.CreateSub(count, irb.getInt64(1));
-    SetReg(ArchReg::RCX, Facet::I64, count);
+    llvm::Value* count;
+    if (info.addrsz == 4) {
+        count = GetReg(ArchReg::RCX, Facet::I32);
+        count = irb.CreateSub(count, irb.getInt32(1));
+        StoreGp(ArchReg::RCX, count);
+    } else {
+        count = GetReg(ArchReg::RCX, Facet::I64);
+        count = irb.CreateSub(count, irb.getInt64(1));
+        SetReg(ArchReg::RCX, Facet::I64, count);
+    }
 
     llvm::Value* zero = llvm::Constant::getNullValue(count->getType());
     llvm::Value* cond = irb.CreateICmpNE(count, zero);
@@ -768,61 +804,225 @@ void Lifter::LiftLods(const Instr& inst) {
 }
 
 void Lifter::LiftStos(const Instr& inst) {
-    if (inst.has_rep() && inst.opsz() == 1) {
-        // TODO: respect address size
-        // TODO: support stosw/stosd/stosq if rax == 0
-        llvm::Type* ty = irb.getIntNTy(inst.opsz() * 8);
-        llvm::Type* ptr_ty = ty->getPointerTo();
-        auto di = irb.CreatePointerCast(GetReg(ArchReg::RDI, Facet::PTR), ptr_ty);
-        auto cx = GetReg(ArchReg::RCX, Facet::I64);
-        auto ax = GetReg(ArchReg::RAX, Facet::I8);
-        auto ip = GetReg(ArchReg::IP, Facet::I64);
-
-        auto* df0_block = ablock.AddBlock();
-        auto* df1_block = ablock.AddBlock();
-        auto* cont_block = ablock.AddBlock();
-
-        llvm::Value* df = GetFlag(Facet::DF);
-        ablock.GetInsertBlock()->BranchTo(df, *df1_block, *df0_block);
-
-        SetInsertBlock(df0_block);
-        irb.CreateMemSet(di, ax, cx, llvm::Align());
-        SetRegPtr(ArchReg::RDI, irb.CreateGEP(ty, di, cx));
-        ablock.GetInsertBlock()->BranchTo(*cont_block);
+    if (!inst.has_rep() || (inst.addrsz() != 8 && inst.addrsz() != 4)) {
+        RepInfo rep_info = RepBegin(inst); // NOTE: this modifies control flow!
 
-        SetInsertBlock(df1_block);
-        auto adj = irb.CreateSub(irb.getInt64(1), cx);
-        auto base = irb.CreateGEP(ty, di, adj);
-        irb.CreateMemSet(base, ax, cx, llvm::Align());
-        SetRegPtr(ArchReg::RDI, irb.CreateGEP(ty, base, irb.getInt64(-1)));
-        ablock.GetInsertBlock()->BranchTo(*cont_block);
+        auto ax = GetReg(ArchReg::RAX, Facet::In(inst.opsz() * 8));
+        irb.CreateStore(ax, rep_info.di);
 
-        SetInsertBlock(cont_block);
-        SetReg(ArchReg::RCX, Facet::I64, irb.getInt64(0));
-        SetReg(ArchReg::IP, Facet::I64, ip);
+        RepEnd(rep_info); // NOTE: this modifies control flow!
         return;
     }
 
-    // TODO: optimize REP STOSB and other sizes with constant zero to llvm
-    // memset intrinsic.
-    RepInfo rep_info = RepBegin(inst); // NOTE: this modifies control flow!
+    // Storing the same value repeatedly is a memset if all bytes of the value
+    // are equal (e.g., zero or -1). Otherwise, fall back to the loop.
+    unsigned addrsz = inst.addrsz();
+    Facet addr_facet = Facet::In(addrsz * 8);
+    unsigned size = inst.opsz();
+    llvm::Type* i8 = irb.getInt8Ty();
+    llvm::Type* i64 = irb.getInt64Ty();
+    llvm::Type* ty = irb.getIntNTy(size * 8);
+    auto cx = irb.CreateZExt(GetReg(ArchReg::RCX, addr_facet), i64);
+    auto ax = GetReg(ArchReg::RAX, Facet::In(size * 8));
+    auto ip = GetReg(ArchReg::IP, Facet::I64);
+    auto byte = size == 1 ? ax : irb.CreateTrunc(ax, i8);
+    llvm::Value* df = GetFlag(Facet::DF);
 
-    auto ax = GetReg(ArchReg::RAX, Facet::In(inst.opsz() * 8));
-    irb.CreateStore(ax, rep_info.di);
+    auto len = irb.CreateMul(cx, irb.getInt64(size));
+    llvm::Value* use_memset = nullptr;
+    if (size > 1) {
+        uint64_t ones = ~uint64_t{0} / 0xff >> (64 - size * 8);
+        auto splat = irb.CreateMul(irb.CreateZExt(byte, ty),
+                                   llvm::ConstantInt::get(ty, ones));
+        use_memset = irb.CreateICmpEQ(splat, ax);
+    }
+    llvm::Value* di_ptr = RepAddr(ArchReg::RDI, addrsz);
+    if (addrsz == 8) {
+        if (size > 1) {
+            // len must not overflow.
+            uint64_t max_cx = UINT64_MAX / size;
+            use_memset = irb.CreateAnd(use_memset,
+                                       irb.CreateICmpULE(cx, irb.getInt64(max_cx)));
+        }
+    } else {
+        // The destination must not wrap around the address space.
+        auto di = irb.CreatePtrToInt(di_ptr, i64);
+        auto limit = irb.getInt64(uint64_t{1} << 32);
+        auto fwd = irb.CreateICmpULE(irb.CreateAdd(di, len), limit);
+        auto bwd = irb.CreateICmpUGE(irb.CreateAdd(di, irb.getInt64(size)), len);
+        auto no_wrap = irb.CreateSelect(df, bwd, fwd);
+        use_memset = use_memset ? irb.CreateAnd(use_memset, no_wrap) : no_wrap;
+    }
 
-    RepEnd(rep_info); // NOTE: this modifies control flow!
+    BasicBlock* loop_block = nullptr;
+    auto* cont_block = ablock.AddBlock();
+    if (use_memset) {
+        auto* memset_block = ablock.AddBlock();
+        loop_block = ablock.AddBlock();
+        ablock.GetInsertBlock()->BranchTo(use_memset, *memset_block,
+                                          *loop_block);
+        SetInsertBlock(memset_block);
+    }
+
+    // With DF=1, the stored region ends with the current element.
+    auto start_off = irb.CreateSelect(df, irb.CreateSub(irb.getInt64(size), len),
+                                      irb.getInt64(0));
+    auto end_off = irb.CreateSelect(df, irb.CreateNeg(len), len);
+    irb.CreateMemSet(irb.CreateGEP(i8, di_ptr, start_off), byte, len,
+                     llvm::MaybeAlign());
+    RepSetAddr(ArchReg::RDI, addrsz, irb.CreateGEP(i8, di_ptr, end_off));
+    SetReg(ArchReg::RCX, Facet::I64, irb.getInt64(0));
+    ablock.GetInsertBlock()->BranchTo(*cont_block);
+
+    if (loop_block) {
+        SetInsertBlock(loop_block);
+        RepInfo rep_info = RepBegin(inst); // NOTE: this modifies control flow!
+        irb.CreateStore(ax, rep_info.di);
+        RepEnd(rep_info); // NOTE: this modifies control flow!
+        ablock.GetInsertBlock()->BranchTo(*cont_block);
+    }
+
+    SetInsertBlock(cont_block);
+    SetReg(ArchReg::IP, Facet::I64, ip);
 }
 
 void Lifter::LiftMovs(const Instr& inst) {
-    // TODO: optimize REP MOVSB to use llvm memcpy intrinsic.
-    RepInfo rep_info = RepBegin(inst); // NOTE: this modifies control flow!
+    if (!inst.has_rep() || (inst.addrsz() != 8 && inst.addrsz() != 4)) {
+        RepInfo rep_info = RepBegin(inst); // NOTE: this modifies control flow!
 
-    irb.CreateStore(irb.CreateLoad(rep_info.ty, rep_info.si), rep_info.di);
+        irb.CreateStore(irb.CreateLoad(rep_info.ty, rep_info.si), rep_info.di);
+
+        RepEnd(rep_info); // NOTE: this modifies control flow!
+        return;
+    }
+
+    // Copying element-wise is equivalent to memmove unless the destination
+    // overlaps with source elements not yet read, i.e. the destination is
+    // less than len bytes ahead of the source in copy direction. In that case
+    // (which is rare in practice), fall back to the loop.
+    unsigned addrsz = inst.addrsz();
+    Facet addr_facet = Facet::In(addrsz * 8);
+    llvm::Type* i64 = irb.getInt64Ty();
+    uint64_t elem_size = inst.opsz();
+    // The same addresses are used by the memmove and the loop.
+    llvm::Value* si_ptr = RepAddr(ArchReg::RSI, addrsz);
+    llvm::Value* di_ptr = RepAddr(ArchReg::RDI, addrsz);
+    auto si = irb.CreatePtrToInt(si_ptr, i64);
+    auto di = irb.CreatePtrToInt(di_ptr, i64);
+    auto cx = irb.CreateZExt(GetReg(ArchReg::RCX, addr_facet), i64);
+    auto ip = GetReg(ArchReg::IP, Facet::I64);
+    llvm::Value* df = GetFlag(Facet::DF);
+
+    auto len = irb.CreateMul(cx, irb.getInt64(elem_size));
+    auto diff = irb.CreateSelect(df, irb.CreateSub(si, di),
+                                 irb.CreateSub(di, si));
+    llvm::Value* no_overlap = irb.CreateICmpUGE(diff, len);
+    if (addrsz == 8) {
+        // len must not overflow.
+        uint64_t max_cx = UINT64_MAX / elem_size;
+        no_overlap = irb.CreateAnd(no_overlap,
+                                   irb.CreateICmpULE(cx, irb.getInt64(max_cx)));
+    } else {
+        // Source and destination must not wrap around the address space.
+        auto limit = irb.getInt64(uint64_t{1} << 32);
+        auto elem = irb.getInt64(elem_size);
+        auto fwd = irb.CreateAnd(irb.CreateICmpULE(irb.CreateAdd(si, len), limit),
+                                 irb.CreateICmpULE(irb.CreateAdd(di, len), limit));
+        auto bwd = irb.CreateAnd(irb.CreateICmpUGE(irb.CreateAdd(si, elem), len),
+                                 irb.CreateICmpUGE(irb.CreateAdd(di, elem), len));
+        no_overlap = irb.CreateAnd(no_overlap, irb.CreateSelect(df, bwd, fwd));
+    }
 
+    auto* memmove_block = ablock.AddBlock();
+    auto* loop_block = ablock.AddBlock();
+    auto* cont_block = ablock.AddBlock();
+    ablock.GetInsertBlock()->BranchTo(no_overlap, *memmove_block, *loop_block);
+
+    SetInsertBlock(memmove_block);
+    // With DF=1, the copied region ends with the current element.
+    auto start_off = irb.CreateSelect(df, irb.CreateSub(irb.getInt64(elem_size),
+                                                        len),
+                                      irb.getInt64(0));
+    auto end_off = irb.CreateSelect(df, irb.CreateNeg(len), len);
+    llvm::Type* i8 = irb.getInt8Ty();
+    irb.CreateMemMove(irb.CreateGEP(i8, di_ptr, start_off), llvm::MaybeAlign(),
+                      irb.CreateGEP(i8, si_ptr, start_off), llvm::MaybeAlign(),
+                      len);
+    RepSetAddr(ArchReg::RSI, addrsz, irb.CreateGEP(i8, si_ptr, end_off));
+    RepSetAddr(ArchReg::RDI, addrsz, irb.CreateGEP(i8, di_ptr, end_off));
+    SetReg(ArchReg::RCX, Facet::I64, irb.getInt64(0));
+    ablock.GetInsertBlock()->BranchTo(*cont_block);
+
+    SetInsertBlock(loop_block);
+    RepInfo rep_info = RepBegin(inst); // NOTE: this modifies control flow!
+    irb.CreateStore(irb.CreateLoad(rep_info.ty, rep_info.si), rep_info.di);
     RepEnd(rep_info); // NOTE: this modifies control flow!
+    ablock.GetInsertBlock()->BranchTo(*cont_block);
+
+    SetInsertBlock(cont_block);
+    SetReg(ArchReg::IP, Facet::I64, ip);
+}
+
+BasicBlock* Lifter::RepCmpCall(const Instr& inst, llvm::Function* helper) {
+    // The helper handles the common case of a forward byte-wise comparison
+    // with a non-zero count and returns the number of compared bytes, i.e. the
+    // number of loop iterations. Otherwise, the loop follows in the current
+    // block; the caller has to branch to the returned continuation block.
+    bool scas = inst.type() == FDI_SCAS;
+    llvm::Type* i8 = irb.getInt8Ty();
+    auto cx = GetReg(ArchReg::RCX, Facet::I64);
+    llvm::Value* df = GetFlag(Facet::DF);
+    auto use_call = irb.CreateAnd(irb.CreateICmpNE(cx, irb.getInt64(0)),
+                                  irb.CreateNot(df));
+
+    auto* call_block = ablock.AddBlock();
+    auto* loop_block = ablock.AddBlock();
+    auto* cont_block = ablock.AddBlock();
+    ablock.GetInsertBlock()->BranchTo(use_call, *call_block, *loop_block);
+
+    SetInsertBlock(call_block);
+    llvm::FunctionType* fn_ty = helper->getFunctionType();
+    auto di = GetReg(ArchReg::RDI, Facet::PTR);
+    llvm::Value* si = nullptr;
+    llvm::Value* src;
+    llvm::Value* count;
+    if (scas) {
+        src = GetReg(ArchReg::RAX, Facet::I8);
+        auto di_arg = irb.CreatePointerCast(di, fn_ty->getParamType(0));
+        count = irb.CreateCall(helper, {di_arg, src, cx});
+    } else {
+        si = GetReg(ArchReg::RSI, Facet::PTR);
+        auto si_arg = irb.CreatePointerCast(si, fn_ty->getParamType(0));
+        auto di_arg = irb.CreatePointerCast(di, fn_ty->getParamType(1));
+        count = irb.CreateCall(helper, {si_arg, di_arg, cx});
+    }
+
+    // Flags are those of the last comparison.
+    auto last = irb.CreateSub(count, irb.getInt64(1));
+    if (!scas)
+        src = irb.CreateLoad(i8, irb.CreateGEP(i8, si, last));
+    llvm::Value* dst = irb.CreateLoad(i8, irb.CreateGEP(i8, di, last));
+    FlagCalcSub(irb.CreateSub(src, dst), src, dst);
+
+    SetRegPtr(ArchReg::RDI, irb.CreateGEP(i8, di, count));
+    if (si)
+        SetRegPtr(ArchReg::RSI, irb.CreateGEP(i8, si, count));
+    SetReg(ArchReg::RCX, Facet::I64, irb.CreateSub(cx, count));
+    ablock.GetInsertBlock()->BranchTo(*cont_block);
+
+    SetInsertBlock(loop_block);
+    return cont_block;
 }
 
 void Lifter::LiftScas(const Instr& inst) {
+    BasicBlock* cont_block = nullptr;
+    llvm::Value* ip = nullptr;
+    if (cfg.repne_scasb_function && inst.has_repnz() && inst.opsz() == 1 &&
+        inst.addrsz() == 8) {
+        ip = GetReg(ArchReg::IP, Facet::I64);
+        cont_block = RepCmpCall(inst, cfg.repne_scasb_function);
+    }
+
     RepInfo rep_info = RepBegin(inst); // NOTE: this modifies control flow!
 
     auto src = GetReg(ArchReg::RAX, Facet::In(inst.opsz() * 8));
@@ -831,9 +1031,23 @@ void Lifter::LiftScas(const Instr& inst) {
     FlagCalcSub(irb.CreateSub(src, dst), src, dst);
 
     RepEnd(rep_info); // NOTE: this modifies control flow!
+
+    if (cont_block) {
+        ablock.GetInsertBlock()->BranchTo(*cont_block);
+        SetInsertBlock(cont_block);
+        SetReg(ArchReg::IP, Facet::I64, ip);
+    }
 }
 
 void Lifter::LiftCmps(const Instr& inst) {
+    BasicBlock* cont_block = nullptr;
+    llvm::Value* ip = nullptr;
+    if (cfg.repe_cmpsb_function && inst.has_rep() && inst.opsz() == 1 &&
+        inst.addrsz() == 8) {
+        ip = GetReg(ArchReg::IP, Facet::I64);
+        cont_block = RepCmpCall(inst, cfg.repe_cmpsb_function);
+    }
+
     RepInfo rep_info = RepBegin(inst); // NOTE: this modifies control flow!
 
     llvm::Value* src = irb.CreateLoad(rep_info.ty, rep_info.si);
@@ -842,6 +1056,12 @@ void Lifter::LiftCmps(const Instr& inst) {
     FlagCalcSub(irb.CreateSub(src, dst), src, dst);
 
     RepEnd(rep_info); // NOTE: this modifies control flow!
+
+    if (cont_block) {
+        ablock.GetInsertBlock()->BranchTo(*cont_block);
+        SetInsertBlock(cont_block);
+        SetReg(ArchReg::IP, Facet::I64, ip);
+    }
 }
 
 } // namespace::x86_64
@@ -33,6 +33,7 @@
 #include <llvm/IR/Type.h>
 #include <llvm/IR/Value.h>
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
 
@@ -83,6 +84,7 @@ llvm::Value* Lifter::OpAddr(const Instr::Op op, llvm::Type* element_type,
                 unsigned idx = seg == FD_REG_FS ? SptrIdx::x86_64::FSBASE
                                                 : SptrIdx::x86_64::GSBASE;
                 auto base = irb.CreateLoad(irb.getInt64Ty(), fi.sptr[idx]);
+                fi.SetCpuAliasScope(base);
                 res = irb.CreateAdd(res, base);
             }
         }
@@ -142,12 +144,21 @@ llvm::Value* Lifter::OpAddr(const Instr::Op op, llvm::Type* element_type,
     return irb.CreatePointerCast(base, elem_ptr_ty);
 }
 
-static void ll_operand_set_alignment(llvm::Instruction* value, llvm::Type* type,
-                                     Alignment alignment, bool sse = false) {
+void Lifter::OpSetAlignment(llvm::Instruction* value, llvm::Value* addr,
+                            llvm::Type* type, Alignment alignment, bool sse) {
+    unsigned size = type->getPrimitiveSizeInBits() / 8;
+    // Only legacy SSE instructions with 16-byte memory operands fault on
+    // misaligned accesses, scalar operands can be unaligned.
     if (alignment == ALIGN_IMP)
-        alignment = sse ? ALIGN_MAX : ALIGN_NONE;
-    unsigned bytes =
-        alignment == ALIGN_NONE ? 1 : type->getPrimitiveSizeInBits() / 8;
+        alignment = sse && size >= 16 ? ALIGN_MAX : ALIGN_NONE;
+    unsigned bytes = alignment == ALIGN_NONE ? 1 : size;
+    if (addr->getType()->getPointerAddressSpace() == 0) {
+        // Alignment-checked accesses also tell about the base register, which
+        // can help subsequent unaligned accesses to the same object.
+        if (bytes >= 16)
+            RecordAlignment(addr, bytes);
+        bytes = std::max(bytes, KnownAlignment(addr));
+    }
     llvm::Align align(bytes);
     if (llvm::LoadInst* load = llvm::dyn_cast<llvm::LoadInst>(value))
         load->setAlignment(align);
@@ -181,9 +192,12 @@ llvm::Value* Lifter::OpLoad(const Instr::Op op, Facet facet,
     } else if (op.is_mem()) {
         llvm::Type* type = facet.Type(irb.getContext());
         llvm::Value* addr = OpAddr(op, type, seg);
+        if (llvm::Constant* const_val = ConstLoad(type, addr))
+            return const_val;
         llvm::LoadInst* result = irb.CreateLoad(type, addr);
-        // FIXME: forward SSE information to increase alignment.
-        ll_operand_set_alignment(result, type, alignment, false);
+        fi.SetGuestAliasScope(result);
+        // Implicit alignment is only used by legacy SSE instructions.
+        OpSetAlignment(result, addr, type, alignment, /*sse=*/true);
         return result;
     }
 
@@ -221,7 +235,8 @@ void Lifter::OpStoreGp(const Instr::Op op, llvm::Value* value,
     if (op.is_mem()) {
         llvm::Value* addr = OpAddr(op, value->getType());
         llvm::StoreInst* store = irb.CreateStore(value, addr);
-        ll_operand_set_alignment(store, value->getType(), alignment);
+        fi.SetGuestAliasScope(store);
+        OpSetAlignment(store, addr, value->getType(), alignment);
     } else if (op.is_reg()) {
         assert(value->getType()->getIntegerBitWidth() == op.bits());
 
@@ -239,7 +254,8 @@ void Lifter::OpStoreVec(const Instr::Op op, llvm::Value* value, bool avx,
     if (op.is_mem()) {
         llvm::Value* addr = OpAddr(op, value->getType());
         llvm::StoreInst* store = irb.CreateStore(value, addr);
-        ll_operand_set_alignment(store, value->getType(), alignment, !avx);
+        fi.SetGuestAliasScope(store);
+        OpSetAlignment(store, addr, value->getType(), alignment, !avx);
         return;
     }
 
@@ -299,7 +315,7 @@ void Lifter::StackPush(llvm::Value* value) {
     llvm::Value* rsp = GetReg(ArchReg::RSP, Facet::PTR);
     rsp = irb.CreatePointerCast(rsp, value->getType()->getPointerTo());
     rsp = irb.CreateConstGEP1_64(value->getType(), rsp, -1);
-    irb.CreateStore(value, rsp);
+    fi.SetGuestAliasScope(irb.CreateStore(value, rsp));
 
     SetRegPtr(ArchReg::RSP, rsp);
 }
@@ -310,7 +326,9 @@ llvm::Value* Lifter::StackPop(const ArchReg sp_src_reg) {
 
     SetRegPtr(ArchReg::RSP, irb.CreateConstGEP1_64(irb.getInt64Ty(), rsp, 1));
 
-    return irb.CreateLoad(irb.getInt64Ty(), rsp);
+    llvm::LoadInst* value = irb.CreateLoad(irb.getInt64Ty(), rsp);
+    fi.SetGuestAliasScope(value);
+    return value;
 }
 
 } // namespace rellume::x86_64
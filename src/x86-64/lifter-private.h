@@ -57,6 +57,24 @@ enum class Condition {
     S = 8, NS = 9, P = 10, NP = 11, L = 12, GE = 13, LE = 14, G = 15,
 };
 
+/// Operation from which the flags are computed on demand, so that no code is
+/// generated for flags which are overwritten before they are read.
+struct FlagDesc {
+    enum Kind : uint8_t {
+        ADD, SUB,
+        /// Only depends on res; CF and OF are set separately.
+        LOGIC,
+    };
+    Kind kind;
+    /// For SUB, compute ZF as lhs == rhs.
+    bool alt_zf;
+    /// For ADD, compute OF with llvm.sadd.with.overflow.
+    bool overflow_intrinsics;
+    llvm::Value* res;
+    llvm::Value* lhs;
+    llvm::Value* rhs;
+};
+
 class Lifter : public LifterBase {
 public:
     Lifter(FunctionInfo& fi, const LLConfig& cfg, ArchBasicBlock& ab) :
@@ -88,13 +106,15 @@ private:
     llvm::Value* OpAddr(const Instr::Op op, llvm::Type* element_type, unsigned seg = 7);
     llvm::Value* OpLoad(const Instr::Op op, Facet facet, Alignment alignment = ALIGN_NONE, unsigned force_seg = 7);
     void OpStoreGp(const Instr::Op op, llvm::Value* value, Alignment alignment = ALIGN_NONE);
+    void OpSetAlignment(llvm::Instruction* value, llvm::Value* addr, llvm::Type* type, Alignment alignment, bool sse = false);
     void OpStoreVec(const Instr::Op op, llvm::Value* value, bool avx = false, Alignment alignment = ALIGN_IMP);
     void StackPush(llvm::Value* value);
     llvm::Value* StackPop(const ArchReg sp_src_reg = ArchReg::RSP);
 
+    void FlagDefer(const FlagDesc& desc, std::initializer_list<Facet> facets);
     void FlagCalcZ(llvm::Value* value) {
-        auto zero = llvm::Constant::getNullValue(value->getType());
-        SetFlag(Facet::ZF, irb.CreateICmpEQ(value, zero));
+        FlagDefer(FlagDesc{FlagDesc::LOGIC, false, false, value, nullptr,
+                           nullptr}, {Facet::ZF});
     }
     // Set SF and PF according to result, AF is undefined.
     void FlagCalcSAPLogic(llvm::Value* res);
@@ -103,6 +123,7 @@ private:
     void FlagCalcSub(llvm::Value* res, llvm::Value* lhs, llvm::Value* rhs,
                      bool skip_carry = false, bool alt_zf = false);
 
+    llvm::Value* FlagCondFused(Condition cond);
     llvm::Value* FlagCond(Condition cond);
     llvm::Value* FlagAsReg(unsigned size);
     void FlagFromReg(llvm::Value* val);
@@ -117,11 +138,17 @@ private:
         llvm::Value* di;
         llvm::Value* si;
         llvm::Value* ip;
+        unsigned addrsz;
     };
+    /// Pointer in RSI/RDI of a string instruction with the given address size.
+    llvm::Value* RepAddr(ArchReg reg, unsigned addrsz);
+    void RepSetAddr(ArchReg reg, unsigned addrsz, llvm::Value* ptr);
     RepInfo RepBegin(const Instr& inst);
     void RepEnd(RepInfo info);
+    BasicBlock* RepCmpCall(const Instr& inst, llvm::Function* helper);
 
     void LiftMovgp(const Instr&, llvm::Instruction::CastOps cast);
+    void LiftMovnti(const Instr&);
     void LiftArith(const Instr&, bool sub);
     void LiftCmpxchg(const Instr&);
     void LiftXchg(const Instr&);
@@ -196,6 +223,7 @@ private:
     void LiftSseMovScalar(const Instr&, Facet);
     void LiftSseMovdq(const Instr&, Facet, Alignment);
     void LiftSseMovntStore(const Instr&, Facet);
+    void LiftSseMovntLoad(const Instr&);
     void LiftSseMovlp(const Instr&);
     void LiftSseMovhps(const Instr&);
     void LiftSseMovhpd(const Instr&);
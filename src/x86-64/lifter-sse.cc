@@ -47,12 +47,13 @@ void Lifter::LiftFence(const Instr& inst) {
 
 void Lifter::LiftPrefetch(const Instr& inst, unsigned rw, unsigned locality) {
     llvm::Module* module = irb.GetInsertBlock()->getModule();
+    llvm::Value* addr = OpAddr(inst.op(0), irb.getInt8Ty());
+    // The pointer type depends on the segment, e.g. for native FS/GS.
     llvm::SmallVector<llvm::Type*, 1> tys;
-    tys.push_back(irb.getInt8PtrTy());
+    tys.push_back(addr->getType());
     auto id = llvm::Intrinsic::prefetch;
     llvm::Function* intrinsic = llvm::Intrinsic::getDeclaration(module, id, tys);
 
-    llvm::Value* addr = OpAddr(inst.op(0), irb.getInt8Ty());
     // Prefetch addr for read/write with given locality into the data cache.
     irb.CreateCall(intrinsic, {addr, irb.getInt32(rw), irb.getInt32(locality),
                                irb.getInt32(1)});
@@ -138,12 +139,17 @@ void Lifter::LiftSseMovntStore(const Instr& inst, Facet facet) {
     llvm::Value* value = OpLoad(inst.op(1), facet, ALIGN_MAX);
     llvm::Value* addr = OpAddr(inst.op(0), value->getType());
     llvm::StoreInst* store = irb.CreateStore(value, addr);
-    unsigned align = value->getType()->getPrimitiveSizeInBits() / 8;
-    store->setAlignment(llvm::Align(align));
+    fi.SetGuestAliasScope(store);
+    OpSetAlignment(store, addr, value->getType(), ALIGN_MAX);
+    SetNonTemporal(store);
+}
 
-    llvm::Metadata* const_1 = llvm::ConstantAsMetadata::get(irb.getInt32(1));
-    llvm::MDNode* node = llvm::MDNode::get(store->getContext(), const_1);
-    store->setMetadata(GetModule()->getMDKindID("nontemporal"), node);
+void Lifter::LiftSseMovntLoad(const Instr& inst) {
+    llvm::Value* value = OpLoad(inst.op(1), Facet::I128, ALIGN_MAX);
+    // The load may have been folded into a constant.
+    if (auto load = llvm::dyn_cast<llvm::LoadInst>(value))
+        SetNonTemporal(load);
+    OpStoreVec(inst.op(0), value);
 }
 
 void Lifter::LiftSseMovlp(const Instr& inst) {
@@ -106,8 +106,7 @@ bool Lifter::Lift(const Instr& inst) {
     case FDI_MOVABS: LiftMovgp(inst, llvm::Instruction::SExt); break;
     case FDI_MOVZX: LiftMovgp(inst, llvm::Instruction::ZExt); break;
     case FDI_MOVSX: LiftMovgp(inst, llvm::Instruction::SExt); break;
-    // TODO: set non-temporal hint
-    case FDI_MOVNTI: LiftMovgp(inst, llvm::Instruction::SExt); break;
+    case FDI_MOVNTI: LiftMovnti(inst); break;
     case FDI_MOVBE: LiftMovbe(inst); break;
     case FDI_ADD: LiftArith(inst, /*sub=*/false); break;
     case FDI_ADC: LiftArith(inst, /*sub=*/false); break;
@@ -206,7 +205,7 @@ bool Lifter::Lift(const Instr& inst) {
     case FDI_PREFETCHT1: LiftPrefetch(inst, 0, 2); break;
     case FDI_PREFETCHT2: LiftPrefetch(inst, 0, 1); break;
     case FDI_PREFETCHNTA: LiftPrefetch(inst, 0, 0); break;
-    case FDI_PREFETCHW: LiftPrefetch(inst, 1, 1); break;
+    case FDI_PREFETCHW: LiftPrefetch(inst, 1, 3); break;
     case FDI_PREFETCHWT1: LiftPrefetch(inst, 1, 2); break;
     case FDI_FXSAVE: LiftFxsave(inst); break;
     case FDI_FXRSTOR: LiftFxrstor(inst); break;
@@ -231,8 +230,7 @@ bool Lifter::Lift(const Instr& inst) {
     case FDI_SSE_MOVNTPS: LiftSseMovntStore(inst, Facet::VF32); break;
     case FDI_SSE_MOVNTPD: LiftSseMovntStore(inst, Facet::VF64); break;
     case FDI_SSE_MOVNTDQ: LiftSseMovntStore(inst, Facet::VI64); break;
-    // TODO: set non-temporal hint
-    case FDI_SSE_MOVNTDQA: LiftSseMovdq(inst, Facet::I128, ALIGN_MAX); break;
+    case FDI_SSE_MOVNTDQA: LiftSseMovntLoad(inst); break;
     case FDI_SSE_MOVLPS: LiftSseMovlp(inst); break;
     case FDI_SSE_MOVHLPS: LiftSseMovlp(inst); break;
     case FDI_SSE_MOVLPD: LiftSseMovlp(inst); break;
@@ -24,6 +24,8 @@
 #ifndef RELLUME_LIFTER_H
 #define RELLUME_LIFTER_H
 
+#include "regfile.h"
+
 namespace rellume {
 
 class ArchBasicBlock;
@@ -36,6 +38,12 @@ namespace x86_64 {
 bool LiftInstruction(const Instr& inst, FunctionInfo& fi, const LLConfig& cfg,
                      ArchBasicBlock& ab) noexcept;
 
+/// Determine the flags read and written by an instruction for the flag
+/// liveness analysis. use includes flags which are read after the instruction
+/// wrote them. Instructions not known to the analysis read all flags.
+void InstrFlags(const Instr& inst, const LLConfig& cfg, RegisterSet& use,
+                RegisterSet& def) noexcept;
+
 } // namespace rellume::x86_64
 
 } // namespace rellume
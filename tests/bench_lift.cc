@@ -0,0 +1,158 @@
+
+#include <rellume/rellume.h>
+
+#include <llvm-c/Core.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <new>
+#include <unistd.h>
+#include <vector>
+
+
+// Count all heap allocations to see how many are caused by lifting.
+static std::atomic<size_t> alloc_count{0};
+
+void* operator new(size_t size) {
+    alloc_count++;
+    if (void* ptr = std::malloc(size ? size : 1))
+        return ptr;
+    std::abort();
+}
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+void operator delete[](void* ptr) noexcept {
+    std::free(ptr);
+}
+void operator delete(void* ptr, size_t) noexcept {
+    std::free(ptr);
+}
+void operator delete[](void* ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+static unsigned opt_rounds = 200;
+static unsigned opt_blocks = 64;
+static unsigned opt_threads = 0;
+static unsigned opt_funcs = 256;
+static bool opt_linear = false;
+
+// Create a function with many small basic blocks, each ending with a
+// conditional branch to the next block.
+static std::vector<uint8_t> CreateCode(unsigned blocks) {
+    static const uint8_t block_code[] = {
+        0x48, 0x01, 0xd8,       // add rax, rbx
+        0x48, 0x29, 0xd1,       // sub rcx, rdx
+        0x48, 0x8b, 0x07,       // mov rax, [rdi]
+        0x48, 0x89, 0x47, 0x08, // mov [rdi+8], rax
+        0x48, 0x85, 0xc9,       // test rcx, rcx
+        0x74, 0x00,             // jz $+2
+    };
+    std::vector<uint8_t> code;
+    for (unsigned i = 0; i < blocks; i++)
+        code.insert(code.end(), std::begin(block_code), std::end(block_code));
+    code.push_back(0xc3); // ret
+    return code;
+}
+
+// Lift opt_funcs functions with ll_func_lift_batch using 1, 2, 4, ... up to
+// opt_threads threads to show the scaling of parallel lifting.
+static int BenchBatch(const std::vector<uint8_t>& code, LLConfig* cfg) {
+    std::vector<uintptr_t> addrs(opt_funcs,
+                                 reinterpret_cast<uintptr_t>(code.data()));
+    for (unsigned threads = 1; threads <= opt_threads; threads *= 2) {
+        LLVMContextRef ctx = LLVMContextCreate();
+        LLVMModuleRef mod = LLVMModuleCreateWithNameInContext("bench", ctx);
+
+        auto start = std::chrono::steady_clock::now();
+        size_t failed = ll_func_lift_batch(mod, cfg, addrs.size(), addrs.data(),
+                                           nullptr, nullptr, threads, nullptr);
+        auto end = std::chrono::steady_clock::now();
+        if (failed) {
+            std::fprintf(stderr, "lifting failed\n");
+            return 1;
+        }
+        double ms = std::chrono::duration<double, std::milli>(end - start).count();
+        std::printf("lift %u funcs, %u threads: %.1f ms\n", opt_funcs, threads,
+                    ms);
+
+        LLVMDisposeModule(mod);
+        LLVMContextDispose(ctx);
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "b:n:j:f:l")) != -1) {
+        switch (opt) {
+        case 'b': opt_blocks = std::atoi(optarg); break;
+        case 'n': opt_rounds = std::atoi(optarg); break;
+        case 'j': opt_threads = std::atoi(optarg); break;
+        case 'f': opt_funcs = std::atoi(optarg); break;
+        case 'l': opt_linear = true; break;
+        default:
+            std::fprintf(stderr, "usage: %s [-b blocks] [-n rounds] [-l] "
+                         "[-j max_threads [-f funcs]]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    std::vector<uint8_t> code = CreateCode(opt_blocks);
+
+    if (opt_threads) {
+        LLConfig* cfg = ll_config_new();
+        ll_config_set_architecture(cfg, "x86-64");
+        int ret = BenchBatch(code, cfg);
+        ll_config_free(cfg);
+        return ret;
+    }
+
+    LLVMContextRef ctx = LLVMContextCreate();
+    LLConfig* cfg = ll_config_new();
+    ll_config_set_architecture(cfg, "x86-64");
+
+    size_t allocs = 0;
+    double us = 0;
+    for (unsigned i = 0; i < opt_rounds; i++) {
+        LLVMModuleRef mod = LLVMModuleCreateWithNameInContext("bench", ctx);
+
+        size_t start_allocs = alloc_count;
+        auto start = std::chrono::steady_clock::now();
+        LLFunc* fn = ll_func_new(mod, cfg);
+        uintptr_t entry = reinterpret_cast<uintptr_t>(code.data());
+        int decode_err;
+        if (opt_linear) {
+            LLMemRegion region = {entry, code.data(), code.size()};
+            decode_err = ll_func_decode_linear(fn, entry, 1, &region, nullptr,
+                                               nullptr);
+        } else {
+            decode_err = ll_func_decode_cfg(fn, entry, nullptr, nullptr);
+        }
+        if (decode_err || !ll_func_lift(fn)) {
+            std::fprintf(stderr, "lifting failed\n");
+            return 1;
+        }
+        ll_func_dispose(fn);
+        auto end = std::chrono::steady_clock::now();
+        allocs += alloc_count - start_allocs;
+        us += std::chrono::duration<double, std::micro>(end - start).count();
+
+        LLVMDisposeModule(mod);
+    }
+
+    ll_config_free(cfg);
+    LLVMContextDispose(ctx);
+
+    std::printf("lift %u blocks%s: %.1f allocs/func, %.1f us/func\n", opt_blocks,
+                opt_linear ? " (linear)" : "", double(allocs) / opt_rounds, us / opt_rounds);
+    return 0;
+}
@@ -0,0 +1,123 @@
+
+#include "arch.h"
+#include "facet.h"
+#include "regfile.h"
+
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+
+using rellume::ArchReg;
+using rellume::Facet;
+
+static unsigned opt_rounds = 2000;
+
+// Typical access pattern of a lifter: registers are written once and read
+// several times, in the native facet and in some sub-facets. Only few reads
+// create new instructions, so that the register file itself dominates.
+static size_t RunRound(llvm::Function* fn, rellume::Arch arch, unsigned ngp,
+                       unsigned nvec, Facet ivec) {
+    llvm::LLVMContext& ctx = fn->getContext();
+    llvm::BasicBlock* bb = llvm::BasicBlock::Create(ctx, "", fn);
+    llvm::BumpPtrAllocator alloc;
+    rellume::RegFile regfile(arch, alloc);
+    regfile.SetInsertBlock(bb);
+
+    llvm::Type* i64 = llvm::Type::getInt64Ty(ctx);
+    llvm::Type* i1 = llvm::Type::getInt1Ty(ctx);
+    llvm::Value* vec_val = llvm::UndefValue::get(ivec.Type(ctx));
+
+    size_t ops = 0;
+    llvm::Value* ip = llvm::ConstantInt::get(i64, 0);
+    regfile.SetReg(ArchReg::IP, Facet::I64, ip, false);
+    for (unsigned i = 0; i < 8; i++) {
+        for (unsigned r = 0; r < ngp; r++) {
+            llvm::Value* val = llvm::ConstantInt::get(i64, i * ngp + r);
+            regfile.SetReg(ArchReg::GP(r), Facet::I64, val, true);
+            for (unsigned j = 0; j < 4; j++) {
+                regfile.GetReg(ArchReg::GP(r), Facet::I64);
+                regfile.GetReg(ArchReg::GP(r), Facet::I32);
+            }
+            ops += 9;
+        }
+        for (unsigned r = 0; r < nvec; r++) {
+            regfile.SetReg(ArchReg::VEC(r), ivec, vec_val, true);
+            for (unsigned j = 0; j < 4; j++)
+                regfile.GetReg(ArchReg::VEC(r), ivec);
+            ops += 5;
+        }
+        for (Facet flag : {Facet::ZF, Facet::SF, Facet::CF, Facet::OF}) {
+            llvm::Value* val = llvm::ConstantInt::get(i1, i & 1);
+            regfile.SetReg(ArchReg::EFLAGS, flag, val, false);
+            for (unsigned j = 0; j < 4; j++)
+                regfile.GetReg(ArchReg::EFLAGS, flag);
+            ops += 5;
+        }
+        regfile.GetReg(ArchReg::IP, Facet::I64);
+        ops += 1;
+    }
+
+    bb->eraseFromParent();
+    return ops;
+}
+
+int main(int argc, char** argv) {
+    const char* arch_name = "x86_64";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "A:n:")) != -1) {
+        switch (opt) {
+        case 'A': arch_name = optarg; break;
+        case 'n': opt_rounds = std::atoi(optarg); break;
+        default:
+            std::fprintf(stderr, "usage: %s [-A arch] [-n rounds]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    rellume::Arch arch = rellume::Arch::INVALID;
+    unsigned ngp = 32, nvec = 32;
+    Facet ivec = Facet::V2I64;
+#ifdef RELLUME_WITH_X86_64
+    if (!std::strcmp(arch_name, "x86_64"))
+        arch = rellume::Arch::X86_64, ngp = 16, nvec = 16;
+#endif // RELLUME_WITH_X86_64
+#ifdef RELLUME_WITH_RV64
+    if (!std::strcmp(arch_name, "rv64"))
+        arch = rellume::Arch::RV64, ivec = Facet::I64;
+#endif // RELLUME_WITH_RV64
+#ifdef RELLUME_WITH_AARCH64
+    if (!std::strcmp(arch_name, "aarch64"))
+        arch = rellume::Arch::AArch64;
+#endif // RELLUME_WITH_AARCH64
+    if (arch == rellume::Arch::INVALID) {
+        std::fprintf(stderr, "unsupported architecture %s\n", arch_name);
+        return 1;
+    }
+
+    llvm::LLVMContext ctx;
+    llvm::Module mod("bench_regfile", ctx);
+    auto fn_ty = llvm::FunctionType::get(llvm::Type::getVoidTy(ctx), false);
+    auto fn = llvm::Function::Create(fn_ty, llvm::GlobalValue::ExternalLinkage,
+                                     "bench", &mod);
+
+    size_t ops = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < opt_rounds; i++)
+        ops += RunRound(fn, arch, ngp, nvec, ivec);
+    auto end = std::chrono::steady_clock::now();
+
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    std::printf("regfile %s: %zu ops, %.2f ns/op\n", arch_name, ops, ns / ops);
+    return 0;
+}
@@ -1,12 +1,26 @@
 
 #include <rellume/rellume.h>
 
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Analysis/ScopedNoAliasAA.h>
+#include <llvm/Analysis/ValueTracking.h>
 #include <llvm/ExecutionEngine/ExecutionEngine.h>
 #include <llvm/ExecutionEngine/GenericValue.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Module.h>
+#include <llvm/Support/Regex.h>
 #include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Transforms/Scalar/GVN.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/FunctionComparator.h>
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdio>
 #include <cstring>
@@ -30,6 +44,12 @@
 static bool opt_verbose = false;
 static bool opt_jit = false;
 static bool opt_overflow_intrinsics = false;
+static bool opt_mem_regions = false;
+static bool opt_linear = false;
+static bool opt_indirect_switch = false;
+static bool opt_stack_promotion = false;
+static bool opt_cpu_struct_noalias = false;
+static bool opt_batch = false;
 static const char* opt_arch = "x86_64";
 
 struct HexBuffer {
@@ -57,6 +77,17 @@ class TestCase {
     const std::unordered_map<std::string,RegEntry>* regs;
     std::ostringstream& diagnostic;
     std::vector<std::pair<void*, size_t>> mem_maps;
+    // Declared functions implemented natively (JIT only).
+    std::vector<std::pair<llvm::Function*, void*>> native_fns;
+    // Constant memory read through the callback, see ReadConstMem.
+    uintptr_t const_mem_cb_addr = 0;
+    std::vector<uint8_t> const_mem_cb_bytes;
+    // Call the lifted function through a native wrapper, see WrapNative.
+    bool wrap_native = false;
+    // Extension attribute of the first wrapper parameter, which is an i8.
+    llvm::Attribute::AttrKind wrap_native_ext = llvm::Attribute::None;
+    // Offsets of the registers passed as parameters, see WrapRegCallConv.
+    std::vector<size_t> reg_callconv;
 
     TestCase(std::ostringstream& diagnostic) : diagnostic(diagnostic) {
         static std::unordered_map<std::string,RegEntry> regs_empty = {};
@@ -181,6 +212,365 @@ class TestCase {
         return std::make_pair(key_str, value_str);
     }
 
+    static uint64_t RepneScasb(const uint8_t* di, uint8_t al, uint64_t count) {
+        auto match = static_cast<const uint8_t*>(std::memchr(di, al, count));
+        return match ? match - di + 1 : count;
+    }
+
+    static uint64_t RepeCmpsb(const uint8_t* si, const uint8_t* di,
+                              uint64_t count) {
+        for (uint64_t i = 0; i < count; i++)
+            if (si[i] != di[i])
+                return i + 1;
+        return count;
+    }
+
+    llvm::Function* DeclareNative(llvm::Module* mod, llvm::FunctionType* fn_ty,
+                                  const char* name, void* impl) {
+        auto fn = llvm::Function::Create(fn_ty, llvm::GlobalValue::ExternalLinkage,
+                                         name, mod);
+        native_fns.push_back(std::make_pair(fn, impl));
+        return fn;
+    }
+
+    static std::vector<uint8_t> ParseHex(std::string hex_str) {
+        std::vector<uint8_t> bytes(hex_str.length() / 2);
+        for (size_t i = 0; i < bytes.size(); i++) {
+            char hex_byte[3] = {hex_str[i*2], hex_str[i*2+1], 0};
+            bytes[i] = std::strtoul(hex_byte, nullptr, 16);
+        }
+        return bytes;
+    }
+
+    static size_t ReadConstMem(size_t addr, uint8_t* buf, size_t size,
+                               void* user_arg) {
+        auto test_case = static_cast<TestCase*>(user_arg);
+        const auto& bytes = test_case->const_mem_cb_bytes;
+        size_t off = addr - test_case->const_mem_cb_addr;
+        if (off >= bytes.size())
+            return 0;
+        size_t copied = std::min(size, bytes.size() - off);
+        std::memcpy(buf, bytes.data() + off, copied);
+        return copied;
+    }
+
+    static size_t ReadMappedMem(size_t addr, uint8_t* buf, size_t size,
+                                void* user_arg) {
+        auto test_case = static_cast<TestCase*>(user_arg);
+        for (const auto& map : test_case->mem_maps) {
+            size_t off = addr - reinterpret_cast<uintptr_t>(map.first);
+            if (off >= map.second)
+                continue;
+            size_t copied = std::min(size, map.second - off);
+            std::memcpy(buf, static_cast<const uint8_t*>(map.first) + off, copied);
+            return copied;
+        }
+        return 0;
+    }
+
+    // Lift the entry twice together with the unmapped address zero using
+    // ll_func_lift_batch and check the result against ll_func_lift.
+    bool LiftBatch(uintptr_t entry, LLConfig* rlcfg, llvm::Module* mod,
+                   LLVMValueRef* fn_wrap) {
+        LLFunc* ref = ll_func_new(llvm::wrap(mod), rlcfg);
+        LLVMValueRef ref_fn = nullptr;
+        if (!ll_func_decode_cfg(ref, entry, ReadMappedMem, this))
+            ref_fn = ll_func_lift(ref);
+        ll_func_dispose(ref);
+
+        uintptr_t addrs[] = {entry, 0, entry};
+        LLVMValueRef fns[3];
+        size_t failed = ll_func_lift_batch(llvm::wrap(mod), rlcfg, 3, addrs,
+                                           ReadMappedMem, this, 2, fns);
+        if (failed != (ref_fn ? 1 : 3) || fns[1] ||
+            (!fns[0] != !ref_fn) || (!fns[2] != !ref_fn)) {
+            diagnostic << "# batch lifting failed for " << failed << " functions" << std::endl;
+            return true;
+        }
+        *fn_wrap = fns[0];
+        if (!ref_fn)
+            return false;
+
+        llvm::GlobalNumberState global_numbers;
+        for (LLVMValueRef fn : {fns[0], fns[2]}) {
+            llvm::FunctionComparator cmp(llvm::unwrap<llvm::Function>(fn),
+                                         llvm::unwrap<llvm::Function>(ref_fn),
+                                         &global_numbers);
+            if (cmp.compare()) {
+                diagnostic << "# batch lifting differs from ll_func_lift" << std::endl;
+                return true;
+            }
+        }
+        llvm::unwrap<llvm::Function>(fns[2])->eraseFromParent();
+        llvm::unwrap<llvm::Function>(ref_fn)->eraseFromParent();
+        return false;
+    }
+
+    static llvm::Value* RegPtr(llvm::IRBuilder<>& irb, llvm::Value* cpu,
+                               size_t offset) {
+        llvm::Value* ptr = irb.CreateConstGEP1_64(irb.getInt8Ty(), cpu, offset);
+        return irb.CreatePointerCast(ptr, irb.getInt64Ty()->getPointerTo());
+    }
+
+    // Collect the CPU struct offsets of a comma-separated register list.
+    bool RegOffsets(std::string reg_list, std::vector<size_t>& offsets) {
+        std::istringstream reg_stream(reg_list);
+        std::string reg;
+        while (std::getline(reg_stream, reg, ',')) {
+            auto reg_entry = regs->find(reg);
+            if (reg_entry == regs->end()) {
+                diagnostic << "# invalid register: " << reg << std::endl;
+                return true;
+            }
+            offsets.push_back(reg_entry->second.offset);
+        }
+        return false;
+    }
+
+    // Apply a configuration option of the test case (+name[=value]).
+    bool ApplyOption(std::string opt, LLConfig* rlcfg, llvm::Module* mod) {
+        llvm::LLVMContext& ctx = mod->getContext();
+        llvm::Type* i8 = llvm::Type::getInt8Ty(ctx);
+        llvm::Type* i64 = llvm::Type::getInt64Ty(ctx);
+        llvm::Type* i8p = llvm::Type::getInt8PtrTy(ctx);
+        if (opt == "scasb_func") {
+            auto fn_ty = llvm::FunctionType::get(i64, {i8p, i8, i64}, false);
+            void* impl = reinterpret_cast<void*>(&RepneScasb);
+            auto fn = DeclareNative(mod, fn_ty, "repne_scasb", impl);
+            ll_config_set_repne_scasb_func(rlcfg, llvm::wrap(fn));
+        } else if (opt == "cmpsb_func") {
+            auto fn_ty = llvm::FunctionType::get(i64, {i8p, i8p, i64}, false);
+            void* impl = reinterpret_cast<void*>(&RepeCmpsb);
+            auto fn = DeclareNative(mod, fn_ty, "repe_cmpsb", impl);
+            ll_config_set_repe_cmpsb_func(rlcfg, llvm::wrap(fn));
+        } else if (opt.substr(0, 15) == "known_function=") {
+            // Lift the code at the address as separate function first.
+            uintptr_t addr = std::stoul(opt.substr(15), nullptr, 0);
+            LLFunc* known = ll_func_new(llvm::wrap(mod), rlcfg);
+            LLVMValueRef known_fn = nullptr;
+            if (!ll_func_decode_cfg(known, addr, nullptr, nullptr))
+                known_fn = ll_func_lift(known);
+            ll_func_dispose(known);
+            if (!known_fn) {
+                diagnostic << "# error lifting known function" << std::endl;
+                return true;
+            }
+            llvm::unwrap<llvm::Function>(known_fn)->setName("known_function");
+            ll_config_add_known_function(rlcfg, addr, known_fn);
+        } else if (opt.substr(0, 16) == "indirect_target=") {
+            // indirect_target=<branch addr>:<target addr>
+            size_t sep = opt.find(':');
+            if (sep == std::string::npos) {
+                diagnostic << "# invalid option: " << opt << std::endl;
+                return true;
+            }
+            uintptr_t branch = std::stoul(opt.substr(16, sep - 16), nullptr, 0);
+            uintptr_t target = std::stoul(opt.substr(sep + 1), nullptr, 0);
+            ll_config_add_indirect_branch_target(rlcfg, branch, target);
+        } else if (opt.substr(0, 13) == "reg_callconv=") {
+            if (RegOffsets(opt.substr(13), reg_callconv))
+                return true;
+            if (!ll_config_set_reg_callconv(rlcfg, reg_callconv.size(),
+                                            reg_callconv.data())) {
+                diagnostic << "# invalid option: " << opt << std::endl;
+                return true;
+            }
+        } else if (opt.substr(0, 18) == "cpu_struct_layout=") {
+            // cpu_struct_layout=<reg>:<slot>,... places each register at the
+            // default offset of the register slot.
+            std::istringstream entry_stream(opt.substr(18));
+            std::string entry_str;
+            std::vector<LLCpuStructEntry> entries;
+            while (std::getline(entry_stream, entry_str, ',')) {
+                size_t sep = entry_str.find(':');
+                std::vector<size_t> offsets;
+                if (sep == std::string::npos ||
+                    RegOffsets(entry_str.substr(0, sep), offsets) ||
+                    RegOffsets(entry_str.substr(sep + 1), offsets)) {
+                    diagnostic << "# invalid option: " << opt << std::endl;
+                    return true;
+                }
+                size_t size = regs->at(entry_str.substr(0, sep)).size;
+                entries.push_back({offsets[0], offsets[1], size});
+            }
+            if (!ll_config_set_cpu_struct_layout(rlcfg, entries.size(), entries.data())) {
+                diagnostic << "# invalid option: " << opt << std::endl;
+                return true;
+            }
+        } else if (opt.substr(0, 13) == "reg_constant=") {
+            // reg_constant=<reg>:<value>
+            size_t sep = opt.find(':');
+            if (sep == std::string::npos) {
+                diagnostic << "# invalid option: " << opt << std::endl;
+                return true;
+            }
+            std::string reg = opt.substr(13, sep - 13);
+            uint64_t value = std::stoull(opt.substr(sep + 1), nullptr, 0);
+            if (!ll_config_set_reg_constant(rlcfg, reg.c_str(), value)) {
+                diagnostic << "# invalid option: " << opt << std::endl;
+                return true;
+            }
+        } else if (opt.substr(0, 13) == "const_memory=") {
+            // const_memory=<addr>:<hex bytes>
+            size_t sep = opt.find(':');
+            if (sep == std::string::npos) {
+                diagnostic << "# invalid option: " << opt << std::endl;
+                return true;
+            }
+            uintptr_t addr = std::stoul(opt.substr(13, sep - 13), nullptr, 0);
+            std::vector<uint8_t> bytes = ParseHex(opt.substr(sep + 1));
+            ll_config_add_const_memory(rlcfg, addr, bytes.size(), bytes.data());
+        } else if (opt.substr(0, 16) == "const_memory_cb=") {
+            // const_memory_cb=<addr>:<hex bytes>, read through the callback
+            size_t sep = opt.find(':');
+            if (sep == std::string::npos) {
+                diagnostic << "# invalid option: " << opt << std::endl;
+                return true;
+            }
+            const_mem_cb_addr = std::stoul(opt.substr(16, sep - 16), nullptr, 0);
+            const_mem_cb_bytes = ParseHex(opt.substr(sep + 1));
+            ll_config_set_const_memory_cb(rlcfg, ReadConstMem, this);
+        } else if (opt == "cpu_struct_noalias=0" || opt == "cpu_struct_noalias=1") {
+            ll_config_enable_cpu_struct_noalias(rlcfg, opt.back() == '1');
+        } else if (opt == "pic") {
+            ll_config_set_position_independent_code(rlcfg, true);
+        } else if (opt.substr(0, 13) == "data_section=") {
+            // data_section=<addr>:<hex bytes>, as initializer of an i64 array
+            size_t sep = opt.find(':');
+            std::vector<uint8_t> bytes;
+            if (sep != std::string::npos)
+                bytes = ParseHex(opt.substr(sep + 1));
+            if (bytes.empty() || bytes.size() % 8) {
+                diagnostic << "# invalid option: " << opt << std::endl;
+                return true;
+            }
+            uintptr_t addr = std::stoul(opt.substr(13, sep - 13), nullptr, 0);
+            std::vector<uint64_t> elems(bytes.size() / 8);
+            std::memcpy(elems.data(), bytes.data(), bytes.size());
+            auto init = llvm::ConstantDataArray::get(ctx, elems);
+            auto global = new llvm::GlobalVariable(*mod, init->getType(), false,
+                                                   llvm::GlobalValue::ExternalLinkage,
+                                                   init, "data_section");
+            ll_config_add_data_section(rlcfg, addr, bytes.size(), llvm::wrap(global));
+        } else if (opt == "syscall_impl") {
+            // The syscall sets the result register to the first argument + 1
+            // (rax = rdi + 1 on x86-64), through the CPU struct.
+            const char* arg_reg = "rdi";
+            const char* res_reg = "rax";
+            if (!strcmp(opt_arch, "aarch64"))
+                arg_reg = res_reg = "x0";
+            else if (!strcmp(opt_arch, "rv64"))
+                arg_reg = res_reg = "x10";
+            auto fn_ty = llvm::FunctionType::get(llvm::Type::getVoidTy(ctx),
+                                                 {i8p}, false);
+            auto fn = llvm::Function::Create(fn_ty, llvm::GlobalValue::ExternalLinkage,
+                                             "syscall_impl", mod);
+            llvm::IRBuilder<> irb(llvm::BasicBlock::Create(ctx, "", fn));
+            llvm::Value* cpu = &fn->arg_begin()[0];
+            llvm::Value* arg = irb.CreateLoad(i64, RegPtr(irb, cpu, regs->at(arg_reg).offset));
+            irb.CreateStore(irb.CreateAdd(arg, irb.getInt64(1)),
+                            RegPtr(irb, cpu, regs->at(res_reg).offset));
+            irb.CreateRetVoid();
+            ll_config_set_syscall_impl(rlcfg, llvm::wrap(fn));
+        } else if (opt == "wrap_native") {
+            wrap_native = true;
+        } else if (opt == "wrap_native=signext" || opt == "wrap_native=zeroext") {
+            wrap_native = true;
+            wrap_native_ext = opt == "wrap_native=signext" ? llvm::Attribute::SExt
+                                                           : llvm::Attribute::ZExt;
+        } else if (opt.substr(0, 8) == "live_in=" || opt.substr(0, 9) == "live_out=") {
+            // live_in=<reg>,... and live_out=<reg>,...
+            bool is_live_in = opt.substr(0, 8) == "live_in=";
+            std::vector<size_t> offsets;
+            if (RegOffsets(opt.substr(is_live_in ? 8 : 9), offsets))
+                return true;
+            bool ok = is_live_in
+                    ? ll_config_set_live_in(rlcfg, offsets.size(), offsets.data())
+                    : ll_config_set_live_out(rlcfg, offsets.size(), offsets.data());
+            if (!ok) {
+                diagnostic << "# invalid option: " << opt << std::endl;
+                return true;
+            }
+        } else {
+            diagnostic << "# invalid option: " << opt << std::endl;
+            return true;
+        }
+        return false;
+    }
+
+    // Create a function taking only the CPU struct, which passes the registers
+    // of the register calling convention to fn and stores its return values.
+    llvm::Function* WrapRegCallConv(llvm::Function* fn) {
+        llvm::LLVMContext& ctx = fn->getContext();
+        auto fn_ty = llvm::FunctionType::get(llvm::Type::getVoidTy(ctx),
+                                             {llvm::Type::getInt8PtrTy(ctx)}, false);
+        auto entry = llvm::Function::Create(fn_ty, llvm::GlobalValue::ExternalLinkage,
+                                            "test_entry", fn->getParent());
+        llvm::IRBuilder<> irb(llvm::BasicBlock::Create(ctx, "", entry));
+        llvm::Value* cpu = &entry->arg_begin()[0];
+        llvm::SmallVector<llvm::Value*, 8> args{cpu};
+        for (size_t offset : reg_callconv)
+            args.push_back(irb.CreateLoad(irb.getInt64Ty(), RegPtr(irb, cpu, offset)));
+        llvm::CallInst* ret = irb.CreateCall(fn->getFunctionType(), fn, args);
+        ret->setCallingConv(fn->getCallingConv());
+        for (unsigned i = 0; i < reg_callconv.size(); i++)
+            irb.CreateStore(irb.CreateExtractValue(ret, {i}),
+                            RegPtr(irb, cpu, reg_callconv[i]));
+        irb.CreateRetVoid();
+        return entry;
+    }
+
+    // Integer arguments of the native wrapper, taken from the initial state.
+    static constexpr const char* native_args[] = {
+        "rdi", "rsi", "rdx", "rcx", "r8", "r9",
+    };
+    using NativeFn = uint64_t(uint64_t, uint64_t, uint64_t, uint64_t,
+                              uint64_t, uint64_t);
+
+    // Create a wrapper with the signature NativeFn for the lifted function.
+    // With wrap_native_ext, the first parameter is an i8 with the attribute,
+    // declared before creating the wrapper.
+    llvm::Function* WrapNative(llvm::Function* fn, uintptr_t entry) {
+        llvm::Type* i64 = llvm::Type::getInt64Ty(fn->getContext());
+        llvm::SmallVector<llvm::Type*, 6> params(6, i64);
+        if (wrap_native_ext != llvm::Attribute::None)
+            params[0] = llvm::Type::getInt8Ty(fn->getContext());
+        auto fn_ty = llvm::FunctionType::get(i64, params, false);
+        if (wrap_native_ext != llvm::Attribute::None) {
+            auto decl = llvm::Function::Create(fn_ty, llvm::GlobalValue::ExternalLinkage,
+                                               "test_wrapper", fn->getParent());
+            decl->addParamAttr(0, wrap_native_ext);
+        }
+        LLVMValueRef wrapper = ll_func_wrap_native(llvm::wrap(fn), llvm::wrap(fn_ty),
+                                                   entry, 4096, "test_wrapper");
+        return wrapper ? llvm::unwrap<llvm::Function>(wrapper) : nullptr;
+    }
+
+    // Call the native wrapper with the argument registers of the state and
+    // place the result in rax. The state is otherwise unmodified.
+    void RunNative(llvm::ExecutionEngine* engine, llvm::Function* wrapper,
+                   CPU* state) {
+        uint64_t args[6];
+        for (size_t i = 0; i < 6; i++)
+            std::memcpy(&args[i], reinterpret_cast<uint8_t*>(state) +
+                        regs->at(native_args[i]).offset, sizeof(uint64_t));
+
+        uint64_t ret;
+        if (auto raw_ptr = engine->getFunctionAddress(wrapper->getName().str())) {
+            auto fn_ptr = reinterpret_cast<NativeFn*>(raw_ptr);
+            ret = fn_ptr(args[0], args[1], args[2], args[3], args[4], args[5]);
+        } else {
+            std::vector<llvm::GenericValue> gv_args(6);
+            for (size_t i = 0; i < 6; i++) {
+                llvm::Type* arg_ty = wrapper->getFunctionType()->getParamType(i);
+                gv_args[i].IntVal = llvm::APInt(arg_ty->getIntegerBitWidth(), args[i]);
+            }
+            ret = engine->runFunction(wrapper, gv_args).IntVal.getZExtValue();
+        }
+        std::memcpy(reinterpret_cast<uint8_t*>(state) + regs->at("rax").offset,
+                    &ret, sizeof(uint64_t));
+    }
+
     template<typename T>
     void Randomize(T& t) {
         using bytes_randomizer = std::independent_bits_engine<std::mt19937, CHAR_BIT, uint8_t>;
@@ -192,12 +582,68 @@ class TestCase {
             ptr[i] = rand_bytes();
     }
 
+    // Run GVN with alias scopes on fn and count the remaining loads which are
+    // not from the CPU struct or other arguments, i.e. from guest memory.
+    static unsigned GuestLoadsAfterGVN(llvm::Function* fn) {
+        llvm::legacy::FunctionPassManager fpm(fn->getParent());
+        fpm.add(llvm::createScopedNoAliasAAWrapperPass());
+        fpm.add(llvm::createGVNPass());
+        fpm.doInitialization();
+        fpm.run(*fn);
+        fpm.doFinalization();
+
+        unsigned loads = 0;
+        for (llvm::BasicBlock& bb : *fn) {
+            for (llvm::Instruction& inst : bb) {
+                auto load = llvm::dyn_cast<llvm::LoadInst>(&inst);
+                if (!load)
+                    continue;
+#if LL_LLVM_MAJOR >= 12
+                llvm::Value* obj = llvm::getUnderlyingObject(load->getPointerOperand());
+#else
+                const llvm::DataLayout& dl = fn->getParent()->getDataLayout();
+                llvm::Value* obj = llvm::GetUnderlyingObject(load->getPointerOperand(), dl);
+#endif
+                if (!llvm::isa<llvm::Argument>(obj))
+                    loads++;
+            }
+        }
+        return loads;
+    }
+
+    static bool EmitAssembly(llvm::Module& mod, llvm::TargetOptions options,
+                             llvm::SmallVectorImpl<char>& buf) {
+        // Use the same target configuration as the JIT.
+        llvm::EngineBuilder builder;
+        builder.setOptLevel(llvm::CodeGenOpt::None);
+        builder.setTargetOptions(options);
+        std::unique_ptr<llvm::TargetMachine> tm(builder.selectTarget());
+        if (!tm)
+            return false;
+
+        std::unique_ptr<llvm::Module> clone = llvm::CloneModule(mod);
+        clone->setDataLayout(tm->createDataLayout());
+        llvm::legacy::PassManager pm;
+        llvm::raw_svector_ostream os(buf);
+        if (tm->addPassesToEmitFile(pm, os, nullptr, llvm::CGFT_AssemblyFile))
+            return false;
+        pm.run(*clone);
+        return true;
+    }
+
     bool Run(std::string argstring) {
         std::istringstream argstream(argstring);
         std::string arg;
         bool fail = false;
         bool should_pass = true;
         bool use_jit = opt_jit;
+        bool use_linear = opt_linear;
+        // Regular expressions which must (or must not) match the generated
+        // assembly (JIT only).
+        std::vector<std::pair<std::string, bool>> asm_checks;
+        // Expected number of guest memory loads after GVN, or -1 to not check.
+        int gvn_guest_loads = -1;
+        std::vector<std::string> cfg_options;
 
         // 1. Setup initial state
         CPU initial{};
@@ -210,6 +656,16 @@ class TestCase {
                 use_jit = true;
             } else if (arg == "-jit") {
                 use_jit = false;
+            } else if (arg == "+linear") {
+                use_linear = true;
+            } else if (arg.substr(0, 5) == "+asm=") {
+                asm_checks.push_back(std::make_pair(arg.substr(5), true));
+            } else if (arg.substr(0, 7) == "+noasm=") {
+                asm_checks.push_back(std::make_pair(arg.substr(7), false));
+            } else if (arg.substr(0, 17) == "+gvn_guest_loads=") {
+                gvn_guest_loads = std::stoi(arg.substr(17));
+            } else if (arg.substr(0, 1) == "+") {
+                cfg_options.push_back(arg.substr(1));
             } else if (arg.substr(0, 1) == "~") {
                 continue;
             } else if (arg == "=>") {
@@ -239,15 +695,54 @@ class TestCase {
         LLConfig* rlcfg = ll_config_new();
         ll_config_enable_verify_ir(rlcfg, true);
         ll_config_enable_overflow_intrinsics(rlcfg, opt_overflow_intrinsics);
+        ll_config_enable_indirect_branch_switch(rlcfg, opt_indirect_switch);
+        ll_config_enable_stack_promotion(rlcfg, opt_stack_promotion);
+        ll_config_enable_cpu_struct_noalias(rlcfg, opt_cpu_struct_noalias);
         bool success = ll_config_set_architecture(rlcfg, opt_arch);
         if (!success) {
             diagnostic << "# error: unsupported architecture" << std::endl;
             return true;
         }
+        for (const auto& option : cfg_options)
+            if (ApplyOption(option, rlcfg, mod.get()))
+                return true;
 
         LLFunc* rlfn = ll_func_new(llvm::wrap(mod.get()), rlcfg);
-        bool decode_ok = !ll_func_decode_cfg(rlfn, *reinterpret_cast<uint64_t*>(&state.rip), nullptr, nullptr);
-        LLVMValueRef fn_wrap = decode_ok ? ll_func_lift(rlfn) : nullptr;
+        uintptr_t entry = *reinterpret_cast<uint64_t*>(&state.rip);
+        LLVMValueRef fn_wrap = nullptr;
+        bool decode_ok;
+        if (use_linear) {
+            // Sweep over the mapping containing the code. Unless the case
+            // requires it (+linear), this must give the same result as
+            // following the control flow.
+            LLMemRegion code_region{};
+            for (auto& map : mem_maps) {
+                uintptr_t map_addr = reinterpret_cast<uintptr_t>(map.first);
+                if (entry - map_addr < map.second)
+                    code_region = {map_addr, reinterpret_cast<const uint8_t*>(map.first), map.second};
+            }
+            decode_ok = !ll_func_decode_linear(rlfn, entry, 1, &code_region, nullptr, nullptr);
+        } else if (opt_batch) {
+            if (LiftBatch(entry, rlcfg, mod.get(), &fn_wrap)) {
+                ll_func_dispose(rlfn);
+                ll_config_free(rlcfg);
+                return true;
+            }
+            // Decode and lift errors are not distinguished.
+            decode_ok = fn_wrap != nullptr;
+        } else if (opt_mem_regions) {
+            // Decode only from the mapped memory, without callback.
+            std::vector<LLMemRegion> regions;
+            for (auto& map : mem_maps) {
+                auto buf = reinterpret_cast<const uint8_t*>(map.first);
+                regions.push_back({reinterpret_cast<uintptr_t>(buf), buf, map.second});
+            }
+            decode_ok = !ll_func_decode_cfg_range(rlfn, entry, regions.size(), regions.data(), nullptr, nullptr);
+        } else {
+            decode_ok = !ll_func_decode_cfg(rlfn, entry, nullptr, nullptr);
+        }
+        if (decode_ok && !fn_wrap)
+            fn_wrap = ll_func_lift(rlfn);
 
         ll_func_dispose(rlfn);
         ll_config_free(rlcfg);
@@ -263,14 +758,51 @@ class TestCase {
 
         llvm::Function* fn = llvm::unwrap<llvm::Function>(fn_wrap);
         fn->setName("test_function");
+        llvm::Function* wrapper = nullptr;
+        if (wrap_native) {
+            wrapper = WrapNative(fn, entry);
+            if (!wrapper) {
+                diagnostic << "# error creating native wrapper" << std::endl;
+                return true;
+            }
+        }
+        if (gvn_guest_loads >= 0) {
+            unsigned loads = GuestLoadsAfterGVN(fn);
+            if (loads != static_cast<unsigned>(gvn_guest_loads)) {
+                fail = true;
+                diagnostic << "# guest loads after GVN: " << loads << std::endl;
+            }
+        }
         if (opt_verbose)
             fn->print(llvm::errs());
+        // Run the lifted function through an entry with the CPU struct only.
+        if (!reg_callconv.empty())
+            fn = WrapRegCallConv(fn);
 
         std::string error;
 
         llvm::TargetOptions options;
         options.EnableFastISel = true;
 
+        // Check the machine code, e.g. for instructions with hints which would
+        // be lost when lifted without the corresponding metadata.
+        if (use_jit && !asm_checks.empty()) {
+            llvm::SmallString<4096> asm_buf;
+            if (!EmitAssembly(*mod, options, asm_buf)) {
+                diagnostic << "# error emitting assembly" << std::endl;
+                return true;
+            }
+            llvm::StringRef asm_str = asm_buf.str();
+            for (const auto& [check, must_match] : asm_checks) {
+                if (llvm::Regex(check).match(asm_str) != must_match) {
+                    fail = true;
+                    diagnostic << (must_match ? "# not in assembly: "
+                                              : "# in assembly: ")
+                               << check << std::endl;
+                }
+            }
+        }
+
         llvm::EngineBuilder builder(std::move(mod));
         // There are two options: "Interpreter" and "JIT". Because we execute
         // the code once only, the interpreter is usually faster (even compared
@@ -284,10 +816,14 @@ class TestCase {
         builder.setTargetOptions(options);
 
         if (llvm::ExecutionEngine* engine = builder.create()) {
+            for (const auto& [native_fn, impl] : native_fns)
+                engine->addGlobalMapping(native_fn, impl);
             // If we have a JIT compiler, get address of compiled code.
             // Otherwise try to run the function using the interpreter.
             const auto& name = fn->getName();
-            if (auto raw_ptr = engine->getFunctionAddress(name.str())) {
+            if (wrapper)
+                RunNative(engine, wrapper, &state);
+            else if (auto raw_ptr = engine->getFunctionAddress(name.str())) {
                 auto fn_ptr = reinterpret_cast<void(*)(CPU*)>(raw_ptr);
                 fn_ptr(&state);
             } else {
@@ -355,15 +891,21 @@ public:
 
 int main(int argc, char** argv) {
     int opt;
-    while ((opt = getopt(argc, argv, "vjiA:")) != -1) {
+    while ((opt = getopt(argc, argv, "vjirlspnbA:")) != -1) {
         switch (opt) {
         case 'v': opt_verbose = true; break;
         case 'j': opt_jit = true; break;
         case 'i': opt_overflow_intrinsics = true; break;
+        case 'r': opt_mem_regions = true; break;
+        case 'l': opt_linear = true; break;
+        case 's': opt_indirect_switch = true; break;
+        case 'p': opt_stack_promotion = true; break;
+        case 'n': opt_cpu_struct_noalias = true; break;
+        case 'b': opt_batch = true; break;
         case 'A': opt_arch = optarg; break;
         default:
 usage:
-            std::cerr << "usage: " << argv[0] << " [-v] [-j] [-i] [-A arch] casefile" << std::endl;
+            std::cerr << "usage: " << argv[0] << " [-v] [-j] [-i] [-r] [-l] [-s] [-p] [-n] [-b] [-A arch] casefile" << std::endl;
             return 1;
         }
     }